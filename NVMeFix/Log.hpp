@@ -22,6 +22,9 @@ static constexpr auto Plugin {"nvmef"},
 					 PM {"pm"},
 					 Quirks {"quirks"},
 					 Feature {"feature"},
+					 Thermal {"thermal"},
+					 Health {"health"},
+					 HMB {"hmb"},
 					 Disasm {"disasm"};
 };
 
@@ -18,11 +18,13 @@
 #include <IOKit/IODeviceTreeSupport.h>
 #include <IOKit/pci/IOPCIDevice.h>
 #include <kern/assert.h>
+#include <pexpert/pexpert.h>
 #include <libkern/c++/OSMetaClass.h>
 
 #include <Headers/kern_api.hpp>
 #include <Headers/kern_disasm.hpp>
 #include <Headers/kern_iokit.hpp>
+#include <Headers/kern_time.hpp>
 #include <Headers/hde64.h>
 #include <Headers/kern_util.hpp>
 #include <Headers/plugin_start.hpp>
@@ -140,6 +142,10 @@ bool NVMeFixPlugin::matchingNotificationHandler(void* that, void* , IOService* s
 					ControllerEntry::deleter(entry);
 					break;
 				}
+				if (!plugin->entries.publish(parent, entry)) {
+					DBGLOG(Log::Plugin, "Controller lookup table is full");
+					__atomic_store_n(&plugin->entriesOverflow, true, __ATOMIC_RELAXED);
+				}
 				break;
 			}
 		}
@@ -265,6 +271,26 @@ void NVMeFixPlugin::handleController(ControllerEntry& entry) {
 	entry.quirks = NVMe::quirksForController(entry.controller);
 	propertyFromParent(entry.controller, "ps-max-latency-us", entry.ps_max_latency_us);
 
+	uint32_t policy {static_cast<uint32_t>(entry.apstPolicy)};
+	propertyFromParent(entry.controller, "apst-policy", policy);
+	if (policy <= static_cast<uint32_t>(APST::Policy::CostModel))
+		entry.apstPolicy = static_cast<APST::Policy>(policy);
+	else
+		SYSLOG(Log::APST, "Ignoring unknown apst-policy %u", policy);
+
+	char profile[16] {};
+	auto parent = entry.controller->getParentEntry(gIOServicePlane);
+	auto profileData = parent ? OSDynamicCast(OSData, parent->getProperty("apst-profile")) : nullptr;
+	if (profileData && profileData->getLength() > 0) {
+		lilu_os_memcpy(profile, profileData->getBytesNoCopy(), min(profileData->getLength(),
+																   sizeof(profile) - 1));
+		if (APST::profileForName(profile))
+			entry.apstProfile = APST::profileForName(profile);
+		else
+			SYSLOG(Log::APST, "Ignoring unknown apst-profile %s", profile);
+	}
+	entry.controller->setProperty("apst-profile", entry.apstProfile->name);
+
 	IOBufferMemoryDescriptor* identifyDesc {nullptr};
 
 	if (identify(entry, identifyDesc) != kIOReturnSuccess || !identifyDesc) {
@@ -295,11 +321,51 @@ void NVMeFixPlugin::handleController(ControllerEntry& entry) {
 	DBGLOG(Log::Plugin, "Identified model %s (vid 0x%x)", mn, ctrl->vid);
 #endif
 
+	if (!allocAdminBuffers(entry))
+		DBGLOG(Log::Feature, "Falling back to per-call admin buffers");
+
+	if (!readRegisters(entry))
+		DBGLOG(Log::Feature, "Controller registers are unknown");
+
+	if (!checkKernelArgument("-nvmefnohmb") && !enableHMB(entry, ctrl))
+		DBGLOG(Log::HMB, "Host memory buffer is not enabled");
+
 	if (!enableAPST(entry, ctrl))
 		SYSLOG(Log::APST, "Failed to enable APST");
+	else if (!enableNOPSPM(entry, ctrl))
+		DBGLOG(Log::APST, "Non-operational power state permissive mode is not enabled");
+
+	entry.apstManaged = entry.apste;
+	entry.governed = !entry.apste && checkKernelArgument("-nvmefgov");
 
 	if (!PM.init(entry, ctrl, entry.apste))
 		SYSLOG(Log::PM, "Failed to initialise power management");
+
+	if (!initPeriodic(entry))
+		SYSLOG(Log::Plugin, "Failed to initialise periodic housekeeping");
+	else if (!initAdminQueue(entry))
+		SYSLOG(Log::Feature, "Failed to initialise asynchronous admin commands");
+
+	if (!checkKernelArgument("-nvmefnoirqc") && !initCoalescing(entry))
+		DBGLOG(Log::PM, "Interrupt coalescing is not adapted");
+
+	if (!configureArbitration(entry, ctrl))
+		DBGLOG(Log::Feature, "Arbitration is not configured");
+
+	if (!configureHCTM(entry, ctrl))
+		DBGLOG(Log::Thermal, "Host controlled thermal management is not enabled");
+
+	if (entry.governed && !PM.initGovernor(entry, ctrl))
+		SYSLOG(Log::PM, "Failed to initialise idle governor");
+
+	if (powerBudgetUw && !initBudget(entry, ctrl))
+		SYSLOG(Log::PM, "Failed to apply power budget");
+
+	/* IOPM may have changed the power state while we held the lock */
+	if (__atomic_load_n(&entry.psDeferred, __ATOMIC_RELAXED) && entry.pmOrdinal > 0)
+		PM::applyPowerState(entry, entry.pmOrdinal);
+
+	__atomic_store_n(&entry.pmReady, entry.pm && entry.powerStates, __ATOMIC_RELEASE);
 }
 
 IOReturn NVMeFixPlugin::identify(ControllerEntry& entry, IOBufferMemoryDescriptor*& desc) {
@@ -307,6 +373,7 @@ IOReturn NVMeFixPlugin::identify(ControllerEntry& entry, IOBufferMemoryDescripto
 
 	uint8_t* data {nullptr};
 	bool prepared {false};
+	uint64_t start {0};
 
 	desc = IOBufferMemoryDescriptor::withCapacity(sizeof(NVMe::nvme_id_ctrl), kIODirectionIn);
 
@@ -325,10 +392,13 @@ IOReturn NVMeFixPlugin::identify(ControllerEntry& entry, IOBufferMemoryDescripto
 	}
 	prepared = true;
 
+	start = getCurrentTimeNs();
 	if (kextFuncs.IONVMeController.IssueIdentifyCommandNew.fptr)
 		ret = kextFuncs.IONVMeController.IssueIdentifyCommandNew(entry.controller, desc, 0, false);
 	else
 		ret = kextFuncs.IONVMeController.IssueIdentifyCommand(entry.controller, desc, nullptr, 0);
+	entry.adminLatency.record(NVMe::nvme_admin_identify, NVMe::NVME_ID_CNS_CTRL,
+							  (getCurrentTimeNs() - start) / 1000);
 	if (ret != kIOReturnSuccess) {
 		SYSLOG(Log::Plugin, "issueIdentifyCommand failed");
 		goto fail;
@@ -342,11 +412,137 @@ fail:
 	return ret;
 }
 
+bool NVMeFixPlugin::allocAdminBuffers(ControllerEntry& entry) {
+	const size_t sizes[] {
+		sizeof(NVMe::nvme_id_ctrl),
+		sizeof(NVMe::nvme_smart_log),
+		sizeof(NVMe::nvme_feat_auto_pst)
+	};
+	static_assert(arrsize(sizes) == ControllerEntry::adminBufferCount, "Admin buffer sizes mismatch");
+
+	for (unsigned i = 0; i < arrsize(sizes); i++) {
+		assert(!entry.adminBuffers[i]);
+		auto desc = IOBufferMemoryDescriptor::withCapacity(sizes[i], kIODirectionInOut);
+		if (!desc) {
+			SYSLOG(Log::Feature, "Failed to create admin buffer of %lu bytes", sizes[i]);
+			return false;
+		}
+
+		/* Wired for the lifetime of the entry, so that commands only take nested references */
+		if (desc->prepare() != kIOReturnSuccess) {
+			SYSLOG(Log::Feature, "Failed to prepare admin buffer of %lu bytes", sizes[i]);
+			desc->release();
+			return false;
+		}
+		entry.adminBuffers[i] = desc;
+	}
+
+	return true;
+}
+
+IOBufferMemoryDescriptor* NVMeFixPlugin::adminBuffer(ControllerEntry& entry, size_t size) {
+	int best {-1};
+	for (unsigned i = 0; i < ControllerEntry::adminBufferCount; i++) {
+		auto desc = entry.adminBuffers[i];
+		if (desc && !entry.adminBufferBusy[i] && desc->getCapacity() >= size &&
+			(best < 0 || desc->getCapacity() < entry.adminBuffers[best]->getCapacity()))
+			best = static_cast<int>(i);
+	}
+
+	IOBufferMemoryDescriptor* desc {nullptr};
+	if (best >= 0) {
+		desc = entry.adminBuffers[best];
+		entry.adminBufferBusy[best] = true;
+		entry.adminAllocsAvoided++;
+		desc->setLength(size);
+		desc->retain();
+	} else {
+		desc = IOBufferMemoryDescriptor::withCapacity(size, kIODirectionInOut);
+		if (!desc) {
+			SYSLOG(Log::Feature, "Failed to create admin buffer of %lu bytes", size);
+			return nullptr;
+		}
+	}
+
+	memset(desc->getBytesNoCopy(), '\0', size);
+	return desc;
+}
+
+void NVMeFixPlugin::returnAdminBuffer(ControllerEntry& entry, IOBufferMemoryDescriptor* desc) {
+	for (unsigned i = 0; i < ControllerEntry::adminBufferCount; i++)
+		if (entry.adminBuffers[i] == desc)
+			entry.adminBufferBusy[i] = false;
+	desc->release();
+}
+
 IOReturn NVMeFixPlugin::NVMeFeatures(ControllerEntry& entry, unsigned fid, unsigned* dword11,
 										IOBufferMemoryDescriptor* desc, uint32_t* res, bool set) {
+	NVMe::nvme_common_command cmd {};
+	cmd.opcode = set ? NVMe::nvme_admin_set_features : NVMe::nvme_admin_get_features;
+	cmd.cdw10 = fid;
+	if (dword11)
+		cmd.cdw11 = *dword11;
+
+	auto start = getCurrentTimeNs();
+	auto ret = NVMeAdmin(entry, cmd, desc, res);
+	if (ret != kIOReturnSuccess)
+		return ret;
+
+	if (set)
+		saveFeature(entry, fid, cmd.cdw11);
+
+	/* Power state changes are timed including the admin command overhead */
+	Stats::LatencyHistogram* hist {nullptr};
+	if (fid == NVMe::NVME_FEAT_POWER_MGMT && set)
+		hist = &entry.psSetLatency[cmd.cdw11 & 0x1f];
+	else if (fid == NVMe::NVME_FEAT_POWER_MGMT)
+		hist = &entry.pmGetLatency;
+	else if (fid == NVMe::NVME_FEAT_AUTO_PST)
+		hist = set ? &entry.apstSetLatency : &entry.apstGetLatency;
+	if (hist)
+		hist->record((getCurrentTimeNs() - start) / 1000);
+
+	return ret;
+}
+
+IOReturn NVMeFixPlugin::getLogPage(ControllerEntry& entry, uint8_t lid, IOBufferMemoryDescriptor* desc,
+								   uint32_t nsid) {
+	assert(desc && desc->getLength() >= sizeof(uint32_t));
+
+	return NVMeAdmin(entry, logPageCommand(lid, desc->getLength(), nsid), desc, nullptr);
+}
+
+NVMe::nvme_common_command NVMeFixPlugin::logPageCommand(uint8_t lid, size_t length, uint32_t nsid) {
+	uint32_t numd = static_cast<uint32_t>(length / sizeof(uint32_t)) - 1;
+	NVMe::nvme_common_command cmd {};
+	cmd.opcode = NVMe::nvme_admin_get_log_page;
+	cmd.nsid = nsid;
+	cmd.cdw10 = lid | ((numd & 0xffff) << 16);
+	cmd.cdw11 = numd >> 16;
+	return cmd;
+}
+
+/**
+ * IONVMeFamily only exports builders for Get and Set Features, so other admin commands start as
+ * Get Features, which sets up the request as an admin command with data transfer, and have their
+ * opcode and command dwords replaced afterwards.
+ */
+IOReturn NVMeFixPlugin::NVMeAdmin(ControllerEntry& entry, const NVMe::nvme_common_command& cmd,
+								  IOBufferMemoryDescriptor* desc, uint32_t* res) {
 	auto ret = kIOReturnSuccess;
 
 	bool prepared {false};
+	bool features = cmd.opcode == NVMe::nvme_admin_get_features ||
+		cmd.opcode == NVMe::nvme_admin_set_features;
+	bool logPage = cmd.opcode == NVMe::nvme_admin_get_log_page;
+
+	/* Without permissive mode any admin command moves the controller out of non-operational state */
+	if (PM::idleNonOperational(entry)) {
+		if (entry.nopspm)
+			entry.adminWakeupsAvoided++;
+		else
+			entry.adminWakeups++;
+	}
 
 	if (desc) {
 		ret = desc->prepare();
@@ -367,13 +563,23 @@ IOReturn NVMeFixPlugin::NVMeFeatures(ControllerEntry& entry, unsigned fid, unsig
 			ret = reinterpret_cast<IODMACommand*>(req)->setMemoryDescriptor(desc);
 
 		if (ret == kIOReturnSuccess) {
-			if (set)
-				kextFuncs.AppleNVMeRequest.BuildCommandSetFeaturesCommon(req, fid);
+			if (cmd.opcode == NVMe::nvme_admin_set_features)
+				kextFuncs.AppleNVMeRequest.BuildCommandSetFeaturesCommon(req, cmd.cdw10 & 0xff);
 			else
-				kextFuncs.AppleNVMeRequest.BuildCommandGetFeatures(req, fid);
+				kextFuncs.AppleNVMeRequest.BuildCommandGetFeatures(req, features ? cmd.cdw10 & 0xff : 0);
+
+			auto& command = kextMembers.AppleNVMeRequest.command.get(req).common;
+			if (!features) {
+				command.opcode = cmd.opcode;
+				command.nsid = cmd.nsid;
+				command.cdw10 = cmd.cdw10;
+			}
+			command.cdw11 = cmd.cdw11;
+			command.cdw12 = cmd.cdw12;
+			command.cdw13 = cmd.cdw13;
+			command.cdw14 = cmd.cdw14;
+			command.cdw15 = cmd.cdw15;
 
-			if (dword11)
-				kextMembers.AppleNVMeRequest.command.get(req).features.dword11 = *dword11;
 			if (desc) {
 				kextMembers.AppleNVMeRequest.prpDescriptor.get(req) = desc;
 				ret = reinterpret_cast<IODMACommand*>(req)->prepare(0, desc->getLength());
@@ -391,11 +597,21 @@ IOReturn NVMeFixPlugin::NVMeFeatures(ControllerEntry& entry, unsigned fid, unsig
 				else {
 					kextMembers.AppleNVMeRequest.controller.get(req) = entry.controller;
 
+					auto start = getCurrentTimeNs();
 					ret = kextFuncs.IONVMeController.ProcessSyncNVMeRequest(entry.controller,
 																			req);
-					if (ret != kIOReturnSuccess)
-						DBGLOG(Log::Feature, "ProcessSyncNVMeRequest failed");
-					else if (res)
+					auto end = getCurrentTimeNs();
+					entry.adminLatency.record(cmd.opcode, features || logPage ? cmd.cdw10 & 0xff : 0,
+											  (end - start) / 1000);
+					if (!entry.nopspm)
+						entry.adminActiveUs = end / 1000;
+
+					if (ret != kIOReturnSuccess) {
+						auto status = kextFuncs.AppleNVMeRequest.GetStatus(req);
+						DBGLOG(Log::Feature, "ProcessSyncNVMeRequest for opcode 0x%x failed with status 0x%x",
+							   cmd.opcode, status);
+						entry.adminErrors.record(status);
+					} else if (res)
 						*res = kextMembers.AppleNVMeRequest.result.get(req);
 				}
 			}
@@ -412,6 +628,29 @@ IOReturn NVMeFixPlugin::NVMeFeatures(ControllerEntry& entry, unsigned fid, unsig
 	return ret;
 }
 
+/**
+ * Delivered when the controller starts terminating, before it is stopped and while it still takes
+ * commands, so that the host memory buffer is taken back without the global lock held.
+ * The entry is only removed by the terminated notification, which comes after this one.
+ */
+bool NVMeFixPlugin::willTerminateNotificationHandler(void* that, void* , IOService* service,
+													 IONotifier* notifier) {
+	auto plugin = static_cast<NVMeFixPlugin*>(that);
+	assert(plugin);
+
+	IOLockLock(plugin->lck);
+	auto entry = plugin->entryForController(service);
+	IOLockUnlock(plugin->lck);
+
+	if (entry && entry->lck) {
+		IOLockLock(entry->lck);
+		plugin->disableHMB(*entry);
+		IOLockUnlock(entry->lck);
+	}
+
+	return false;
+}
+
 /* Notifications are serialized for a single controller, so we don't have to sync with removal */
 bool NVMeFixPlugin::terminatedNotificationHandler(void* that, void* , IOService* service,
 												IONotifier* notifier) {
@@ -423,6 +662,8 @@ bool NVMeFixPlugin::terminatedNotificationHandler(void* that, void* , IOService*
 	IOLockLock(plugin->lck);
 	for (size_t i = 0; i < plugin->controllers.size(); i++)
 		if (plugin->controllers[i]->controller == service) {
+			/* Wait for activityTickle calls still using the entry */
+			plugin->entries.retire(service, []() { IOSleep(1); });
 			plugin->controllers.erase(i);
 			break;
 	   }
@@ -431,6 +672,14 @@ bool NVMeFixPlugin::terminatedNotificationHandler(void* that, void* , IOService*
 	return false;
 }
 
+/* Power budget shared by all controllers, set in watts via `nvmefpower` boot argument */
+static uint64_t bootargPowerBudgetUw() {
+	uint32_t watts {0};
+	if (!PE_parse_boot_argn("nvmefpower", &watts, sizeof(watts)))
+		return 0;
+	return watts * 1000000ull;
+}
+
 /**
  * NOTE: We are in kmod context, not IOService. This works fine as long as we publish our personality
  * in Info.plist to match something in ioreg, but specify a non-existing IOClass so that IOKit attempts
@@ -447,6 +696,9 @@ void NVMeFixPlugin::init() {
 
 	atomic_store_explicit(&solvedSymbols, false, memory_order_relaxed);
 
+	powerBudgetUw = bootargPowerBudgetUw();
+	DBGLOG_COND(powerBudgetUw, Log::PM, "Power budget %llu uW", powerBudgetUw);
+
 	matchingNotifier = IOService::addMatchingNotification(gIOPublishNotification,
 							IOService::serviceMatching("IOMediaBSDClient"),
 							matchingNotificationHandler,
@@ -456,6 +708,15 @@ void NVMeFixPlugin::init() {
 		goto fail;
 	}
 
+	willTerminateNotifier = IOService::addMatchingNotification(gIOWillTerminateNotification,
+							IOService::serviceMatching("IONVMeController"),
+							willTerminateNotificationHandler,
+						    this);
+	if (!willTerminateNotifier) {
+		SYSLOG(Log::Plugin, "Failed to register for will terminate notification");
+		goto fail;
+	}
+
 	terminationNotifier = IOService::addMatchingNotification(gIOTerminatedNotification,
 							IOService::serviceMatching("IONVMeController"),
 							terminatedNotificationHandler,
@@ -479,6 +740,8 @@ fail:
 		IOLockFree(lck);
 	if (matchingNotifier)
 		matchingNotifier->remove();
+	if (willTerminateNotifier)
+		willTerminateNotifier->remove();
 	if (terminationNotifier)
 		terminationNotifier->remove();
 }
@@ -488,6 +751,80 @@ void NVMeFixPlugin::deinit() {
 	panic("nvmef: deinit called");
 }
 
+void NVMeFixPlugin::ControllerEntry::deleter(ControllerEntry* entry) {
+	assert(entry);
+
+	if (entry->timer) {
+		entry->timer->cancelTimeout();
+		if (entry->workLoop)
+			entry->workLoop->removeEventSource(entry->timer);
+		entry->timer->release();
+	}
+	if (entry->govTimer) {
+		entry->govTimer->cancelTimeout();
+		if (entry->workLoop)
+			entry->workLoop->removeEventSource(entry->govTimer);
+		entry->govTimer->release();
+	}
+	if (entry->budgetTimer) {
+		entry->budgetTimer->cancelTimeout();
+		if (entry->workLoop)
+			entry->workLoop->removeEventSource(entry->budgetTimer);
+		entry->budgetTimer->release();
+	}
+	if (entry->irqTimer) {
+		entry->irqTimer->cancelTimeout();
+		if (entry->workLoop)
+			entry->workLoop->removeEventSource(entry->irqTimer);
+		entry->irqTimer->release();
+	}
+	if (entry->adminTimer) {
+		entry->adminTimer->cancelTimeout();
+		if (entry->workLoop)
+			entry->workLoop->removeEventSource(entry->adminTimer);
+		entry->adminTimer->release();
+	}
+	/* Commands that did not get to run are completed as aborted */
+	Admin::Command command;
+	for (int slot; (slot = entry->adminScheduler.start(command)) >= 0;) {
+		completeAborted(*entry, command);
+		entry->adminScheduler.finish(slot);
+	}
+	if (entry->adminLck)
+		IOLockFree(entry->adminLck);
+	if (entry->workLoop)
+		entry->workLoop->release();
+
+	/* PM functions don't check for validity of entry or its members, so let's stop it early */
+	if (entry->pm) {
+		if (entry->controller)
+			entry->controller->deRegisterInterestedDriver(entry->pm);
+		entry->pm->PMstop();
+		static_cast<NVMePMProxy*>(entry->pm)->entry = nullptr;
+		entry->pm->release();
+	}
+
+	if (entry->powerStates)
+		delete[] entry->powerStates;
+	if (entry->identify)
+		entry->identify->release();
+	/* Taken back on willTerminate, and leaked rather than freed while the controller might still use it */
+	if (entry->hmbEnabled && !globalPlugin().controllerDisabled(*entry))
+		SYSLOG(Log::HMB, "Leaking host memory buffer of %llu bytes not released by controller",
+			   entry->hmb.totalBytes);
+	else
+		releaseHMB(*entry);
+	for (auto desc : entry->adminBuffers)
+		if (desc) {
+			desc->complete();
+			desc->release();
+		}
+	if (entry->lck)
+		IOLockFree(entry->lck);
+
+	delete entry;
+}
+
 NVMeFixPlugin::ControllerEntry* NVMeFixPlugin::entryForController(IOService* controller) const {
 	for (size_t i = 0; i < controllers.size(); i++)
 		if (controllers[i]->controller == controller)
@@ -495,6 +832,59 @@ NVMeFixPlugin::ControllerEntry* NVMeFixPlugin::entryForController(IOService* con
 	return nullptr;
 }
 
+bool NVMeFixPlugin::initPeriodic(ControllerEntry& entry) {
+	if (!entry.pm)
+		return false;
+
+	entry.workLoop = IOWorkLoop::workLoop();
+	if (!entry.workLoop) {
+		SYSLOG(Log::Plugin, "Failed to create workloop");
+		return false;
+	}
+
+	entry.timer = IOTimerEventSource::timerEventSource(entry.pm, periodicAction);
+	if (!entry.timer) {
+		SYSLOG(Log::Plugin, "Failed to create timer");
+		return false;
+	}
+
+	if (entry.workLoop->addEventSource(entry.timer) != kIOReturnSuccess) {
+		SYSLOG(Log::Plugin, "Failed to add timer to workloop");
+		entry.timer->release();
+		entry.timer = nullptr;
+		return false;
+	}
+
+	entry.timer->setTimeoutMS(periodicIntervalMs);
+	return true;
+}
+
+/* Runs on the entry workloop, so it is fine to block on admin commands here */
+void NVMeFixPlugin::periodicAction(OSObject* owner, IOTimerEventSource* sender) {
+	auto pm = OSDynamicCast(NVMePMProxy, owner);
+	if (!pm || !pm->entry)
+		return;
+
+	auto& entry = *pm->entry;
+
+	IOLockLock(entry.lck);
+	/* Nothing is sent to a controller turned off by IOPM, lost features are replayed once it is back */
+	if (!entry.poweredOff()) {
+		if (__atomic_load_n(&entry.psDeferred, __ATOMIC_RELAXED) && entry.pmOrdinal > 0)
+			PM::applyPowerState(entry, entry.pmOrdinal);
+		plugin.retuneAPST(entry);
+		plugin.restoreFeatures(entry, true);
+		plugin.pollHealth(entry);
+	}
+	plugin.publishAPSTStats(entry);
+	plugin.publishAdminStats(entry);
+	plugin.publishCoalescing(entry);
+	plugin.PM.publishStats(entry);
+	IOLockUnlock(entry.lck);
+
+	sender->setTimeoutMS(periodicIntervalMs);
+}
+
 static const char *bootargOff[] {
 	"-nvmefoff"
 };
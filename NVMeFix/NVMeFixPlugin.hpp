@@ -22,12 +22,26 @@
 #include <IOKit/IOService.h>
 #include <IOKit/IOLocks.h>
 #include <IOKit/IOBufferMemoryDescriptor.h>
+#include <IOKit/IODMACommand.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <IOKit/IOWorkLoop.h>
 #include <IOKit/pwr_mgt/IOPMpowerState.h>
 #include <Headers/kern_patcher.hpp>
 #include <Headers/kern_util.hpp>
 
 #include "Log.hpp"
 #include "nvme.h"
+#include "nvme_admin_queue.hpp"
+#include "nvme_arbitration_plan.hpp"
+#include "nvme_apst_plan.hpp"
+#include "nvme_apst_tune.hpp"
+#include "nvme_budget_plan.hpp"
+#include "nvme_entry_table.hpp"
+#include "nvme_health.hpp"
+#include "nvme_histogram.hpp"
+#include "nvme_hmb_plan.hpp"
+#include "nvme_irq_coalesce.hpp"
+#include "nvme_pm_governor.hpp"
 #include "nvme_quirks.hpp"
 
 class NVMeFixPlugin {
@@ -42,12 +56,13 @@ public:
 private:
 	static void processKext(void*, KernelPatcher&, size_t, mach_vm_address_t, size_t);
 	static bool matchingNotificationHandler(void*, void*, IOService*, IONotifier*);
+	static bool willTerminateNotificationHandler(void*, void*, IOService*, IONotifier*);
 	static bool terminatedNotificationHandler(void*, void*, IOService*, IONotifier*);
 	bool solveSymbols(KernelPatcher& kp);
 
 	atomic_bool solvedSymbols = false;
 
-	IONotifier* matchingNotifier {nullptr}, * terminationNotifier {nullptr};
+	IONotifier* matchingNotifier {nullptr}, * willTerminateNotifier {nullptr}, * terminationNotifier {nullptr};
 
 	/* Used for synchronising concurrent access to this class from notification handlers */
 	IOLock* lck {nullptr};
@@ -131,7 +146,7 @@ private:
 				"__ZN16IONVMeController13ReturnRequestEP16AppleNVMeRequest"
 			};
 			Func<bool,void*,unsigned long, unsigned long> activityTickle {};
-			Func<void,void*,void*,int> FilterInterruptRequest {
+			Func<bool,void*,void*> FilterInterruptRequest {
 				"__ZN16IONVMeController22FilterInterruptRequestEP28IOFilterInterruptEventSource"
 			};
 		} IONVMeController;
@@ -241,37 +256,195 @@ private:
 		bool processed {false};
 		NVMe::nvme_quirks quirks {NVMe::NVME_QUIRK_NONE};
 		uint64_t ps_max_latency_us {100000};
+		APST::Policy apstPolicy {APST::Policy::CostModel};
+		const APST::Profile* apstProfile {&APST::defaultProfile()};
 		IOPMPowerState* powerStates {nullptr};
 		size_t nstates {0};
 		IOLock* lck {nullptr};
 		IOService* pm {nullptr};
 		IOBufferMemoryDescriptor* identify {nullptr};
+		/* Controller Capabilities and Configuration as set by IONVMeFamily, read once */
+		bool regsValid {false};
+		uint64_t regCap {0};
+		uint32_t regCc {0};
+		/* Also read without the lock by activityTickle, so written atomically */
 		bool apste {false};
+		/* Power managed by APST, even while the profile leaves it without usable states */
+		bool apstManaged {false};
+		/* Set once pm and powerStates may be used by activityTickle */
+		bool pmReady {false};
+		/* Last IOPM power state ordinal set by setPowerState */
+		unsigned long pmOrdinal {0};
+		/* IOPM is tickled at most once per window while in the highest state */
+		uint64_t tickleWindowNs {0};
+		uint64_t lastTickleNs {0};
+		uint32_t ticklesForwarded {0};
+		uint32_t ticklesSuppressed {0};
+		/* Power state last set or read by active PM, -1 if unknown */
+		int psKnown {-1};
+		/* APST was found enabled by firmware, and may move the controller after this much idle time */
+		bool apstExternal {false};
+		uint64_t apstMinIdleNs {0};
+		uint32_t psQueriesAvoided {0};
+		/* Moving average of setPowerState admin command time with and without querying the state */
+		uint64_t psSetNsQueried {0};
+		uint64_t psSetNsCached {0};
+		/* Last successfully programmed APST table */
+		APST::Plan apstPlan;
+		/* Pre-wired admin command payload buffers, used under lck: 4 KiB log pages, SMART log, APST table */
+		static constexpr unsigned adminBufferCount {3};
+		IOBufferMemoryDescriptor* adminBuffers[adminBufferCount] {};
+		bool adminBufferBusy[adminBufferCount] {};
+		uint32_t adminAllocsAvoided {0};
+		/* Inputs apstPlan was built from */
+		struct {
+			NVMe::nvme_quirks quirks;
+			uint64_t ps_max_latency_us;
+			const IOBufferMemoryDescriptor* identify;
+			APST::Policy policy;
+			const APST::Profile* profile;
+		} apstPlanKey {};
+		APST::Tuner apstTuner;
+		uint32_t apstRetunes {0};
+		/* Power transitions after which APST was found intact or had to be reprogrammed */
+		uint32_t apstResumeHits {0};
+		uint32_t apstResumeMisses {0};
+		/* Non-Operational Power State Permissive Mode is enabled */
+		bool nopspm {false};
+		/* Admin commands issued while APST has likely taken the controller to a non-operational state,
+		 * which either force or avoid a wake-up */
+		uint32_t adminWakeups {0};
+		uint32_t adminWakeupsAvoided {0};
+		/* Last time an admin command or power transition left the controller in PS0, in microseconds */
+		uint64_t adminActiveUs {0};
+		/* Host Controlled Thermal Management thresholds in Kelvin, 0 when not configured */
+		uint16_t hctmTmt1 {0};
+		uint16_t hctmTmt2 {0};
+		/* Thermal management statistics from the last SMART log read */
+		uint32_t thmTransitions[2] {};
+		uint32_t thmTimeS[2] {};
+		/* Host Memory Buffer chunks and their descriptor list, kept until the entry is deleted */
+		HMB::Buffer hmb {};
+		IOBufferMemoryDescriptor* hmbChunks[HMB::maxChunks] {};
+		IODMACommand* hmbDma[HMB::maxChunks] {};
+		IOBufferMemoryDescriptor* hmbList {nullptr};
+		IODMACommand* hmbListDma {nullptr};
+		uint64_t hmbListAddr {0};
+		/* Controller uses the buffer, cleared while it is taken back over sleep */
+		bool hmbEnabled {false};
+		/* Health counters from the last SMART log read, and reads skipped not to wake the controller */
+		Health::Tracker health;
+		uint32_t healthSkips {0};
+		/* Measured latency of Set Features Power Management to each state, and of the first I/O after idle in it */
+		static constexpr unsigned maxPowerStates {32};
+		Stats::LatencyHistogram psSetLatency[maxPowerStates];
+		Stats::LatencyHistogram psWakeLatency[maxPowerStates];
+		Stats::LatencyHistogram pmGetLatency;
+		Stats::LatencyHistogram apstSetLatency;
+		Stats::LatencyHistogram apstGetLatency;
+		/* Controller time of every admin command by opcode and feature or log page, and failures by status */
+		Stats::CommandLatency<16> adminLatency;
+		Stats::StatusCounts<8> adminErrors;
+		/* Last I/O request, and the start and expected power state of the first one after idle */
+		uint64_t lastIoNs {0};
+		uint64_t wakeStartNs {0};
+		unsigned wakeState {0};
+		/* Operational states to split the power budget over, and the deepest one we may have to use */
+		Governor::Levels budgetLevels;
+		const NVMe::nvme_id_power_state* budgetPsd {nullptr};
+		/* I/O requests seen if budgeted or coalescing adaptively, and their number at the last budget allocation */
+		uint64_t ioRequests {0};
+		uint64_t budgetRequests {0};
+		/* Shallowest power state allowed by the budget and the one last applied, -1 if none */
+		int capState {-1};
+		int capApplied {-1};
+		IOTimerEventSource* budgetTimer {nullptr};
+		/* Interrupt coalescing adapted to I/O load, sampled on workLoop while there is I/O */
+		bool irqAdaptive {false};
+		Coalesce::Policy irqPolicy;
+		IOTimerEventSource* irqTimer {nullptr};
+		/* Counted by filterInterrupt, which also flags the next request as the start of a burst */
+		uint64_t irqCount {0};
+		uint64_t irqBursts {0};
+		bool irqSeen {false};
+		/* Sampling stopped while idle, restarted by the next request */
+		bool irqDormant {false};
+		struct {
+			uint64_t ns;
+			uint64_t requests;
+			uint64_t interrupts;
+			uint64_t bursts;
+		} irqSampleStart {};
+		/* Features we set, in the order they are replayed after the controller was reset */
+		struct SavedFeature {
+			uint8_t fid;
+			bool valid;
+			uint32_t dword11;
+		} savedFeatures[6] {
+			{NVMe::NVME_FEAT_ARBITRATION, false, 0},
+			{NVMe::NVME_FEAT_HCTM, false, 0},
+			{NVMe::NVME_FEAT_IRQ_COALESCE, false, 0},
+			{NVMe::NVME_FEAT_NOPSC, false, 0},
+			{NVMe::NVME_FEAT_AUTO_PST, false, 0},
+			{NVMe::NVME_FEAT_POWER_MGMT, false, 0}
+		};
+		/* Controller may have been reset, so the saved features have to be replayed */
+		bool featuresLost {false};
+		uint32_t resumeReplays {0};
+		Stats::LatencyHistogram resumeLatency;
+		/* Drives periodic housekeeping, owned by pm */
+		IOWorkLoop* workLoop {nullptr};
+		IOTimerEventSource* timer {nullptr};
+		/* Active PM driven by our own idle governor instead of IOPM idle timer */
+		bool governed {false};
+		Governor::IdleGovernor governor;
+		/* Also limit operational state to the measured I/O rate */
+		bool tputGoverned {false};
+		Governor::ThroughputGovernor tputGovernor;
+		/* I/O requests not yet recorded into tputGovernor, counted without the lock */
+		uint32_t tputPending {0};
+		IOTimerEventSource* govTimer {nullptr};
+		/* IOPM power state change could neither be queued nor applied, and is applied later */
+		bool psDeferred {false};
+		/* Admin commands submitted for execution on workLoop, guarded by adminLck */
+		static constexpr size_t adminQueueDepth {16};
+		Admin::Scheduler<adminQueueDepth> adminScheduler;
+		IOLock* adminLck {nullptr};
+		IOTimerEventSource* adminTimer {nullptr};
+		/* Start of the power transition whose APST check or feature replays are queued */
+		uint64_t resumeStartNs {0};
+		/* Also completed by IOPM superseding them, so counted atomically */
+		uint32_t replaysPending {0};
+		/* Power state last programmed by the governor, none after IOPM transitions */
+		unsigned govState {noGovState};
+		static constexpr unsigned noGovState {~0u};
+
+		void setAPSTE(bool enabled) {
+			__atomic_store_n(&apste, enabled, __ATOMIC_RELAXED);
+		}
+
+		/* IOPM has turned the controller off, so nothing may be sent to it until it is back */
+		bool poweredOff() const {
+			return powerStates && __atomic_load_n(&pmOrdinal, __ATOMIC_RELAXED) == 0;
+		}
 
 		bool apstAllowed() {
 			return !(quirks & NVMe::nvme_quirks::NVME_QUIRK_NO_APST) && ps_max_latency_us > 0;
 		}
 
-		static void deleter(ControllerEntry* entry) {
-			assert(entry);
+		void apstPlanned() {
+			apstPlanKey = {quirks, ps_max_latency_us, identify, apstPolicy, apstProfile};
+		}
 
-			/* PM functions don't check for validity of entry or its members, so let's stop it early */
-			if (entry->pm) {
-				if (entry->controller)
-					entry->controller->deRegisterInterestedDriver(entry->pm);
-				entry->pm->PMstop();
-				entry->pm->release();
-			}
-			if (entry->powerStates)
-				delete[] entry->powerStates;
-			if (entry->identify)
-				entry->identify->release();
-			if (entry->lck)
-				IOLockFree(entry->lck);
-
-			delete entry;
+		bool apstPlanCurrent() const {
+			return apstPlan.maxPs != -1 && apstPlanKey.quirks == quirks &&
+				apstPlanKey.ps_max_latency_us == ps_max_latency_us &&
+				apstPlanKey.identify == identify && apstPlanKey.policy == apstPolicy &&
+				apstPlanKey.profile == apstProfile;
 		}
 
+		static void deleter(ControllerEntry* entry);
+
 		explicit ControllerEntry(IOService* c) : controller(c) {
 			lck = IOLockAlloc();
 			assert(lck);
@@ -279,17 +452,98 @@ private:
 	};
 
 	evector<ControllerEntry*, ControllerEntry::deleter> controllers;
+	/* Lookup for activityTickle, which is called on every I/O. Updated under lck. */
+	EntryTable<ControllerEntry, 32> entries;
+	/* Some controllers did not fit into entries and have to be looked up under lck */
+	bool entriesOverflow {false};
 	void handleControllers();
 	void forceEnableASPM(IOService*);
 	void handleController(ControllerEntry&);
 	IOReturn identify(ControllerEntry&,IOBufferMemoryDescriptor*&);
 	bool enableAPST(ControllerEntry&, const NVMe::nvme_id_ctrl*);
+	static APST::Input apstInput(const ControllerEntry&, const NVMe::nvme_id_ctrl*);
 	IOReturn configureAPST(ControllerEntry&,const NVMe::nvme_id_ctrl*);
+	IOReturn programAPST(ControllerEntry&, const APST::Plan&);
+	void publishAPSTStats(ControllerEntry&);
+	IOReturn setAPSTProfile(ControllerEntry&, const APST::Profile&);
+	void retuneAPST(ControllerEntry&);
 	IOReturn APSTenabled(ControllerEntry&, bool&);
+	IOReturn readAPST(ControllerEntry&, NVMe::nvme_feat_auto_pst&);
 	IOReturn dumpAPST(ControllerEntry&, int npss);
+	bool restoreAPST(ControllerEntry&, const NVMe::nvme_id_ctrl*);
+	void apstResumed(ControllerEntry&, bool retained);
+	static void apstChecked(void* owner, void* context, int status, uint32_t result);
+	void saveFeature(ControllerEntry&, unsigned fid, uint32_t dword11);
+	void restoreFeatures(ControllerEntry&, bool powerState);
+	bool replayFeatures(ControllerEntry&);
+	static void featureReplayed(void* owner, void* context, int status, uint32_t result);
+	bool enableNOPSPM(ControllerEntry&, const NVMe::nvme_id_ctrl*);
+	/* Default HCTM thresholds below the warning temperature, in Kelvin */
+	static constexpr uint32_t tmt2MarginK {3};
+	static constexpr uint32_t tmt1MarginK {5};
+	bool configureHCTM(ControllerEntry&, const NVMe::nvme_id_ctrl*);
+	static void hctmConfigured(void* owner, void* context, int status, uint32_t result);
+	void updateThermal(ControllerEntry&, const NVMe::nvme_smart_log&);
+	bool readRegisters(ControllerEntry&);
+	bool controllerDisabled(ControllerEntry&);
+	bool configureArbitration(ControllerEntry&, const NVMe::nvme_id_ctrl*);
+	static void arbitrationConfigured(void* owner, void* context, int status, uint32_t result);
+	bool enableHMB(ControllerEntry&, const NVMe::nvme_id_ctrl*);
+	static bool allocHMBChunk(void* context, uint64_t bytes, uint64_t& addr);
+	void returnHMB(ControllerEntry&);
+	void resumeHMB(ControllerEntry&);
+	static void hmbResumed(void* owner, void* context, int status, uint32_t result);
+	void disableHMB(ControllerEntry&);
+	static void releaseHMB(ControllerEntry&);
+	bool initCoalescing(ControllerEntry&);
+	static void coalesceTickle(ControllerEntry&);
+	static void coalesceAction(OSObject*, IOTimerEventSource*);
+	void applyCoalescing(ControllerEntry&);
+	static void coalescingApplied(void* owner, void* context, int status, uint32_t result);
+	void publishCoalescing(ControllerEntry&);
+	static bool healthPollWakes(const ControllerEntry&);
+	void pollHealth(ControllerEntry&);
+	static void healthPolled(void* owner, void* context, int status, uint32_t result);
+	void publishHealth(ControllerEntry&, uint32_t changed);
 	IOReturn NVMeFeatures(ControllerEntry&, unsigned fid, unsigned* dword11, IOBufferMemoryDescriptor* desc,
 							 uint32_t* res, bool set);
+	/* Admin command with opcode, nsid and command dwords 10-15 taken from `cmd` */
+	IOReturn NVMeAdmin(ControllerEntry&, const NVMe::nvme_common_command& cmd, IOBufferMemoryDescriptor* desc,
+					   uint32_t* res);
+	IOReturn getLogPage(ControllerEntry&, uint8_t lid, IOBufferMemoryDescriptor* desc,
+						uint32_t nsid = 0xffffffff);
+	static NVMe::nvme_common_command logPageCommand(uint8_t lid, size_t length, uint32_t nsid = 0xffffffff);
+	bool initAdminQueue(ControllerEntry&);
+	/**
+	 * Queues `command` for execution on the entry workloop, where its callback is invoked with entry
+	 * lock held. The buffer, an IOBufferMemoryDescriptor, is retained until then.
+	 */
+	IOReturn submitAdmin(ControllerEntry&, const Admin::Command& command);
+	/* Executes `command` right away, invoking its callback, with entry lock held */
+	void executeAdmin(ControllerEntry&, const Admin::Command& command);
+	static void completeAborted(ControllerEntry&, const Admin::Command& command);
+	static void adminAction(OSObject*, IOTimerEventSource*);
+	void publishAdminStats(ControllerEntry&);
+	void publishAdminLatency(ControllerEntry&);
+	bool allocAdminBuffers(ControllerEntry&);
+	/* Zeroed buffer of `size` bytes, pooled if one is free, to be given back via returnAdminBuffer */
+	IOBufferMemoryDescriptor* adminBuffer(ControllerEntry&, size_t size);
+	void returnAdminBuffer(ControllerEntry&, IOBufferMemoryDescriptor*);
 	ControllerEntry* entryForController(IOService*) const;
+
+	/* Maximum power of all controllers together in microwatts, 0 if unlimited */
+	uint64_t powerBudgetUw {0};
+	uint64_t budgetAllocatedNs {0};
+	static constexpr uint32_t budgetIntervalMs {1000};
+	bool initBudget(ControllerEntry&, const NVMe::nvme_id_ctrl*);
+	void allocatePowerBudget();
+	static unsigned cappedState(const ControllerEntry&, unsigned state);
+	void applyPowerCap(ControllerEntry&);
+	static void budgetAction(OSObject*, IOTimerEventSource*);
+
+	static constexpr uint32_t periodicIntervalMs {30000};
+	bool initPeriodic(ControllerEntry&);
+	static void periodicAction(OSObject*, IOTimerEventSource*);
 	struct PM {
 		/**
 		 * If `apst`, initialises and enables NVMePMProxy to handle controller power state change
@@ -300,8 +554,37 @@ private:
 		bool solveSymbols(KernelPatcher&);
 
 		static constexpr unsigned idlePeriod {2}; /* seconds */
+		static constexpr uint32_t defaultTickleWindowMs {100};
 
 		static bool activityTickle(void*,unsigned long,unsigned long);
+		static void tickle(ControllerEntry&);
+
+		/* Idle time after which the next I/O is timed until the controller interrupts */
+		static constexpr uint64_t wakeIdleNs {1000000};
+		bool interruptRouted {false};
+		static bool filterInterrupt(void*, void*);
+		static void trackWake(ControllerEntry&);
+		static unsigned expectedState(const ControllerEntry&, uint64_t idleUs);
+		static bool idleNonOperational(const ControllerEntry&);
+		void publishLatency(ControllerEntry&);
+		/* Adds count and percentiles of `hist` as `key`, if it has samples */
+		static void setLatencySummary(OSDictionary*, const char* key, const Stats::LatencyHistogram& hist);
+		static bool powerStateStale(const ControllerEntry&);
+
+		/* Admin command time assumed for power state changes, until a longer one is measured */
+		static constexpr uint32_t adminLatencyUs {10000};
+		static void applyPowerState(ControllerEntry&, unsigned long powerStateOrdinal);
+		static IOReturn applyState(ControllerEntry&, unsigned state);
+		static uint32_t transitionLatencyUs(const ControllerEntry&, unsigned long powerStateOrdinal);
+		/* Moves setPowerState admin commands off the IOPM thread, acknowledging them afterwards */
+		static IOReturn submitTransition(ControllerEntry&, unsigned long powerStateOrdinal);
+		static void transitionApplied(void* owner, void* context, int status, uint32_t result);
+
+		/* Sets up millisecond resolution idle governor on the entry workloop */
+		bool initGovernor(ControllerEntry&, const NVMe::nvme_id_ctrl*);
+		static void governorAction(OSObject*, IOTimerEventSource*);
+		static void governorKick(ControllerEntry&, uint64_t nowUs);
+		void publishStats(ControllerEntry&);
 
 		explicit PM(NVMeFixPlugin& plugin) : plugin(plugin) {}
 	private:
@@ -319,12 +602,21 @@ public:
 		unsigned long powerStateOrdinal,
 		IOService *   whatDevice ) override;
 	
+	// Taking Host Memory Buffer back from IONVMeController before it sleeps
+	virtual IOReturn powerStateWillChangeTo(
+		IOPMPowerFlags  capabilities,
+		unsigned long   stateNumber,
+		IOService *     whatDevice ) override;
+
 	// Monitoring IONVMeController power state to re-enable APST
 	virtual IOReturn powerStateDidChangeTo(
 		IOPMPowerFlags  capabilities,
 		unsigned long   stateNumber,
 		IOService *     whatDevice ) override;
 
+	// Runtime configuration, e.g. APST profile switching
+	virtual IOReturn setProperties(OSObject* properties) override;
+
 	NVMeFixPlugin::ControllerEntry* entry {nullptr};
 };
 
@@ -0,0 +1,226 @@
+//
+// @file nvme_admin.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+#include "Log.hpp"
+#include "NVMeFixPlugin.hpp"
+
+/**
+ * IONVMeFamily only exports synchronous admin command submission, so asynchronous commands are
+ * executed one by one on the entry workloop. Callers on the IOPM or notification threads thus no
+ * longer wait for the controller, and the scheduler bounds the commands a controller may have
+ * pending. Restoring the configuration after reset goes first, then power state transitions, and
+ * telemetry last, and only the last value of a feature set in the meantime is sent.
+ */
+bool NVMeFixPlugin::initAdminQueue(ControllerEntry& entry) {
+	if (!entry.workLoop)
+		return false;
+
+	entry.adminLck = IOLockAlloc();
+	if (!entry.adminLck) {
+		SYSLOG(Log::Feature, "Failed to allocate admin queue lock");
+		return false;
+	}
+
+	entry.adminTimer = IOTimerEventSource::timerEventSource(entry.pm, adminAction);
+	if (!entry.adminTimer) {
+		SYSLOG(Log::Feature, "Failed to create admin queue timer");
+		return false;
+	}
+
+	if (entry.workLoop->addEventSource(entry.adminTimer) != kIOReturnSuccess) {
+		SYSLOG(Log::Feature, "Failed to add admin queue timer to workloop");
+		entry.adminTimer->release();
+		entry.adminTimer = nullptr;
+		return false;
+	}
+
+	return true;
+}
+
+/**
+ * Called with entry lock held, as a command superseded by coalescing is completed here with
+ * kIOReturnAborted, and callbacks expect the lock like on the workloop.
+ * Fails with kIOReturnNotReady without the workloop, and with kIOReturnBusy if too many commands
+ * are pending.
+ */
+IOReturn NVMeFixPlugin::submitAdmin(ControllerEntry& entry, const Admin::Command& command) {
+	if (!entry.adminTimer)
+		return kIOReturnNotReady;
+
+	/* The workloop may already be draining the queue and release it right away */
+	auto desc = static_cast<IOBufferMemoryDescriptor*>(command.buffer);
+	if (desc)
+		desc->retain();
+
+	Admin::Command superseded;
+	IOLockLock(entry.adminLck);
+	auto result = entry.adminScheduler.submit(command, superseded);
+	IOLockUnlock(entry.adminLck);
+
+	if (result == Admin::Submit::Dropped) {
+		DBGLOG(Log::Feature, "Admin queue full, dropping opcode 0x%x", command.cmd.opcode);
+		if (desc)
+			desc->release();
+		return kIOReturnBusy;
+	}
+
+	if (result == Admin::Submit::Coalesced) {
+		DBGLOG(Log::Feature, "Coalesced Set Features 0x%x", command.cmd.cdw10 & 0xff);
+		completeAborted(entry, superseded);
+	}
+
+	entry.adminTimer->setTimeoutUS(1);
+	return kIOReturnSuccess;
+}
+
+void NVMeFixPlugin::completeAborted(ControllerEntry& entry, const Admin::Command& command) {
+	if (command.callback)
+		command.callback(&entry, command.context, kIOReturnAborted, 0);
+	if (command.buffer)
+		static_cast<IOBufferMemoryDescriptor*>(command.buffer)->release();
+}
+
+/* Called with entry lock held */
+void NVMeFixPlugin::executeAdmin(ControllerEntry& entry, const Admin::Command& command) {
+	auto& cmd = command.cmd;
+	auto desc = static_cast<IOBufferMemoryDescriptor*>(command.buffer);
+	bool set = cmd.opcode == NVMe::nvme_admin_set_features;
+	unsigned fid = cmd.cdw10 & 0xff;
+	uint32_t res {};
+	IOReturn ret;
+
+	if (set && fid == NVMe::NVME_FEAT_POWER_MGMT && !command.replay) {
+		/* Transitions are checked against the budget and APST when they are sent, not when queued */
+		ret = PM::applyState(entry, cmd.cdw11 & 0x1f);
+	} else if (set && fid == NVMe::NVME_FEAT_HOST_MEM_BUF) {
+		/* Takes the buffer size and descriptor list in dwords 12-15, and is never replayed */
+		ret = NVMeAdmin(entry, cmd, desc, &res);
+	} else if (set || cmd.opcode == NVMe::nvme_admin_get_features) {
+		/* Features go through NVMeFeatures, so that they are timed and saved for replay */
+		unsigned dword11 = cmd.cdw11;
+		ret = NVMeFeatures(entry, fid, &dword11, desc, &res, set);
+		if (set && fid == NVMe::NVME_FEAT_POWER_MGMT)
+			entry.psKnown = ret == kIOReturnSuccess ? static_cast<int>(dword11 & 0x1f) : -1;
+	} else
+		ret = NVMeAdmin(entry, cmd, desc, &res);
+
+	DBGLOG_COND(ret != kIOReturnSuccess, Log::Feature, "Admin opcode 0x%x failed with 0x%x", cmd.opcode, ret);
+	if (command.callback)
+		command.callback(&entry, command.context, ret, res);
+}
+
+/* Runs on the entry workloop */
+void NVMeFixPlugin::adminAction(OSObject* owner, IOTimerEventSource* sender) {
+	auto pm = OSDynamicCast(NVMePMProxy, owner);
+	if (!pm || !pm->entry)
+		return;
+
+	auto& entry = *pm->entry;
+	auto& plugin = NVMeFixPlugin::globalPlugin();
+
+	while (true) {
+		Admin::Command command;
+		IOLockLock(entry.adminLck);
+		auto slot = entry.adminScheduler.start(command);
+		IOLockUnlock(entry.adminLck);
+		if (slot < 0)
+			break;
+
+		IOLockLock(entry.lck);
+		plugin.executeAdmin(entry, command);
+		IOLockUnlock(entry.lck);
+
+		if (command.buffer)
+			static_cast<IOBufferMemoryDescriptor*>(command.buffer)->release();
+
+		/* Finished only now, so that the command counted against the bound while it ran */
+		IOLockLock(entry.adminLck);
+		entry.adminScheduler.finish(slot);
+		IOLockUnlock(entry.adminLck);
+	}
+
+	/* IOPM power state change that found the entry lock taken, kicked by setPowerState */
+	if (__atomic_load_n(&entry.psDeferred, __ATOMIC_RELAXED)) {
+		IOLockLock(entry.lck);
+		if (__atomic_load_n(&entry.psDeferred, __ATOMIC_RELAXED) && entry.pmOrdinal > 0)
+			PM::applyPowerState(entry, entry.pmOrdinal);
+		IOLockUnlock(entry.lck);
+	}
+}
+
+/**
+ * Publishes the time controller took for each admin command, keyed by opcode and feature or log
+ * page identifier as `opcode/id` in hex, and failures keyed by status.
+ */
+void NVMeFixPlugin::publishAdminLatency(ControllerEntry& entry) {
+	auto commands = OSDictionary::withCapacity(arrsize(entry.adminLatency.slots));
+	auto errors = OSDictionary::withCapacity(arrsize(entry.adminErrors.slots) + 1);
+	if (!commands || !errors) {
+		OSSafeReleaseNULL(commands);
+		OSSafeReleaseNULL(errors);
+		return;
+	}
+
+	char key[16];
+	for (auto& slot : entry.adminLatency.slots) {
+		if (!slot.used)
+			break;
+		snprintf(key, sizeof(key), "0x%02x/0x%02x", slot.opcode, slot.sub);
+		PM::setLatencySummary(commands, key, slot.hist);
+	}
+
+	for (auto& slot : entry.adminErrors.slots) {
+		if (!slot.count)
+			break;
+		snprintf(key, sizeof(key), "0x%x", slot.status);
+		auto num = OSNumber::withNumber(slot.count, 32);
+		if (num) {
+			errors->setObject(key, num);
+			num->release();
+		}
+	}
+
+	if (entry.adminErrors.other) {
+		auto num = OSNumber::withNumber(entry.adminErrors.other, 32);
+		if (num) {
+			errors->setObject("other", num);
+			num->release();
+		}
+	}
+
+	entry.controller->setProperty("admin-latency-us", commands);
+	entry.controller->setProperty("admin-errors", errors);
+	entry.controller->setProperty("admin-latency-overflow", entry.adminLatency.overflow, 32);
+	commands->release();
+	errors->release();
+}
+
+void NVMeFixPlugin::publishAdminStats(ControllerEntry& entry) {
+	publishAdminLatency(entry);
+
+	if (!entry.adminLck)
+		return;
+
+	IOLockLock(entry.adminLck);
+	auto submitted = entry.adminScheduler.submitted;
+	auto coalesced = entry.adminScheduler.coalesced;
+	auto dropped = entry.adminScheduler.dropped;
+	auto maxDepth = entry.adminScheduler.maxDepth;
+	IOLockUnlock(entry.adminLck);
+
+	entry.controller->setProperty("admin-async-submitted", submitted, 32);
+	entry.controller->setProperty("admin-async-coalesced", coalesced, 32);
+	entry.controller->setProperty("admin-async-dropped", dropped, 32);
+	entry.controller->setProperty("admin-async-max-depth", maxDepth, 32);
+}
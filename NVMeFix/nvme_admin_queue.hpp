@@ -0,0 +1,182 @@
+//
+// @file nvme_admin_queue.hpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+#ifndef nvme_admin_queue_hpp
+#define nvme_admin_queue_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nvme.h"
+
+/**
+ * Bookkeeping of admin commands submitted for asynchronous execution. The executor starts the
+ * pending command of the highest priority, oldest first, runs it, invokes its callback with the
+ * status and result dword, and only then finishes it, so that it counts against the bound until then.
+ * A pending Set Features is coalesced with a new one of the same feature, so that only the last
+ * value is sent.
+ * Neither executes commands nor locks by itself, so the same code may be driven by the kext
+ * workloop or by a fake controller on the host.
+ */
+namespace Admin {
+
+/* Status is an IOReturn in the kext */
+using Callback = void (*)(void* owner, void* context, int status, uint32_t result);
+
+enum class Priority : uint8_t {
+	/* Telemetry and configuration nothing waits for */
+	Background,
+	/* IOPM power state transitions */
+	Transition,
+	/* Restoring the controller configuration after it was reset */
+	Resume
+};
+
+struct Command {
+	/* Opcode, nsid and command dwords 10-15 */
+	NVMe::nvme_common_command cmd;
+	/* Opaque data buffer, nullptr if there is no data transfer */
+	void* buffer;
+	Callback callback;
+	void* context;
+	Priority priority;
+	/* Set Features with a saved value, which any other pending one of the same feature supersedes */
+	bool replay;
+};
+
+enum class Submit {
+	Queued,
+	/* Merged with a pending command of the same feature, the superseded one is not sent */
+	Coalesced,
+	/* All slots are busy */
+	Dropped
+};
+
+template <size_t N>
+class Scheduler {
+	static_assert(N > 0 && N < 256, "Unsupported depth");
+
+public:
+	/**
+	 * The command that will not be sent due to coalescing is returned in `superseded`, to be
+	 * completed by the caller. The merged command keeps the place of the pending one in the queue,
+	 * at the higher of both priorities.
+	 */
+	Submit submit(const Command& command, Command& superseded) {
+		submitted++;
+
+		if (coalescable(command.cmd))
+			for (auto& slot : slots) {
+				if (slot.state != State::Pending || !coalescable(slot.command.cmd) ||
+					feature(slot.command.cmd) != feature(command.cmd))
+					continue;
+
+				auto priority = slot.command.priority > command.priority ? slot.command.priority :
+					command.priority;
+				if (command.replay)
+					superseded = command;
+				else {
+					superseded = slot.command;
+					slot.command = command;
+				}
+				slot.command.priority = priority;
+				coalesced++;
+				return Submit::Coalesced;
+			}
+
+		for (auto& slot : slots) {
+			if (slot.state != State::Free)
+				continue;
+
+			slot = {command, sequence++, State::Pending};
+			depth++;
+			if (depth > maxDepth)
+				maxDepth = depth;
+			return Submit::Queued;
+		}
+
+		dropped++;
+		return Submit::Dropped;
+	}
+
+	/* Marks the next command to run as running and returns its slot, -1 if none is pending */
+	int start(Command& command) {
+		int next {-1};
+		for (size_t i = 0; i < N; i++) {
+			auto& slot = slots[i];
+			if (slot.state != State::Pending)
+				continue;
+			if (next < 0 || slot.command.priority > slots[next].command.priority ||
+				(slot.command.priority == slots[next].command.priority &&
+				 static_cast<int32_t>(slot.sequence - slots[next].sequence) < 0))
+				next = static_cast<int>(i);
+		}
+
+		if (next >= 0) {
+			slots[next].state = State::Running;
+			command = slots[next].command;
+		}
+		return next;
+	}
+
+	/* Frees the slot of a started command once the executor invoked its callback */
+	void finish(int slot) {
+		if (slot < 0 || static_cast<size_t>(slot) >= N || slots[slot].state != State::Running)
+			return;
+
+		slots[slot].state = State::Free;
+		depth--;
+		completed++;
+	}
+
+	/* Pending and running commands */
+	uint32_t pending() const {
+		return depth;
+	}
+
+	uint32_t submitted {0};
+	uint32_t completed {0};
+	uint32_t coalesced {0};
+	uint32_t dropped {0};
+	uint32_t maxDepth {0};
+
+private:
+	static bool coalescable(const NVMe::nvme_common_command& cmd) {
+		return cmd.opcode == NVMe::nvme_admin_set_features;
+	}
+
+	static uint8_t feature(const NVMe::nvme_common_command& cmd) {
+		return static_cast<uint8_t>(cmd.cdw10 & 0xff);
+	}
+
+	enum class State : uint8_t {
+		Free,
+		Pending,
+		Running
+	};
+
+	struct Slot {
+		Command command;
+		uint32_t sequence;
+		State state;
+	} slots[N] {};
+
+	uint32_t sequence {0};
+	uint32_t depth {0};
+};
+
+}
+
+#endif /* nvme_admin_queue_hpp */
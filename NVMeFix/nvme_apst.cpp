@@ -18,6 +18,8 @@
  * Portions Copyright (c) 2011-2014, Intel Corporation.
  */
 
+#include <Headers/kern_time.hpp>
+
 #include "Log.hpp"
 #include "NVMeFixPlugin.hpp"
 
@@ -32,9 +34,9 @@ bool NVMeFixPlugin::enableAPST(ControllerEntry& entry, const NVMe::nvme_id_ctrl*
 		auto res = configureAPST(entry, ctrl);
 		if (res != kIOReturnSuccess) {
 			DBGLOG("nvmef", "Failed to configure APST with 0x%x", res);
-			entry.apste = false;
+			entry.setAPSTE(false);
 		} else /* Assume we turn APST on without double checking in RELEASE builds */
-			entry.apste = true;
+			entry.setAPSTE(true);
 	} else
 		DBGLOG(Log::APST, "Not configuring APST (it is already enabled or quirks prohibit it)");
 
@@ -50,7 +52,16 @@ bool NVMeFixPlugin::enableAPST(ControllerEntry& entry, const NVMe::nvme_id_ctrl*
 	return entry.apste;
 }
 
-/* linux/drivers/nvme/host/core.c:nvme_configure_apst */
+APST::Input NVMeFixPlugin::apstInput(const ControllerEntry& entry, const NVMe::nvme_id_ctrl* ctrl) {
+	APST::Input input;
+	input.psd = ctrl->psd;
+	input.npss = ctrl->npss;
+	input.maxLatencyUs = entry.ps_max_latency_us;
+	input.noDeepest = entry.quirks & NVMe::nvme_quirks::NVME_QUIRK_NO_DEEPEST_PS;
+	APST::applyProfile(*entry.apstProfile, input);
+	return input;
+}
+
 IOReturn NVMeFixPlugin::configureAPST(ControllerEntry& entry, const NVMe::nvme_id_ctrl* ctrl) {
 	assert(ctrl);
 	assert(entry.controller);
@@ -64,89 +75,113 @@ IOReturn NVMeFixPlugin::configureAPST(ControllerEntry& entry, const NVMe::nvme_i
 		return kIOReturnUnsupported;
 	}
 
+	/* Table is only rebuilt when its inputs change */
+	if (entry.apstPlanCurrent()) {
+		DBGLOG(Log::APST, "Reusing APST table");
+		return programAPST(entry, entry.apstPlan);
+	}
+
+	APST::Plan plan;
+	if (!APST::plan(entry.apstPolicy, apstInput(entry, ctrl), entry.apstTuner.distribution(), plan)) {
+		DBGLOG(Log::APST, "No non-operational states are available");
+		/* Profile switch may leave no states, so turn off the previously programmed table */
+		if (entry.apstPlan.maxPs != -1)
+			return programAPST(entry, plan);
+		return kIOReturnSuccess;
+	}
+
+	for (int state = ctrl->npss; state >= 0; state--)
+		DBGLOG_COND(plan.table.entries[state], Log::APST, "Set entry %d to 0x%llx", state,
+					plan.table.entries[state]);
+	DBGLOG(Log::APST, "APST enabled: policy %u, max PS = %d, max round-trip latency = %lluus\n",
+		   static_cast<uint32_t>(entry.apstPolicy), plan.maxPs, plan.maxLatencyUs);
+
+	return programAPST(entry, plan);
+}
+
+IOReturn NVMeFixPlugin::programAPST(ControllerEntry& entry, const APST::Plan& plan) {
 	auto ret = kIOReturnSuccess;
-	auto apstDesc = IOBufferMemoryDescriptor::withCapacity(sizeof(NVMe::nvme_feat_auto_pst),
-														   kIODirectionOut);
+	auto apstDesc = adminBuffer(entry, sizeof(NVMe::nvme_feat_auto_pst));
 
-	if (!apstDesc) {
-		SYSLOG(Log::APST, "Failed to create APST table descriptor");
+	if (!apstDesc)
 		return kIOReturnNoResources;
-	}
 
 	auto apstTable = reinterpret_cast<NVMe::nvme_feat_auto_pst*>(apstDesc->getBytesNoCopy());
-	int max_ps {-1};
-
 	if (apstTable) {
-		memset(apstTable, '\0', sizeof(*apstTable));
-
-		uint64_t target {0};
-		uint64_t max_lat_us {0};
-
-		/*
-		* Walk through all states from lowest- to highest-power.
-		* According to the spec, lower-numbered states use more
-		* power.  NPSS, despite the name, is the index of the
-		* lowest-power state, not the number of states.
-		*/
-		for (int state = ctrl->npss; state >= 0; state--) {
-			if (target) {
-				apstTable->entries[state] = target;
-				DBGLOG(Log::APST, "Set entry %d to 0x%llx", state, target);
-			}
+		lilu_os_memcpy(apstTable, &plan.table, sizeof(*apstTable));
 
-			/*
-			 * Don't allow transitions to the deepest state
-			 * if it's quirked off.
-			 */
-			if (state == ctrl->npss && (entry.quirks & NVMe::nvme_quirks::NVME_QUIRK_NO_DEEPEST_PS))
-				continue;
+		uint32_t dword11 = plan.maxPs != -1;
+		ret = NVMeFeatures(entry, NVMe::NVME_FEAT_AUTO_PST, &dword11, apstDesc, nullptr, true);
+		if (ret == kIOReturnSuccess && &plan != &entry.apstPlan) {
+			entry.apstPlan = plan;
+			entry.apstPlanned();
+		}
+	} else {
+		SYSLOG(Log::APST, "Failed to get table buffer");
+		ret = kIOReturnNoResources;
+	}
 
-			/*
-			 * Is this state a useful non-operational state for
-			 * higher-power states to autonomously transition to?
-			 */
-			if (!(ctrl->psd[state].flags & NVMe::NVME_PS_FLAGS_NON_OP_STATE))
-				continue;
+	returnAdminBuffer(entry, apstDesc);
+	return ret;
+}
 
-			uint64_t exit_latency_us = ctrl->psd[state].exit_lat;
-			if (exit_latency_us > entry.ps_max_latency_us)
-				continue;
+void NVMeFixPlugin::publishAPSTStats(ControllerEntry& entry) {
+	entry.controller->setProperty("apst-retunes", entry.apstRetunes, 32);
+	entry.controller->setProperty("apst-resume-hits", entry.apstResumeHits, 32);
+	entry.controller->setProperty("apst-resume-misses", entry.apstResumeMisses, 32);
+	entry.controller->setProperty("admin-allocs-avoided", entry.adminAllocsAvoided, 32);
+	entry.controller->setProperty("admin-wakeups", entry.adminWakeups, 32);
+	entry.controller->setProperty("admin-wakeups-avoided", entry.adminWakeupsAvoided, 32);
+}
 
-			uint64_t total_latency_us = exit_latency_us + ctrl->psd[state].entry_lat;
-			/*
-			 * This state is good.  Use it as the APST idle
-			 * target for higher power states.
-			 */
-			uint64_t transition_ms = total_latency_us + 19;
-			transition_ms /= 20;
-			if (transition_ms > (1ull << 24) - 1)
-				transition_ms = (1ull << 24) - 1;
+IOReturn NVMeFixPlugin::setAPSTProfile(ControllerEntry& entry, const APST::Profile& profile) {
+	IOReturn ret = kIOReturnSuccess;
+
+	IOLockLock(entry.lck);
+
+	DBGLOG(Log::APST, "Switching to %s profile", profile.name);
+	entry.apstProfile = &profile;
+	entry.controller->setProperty("apst-profile", profile.name);
+
+	/* Apply right away, the cached table no longer matches the profile */
+	if (entry.apstManaged && entry.identify) {
+		auto ctrl = static_cast<const NVMe::nvme_id_ctrl*>(entry.identify->getBytesNoCopy());
+		ret = ctrl ? configureAPST(entry, ctrl) : kIOReturnInternalError;
+		if (ret != kIOReturnSuccess)
+			SYSLOG(Log::APST, "Failed to apply %s profile with 0x%x", profile.name, ret);
+		else {
+			/* Profile may leave no usable states, and a later one bring them back */
+			entry.setAPSTE(entry.apstPlan.maxPs != -1);
+			entry.controller->setProperty("apst", entry.apste);
+		}
+	}
 
-			target = (state << 3ull) | (transition_ms << 8ull);
+	IOLockUnlock(entry.lck);
+	return ret;
+}
 
-			if (max_ps == -1)
-				max_ps = state;
+void NVMeFixPlugin::retuneAPST(ControllerEntry& entry) {
+	if (!entry.apste || entry.apstPolicy != APST::Policy::CostModel || !entry.identify)
+		return;
 
-			if (total_latency_us > max_lat_us)
-				max_lat_us = total_latency_us;
-		}
+	auto ctrl = static_cast<const NVMe::nvme_id_ctrl*>(entry.identify->getBytesNoCopy());
+	if (!ctrl)
+		return;
 
-		if (max_ps == -1)
-			DBGLOG(Log::APST, "No non-operational states are available");
-		else
-			DBGLOG(Log::APST, "APST enabled: max PS = %d, max round-trip latency = %lluus\n",
-				max_ps, max_lat_us);
-	} else
-		SYSLOG(Log::APST, "Failed to get table buffer");
+	APST::Plan plan;
+	if (!entry.apstTuner.retune(apstInput(entry, ctrl), entry.apstPlan, getCurrentTimeNs() / 1000,
+								plan))
+		return;
 
-	if (max_ps != -1) {
-		uint32_t dword11 {1};
-		ret = NVMeFeatures(entry, NVMe::NVME_FEAT_AUTO_PST, &dword11, apstDesc, nullptr, true);
+	DBGLOG(Log::APST, "Retuning APST table: max PS = %d, max round-trip latency = %lluus",
+		   plan.maxPs, plan.maxLatencyUs);
+	if (programAPST(entry, plan) != kIOReturnSuccess) {
+		SYSLOG(Log::APST, "Failed to program retuned APST table");
+		return;
 	}
 
-	if (apstDesc)
-		apstDesc->release();
-	return ret;
+	entry.apstRetunes++;
+	publishAPSTStats(entry);
 }
 
 IOReturn NVMeFixPlugin::APSTenabled(ControllerEntry& entry, bool& enabled) {
@@ -160,31 +195,212 @@ IOReturn NVMeFixPlugin::APSTenabled(ControllerEntry& entry, bool& enabled) {
 	return ret;
 }
 
-IOReturn NVMeFixPlugin::dumpAPST(ControllerEntry& entry, int npss) {
+IOReturn NVMeFixPlugin::readAPST(ControllerEntry& entry, NVMe::nvme_feat_auto_pst& table) {
 	assert(entry.controller);
 
-	auto ret = kIOReturnSuccess;
-	auto apstDesc = IOBufferMemoryDescriptor::withCapacity(sizeof(NVMe::nvme_feat_auto_pst),
-														   kIODirectionIn);
-	if (!apstDesc) {
-		SYSLOG(Log::APST, "Failed to create APST table descriptor");
+	auto apstDesc = adminBuffer(entry, sizeof(NVMe::nvme_feat_auto_pst));
+	if (!apstDesc)
 		return kIOReturnNoResources;
-	}
 
 	auto apstTable = static_cast<NVMe::nvme_feat_auto_pst*>(apstDesc->getBytesNoCopy());
-	memset(apstTable, '\0', apstDesc->getLength());
 
-	if (NVMeFeatures(entry, NVMe::NVME_FEAT_AUTO_PST, nullptr, apstDesc, nullptr, false) !=
-		kIOReturnSuccess) {
+	auto ret = NVMeFeatures(entry, NVMe::NVME_FEAT_AUTO_PST, nullptr, apstDesc, nullptr, false);
+	if (ret != kIOReturnSuccess)
 		DBGLOG(Log::APST, "Failed to get features");
-		goto fail;
-	}
+	else
+		lilu_os_memcpy(&table, apstTable, sizeof(table));
+
+	returnAdminBuffer(entry, apstDesc);
+	return ret;
+}
 
-	for (int state = npss; state >= 0; state--)
-		DBGLOG(Log::APST, "entry %d : 0x%llx", state, apstTable->entries[state]);
+IOReturn NVMeFixPlugin::dumpAPST(ControllerEntry& entry, int npss) {
+	NVMe::nvme_feat_auto_pst table;
+	auto ret = readAPST(entry, table);
+
+	if (ret == kIOReturnSuccess)
+		for (int state = npss; state >= 0; state--)
+			DBGLOG(Log::APST, "entry %d : 0x%llx", state, table.entries[state]);
 
-fail:
-	if (apstDesc)
-		apstDesc->release();
 	return ret;
 }
+
+/**
+ * Controllers lose APST settings on reset, but many of them keep the settings across D3.
+ * Query APSTE first, and only when it was dropped replay the last table together with every
+ * other feature we set, which were lost in the same reset.
+ */
+bool NVMeFixPlugin::restoreAPST(ControllerEntry& entry, const NVMe::nvme_id_ctrl* ctrl) {
+	if (entry.apstPlan.maxPs == -1)
+		return enableAPST(entry, ctrl);
+
+	bool enabled {false};
+	apstResumed(entry, APSTenabled(entry, enabled) == kIOReturnSuccess && enabled);
+	return entry.apste;
+}
+
+void NVMeFixPlugin::apstResumed(ControllerEntry& entry, bool retained) {
+#ifdef DEBUG
+	NVMe::nvme_feat_auto_pst table;
+	if (retained && readAPST(entry, table) == kIOReturnSuccess &&
+		memcmp(&table, &entry.apstPlan.table, sizeof(table))) {
+		DBGLOG(Log::APST, "APST is enabled, but the table differs");
+		retained = false;
+	}
+#endif
+
+	if (retained) {
+		entry.apstResumeHits++;
+		DBGLOG(Log::APST, "APST retained over power transition");
+	} else {
+		entry.apstResumeMisses++;
+		DBGLOG(Log::APST, "APST lost over power transition, replaying features");
+		entry.featuresLost = true;
+		restoreFeatures(entry, true);
+		entry.controller->setProperty("apst", entry.apste);
+	}
+
+	publishAPSTStats(entry);
+}
+
+/* Completion of the APSTE query queued by powerStateDidChangeTo */
+void NVMeFixPlugin::apstChecked(void* owner, void*, int status, uint32_t result) {
+	auto& entry = *static_cast<ControllerEntry*>(owner);
+	if (status == kIOReturnAborted)
+		return;
+
+	NVMeFixPlugin::globalPlugin().apstResumed(entry, status == kIOReturnSuccess && result);
+	entry.resumeLatency.record((getCurrentTimeNs() - entry.resumeStartNs) / 1000);
+}
+
+void NVMeFixPlugin::saveFeature(ControllerEntry& entry, unsigned fid, uint32_t dword11) {
+	for (auto& feature : entry.savedFeatures)
+		if (feature.fid == fid) {
+			feature.valid = true;
+			feature.dword11 = dword11;
+		}
+}
+
+/**
+ * Sets saved features again back-to-back from the recorded command dwords and the last programmed
+ * APST table, without querying the controller or planning anything anew.
+ */
+void NVMeFixPlugin::restoreFeatures(ControllerEntry& entry, bool powerState) {
+	if (!__atomic_load_n(&entry.featuresLost, __ATOMIC_RELAXED))
+		return;
+
+	entry.featuresLost = false;
+	entry.resumeReplays++;
+
+	for (auto& feature : entry.savedFeatures) {
+		if (!feature.valid || (feature.fid == NVMe::NVME_FEAT_POWER_MGMT && !powerState))
+			continue;
+
+		IOReturn ret;
+		if (feature.fid == NVMe::NVME_FEAT_AUTO_PST) {
+			ret = programAPST(entry, entry.apstPlan);
+			entry.setAPSTE(ret == kIOReturnSuccess && entry.apstPlan.maxPs != -1);
+		} else {
+			unsigned dword11 = feature.dword11;
+			ret = NVMeFeatures(entry, feature.fid, &dword11, nullptr, nullptr, true);
+			if (feature.fid == NVMe::NVME_FEAT_POWER_MGMT)
+				entry.psKnown = ret == kIOReturnSuccess ? static_cast<int>(dword11 & 0x1f) : -1;
+		}
+
+		if (ret != kIOReturnSuccess) {
+			SYSLOG(Log::APST, "Failed to replay feature 0x%x with 0x%x", feature.fid, ret);
+			entry.featuresLost = true;
+		}
+	}
+}
+
+/**
+ * Queues saved features to be set again ahead of anything else on the workloop, unless a newer
+ * value of the same feature is pending anyway. Returns false if they have to be replayed right away.
+ */
+bool NVMeFixPlugin::replayFeatures(ControllerEntry& entry) {
+	if (!entry.adminTimer || __atomic_load_n(&entry.replaysPending, __ATOMIC_RELAXED))
+		return false;
+
+	entry.featuresLost = false;
+	entry.resumeReplays++;
+
+	for (auto& feature : entry.savedFeatures) {
+		if (!feature.valid)
+			continue;
+
+		Admin::Command command {};
+		command.cmd.opcode = NVMe::nvme_admin_set_features;
+		command.cmd.cdw10 = feature.fid;
+		command.cmd.cdw11 = feature.dword11;
+		command.callback = featureReplayed;
+		command.priority = Admin::Priority::Resume;
+		command.replay = true;
+
+		/* The table buffer is the context, so that the callback can give it back */
+		IOBufferMemoryDescriptor* desc {nullptr};
+		if (feature.fid == NVMe::NVME_FEAT_AUTO_PST) {
+			desc = adminBuffer(entry, sizeof(NVMe::nvme_feat_auto_pst));
+			if (!desc) {
+				entry.featuresLost = true;
+				continue;
+			}
+			lilu_os_memcpy(desc->getBytesNoCopy(), &entry.apstPlan.table, sizeof(entry.apstPlan.table));
+			command.cmd.cdw11 = entry.apstPlan.maxPs != -1;
+			command.buffer = command.context = desc;
+		}
+
+		/* Superseded replays complete right in submitAdmin, and power state may be superseded by IOPM */
+		__atomic_add_fetch(&entry.replaysPending, 1, __ATOMIC_RELAXED);
+		if (submitAdmin(entry, command) != kIOReturnSuccess) {
+			__atomic_sub_fetch(&entry.replaysPending, 1, __ATOMIC_RELAXED);
+			if (desc)
+				returnAdminBuffer(entry, desc);
+			entry.featuresLost = true;
+		}
+	}
+
+	if (!__atomic_load_n(&entry.replaysPending, __ATOMIC_RELAXED))
+		entry.resumeLatency.record((getCurrentTimeNs() - entry.resumeStartNs) / 1000);
+	return true;
+}
+
+/* Features that failed are replayed synchronously by the next periodic run */
+void NVMeFixPlugin::featureReplayed(void* owner, void* context, int status, uint32_t) {
+	auto& entry = *static_cast<ControllerEntry*>(owner);
+
+	if (context) {
+		if (status != kIOReturnAborted)
+			entry.setAPSTE(status == kIOReturnSuccess && entry.apstPlan.maxPs != -1);
+		NVMeFixPlugin::globalPlugin().returnAdminBuffer(entry, static_cast<IOBufferMemoryDescriptor*>(context));
+	}
+
+	if (status != kIOReturnSuccess && status != kIOReturnAborted) {
+		SYSLOG(Log::APST, "Failed to replay feature with 0x%x", status);
+		entry.featuresLost = true;
+	}
+
+	if (!__atomic_sub_fetch(&entry.replaysPending, 1, __ATOMIC_RELAXED))
+		entry.resumeLatency.record((getCurrentTimeNs() - entry.resumeStartNs) / 1000);
+}
+
+/**
+ * With Non-Operational Power State Permissive Mode the controller may service admin commands, e.g.
+ * our own Get Features, without leaving the non-operational state entered via APST.
+ * The setting is lost on reset, and is then replayed together with APST table.
+ */
+bool NVMeFixPlugin::enableNOPSPM(ControllerEntry& entry, const NVMe::nvme_id_ctrl* ctrl) {
+	if (!(ctrl->ctratt & NVMe::NVME_CTRL_ATTR_NOPSPM)) {
+		DBGLOG(Log::APST, "NOPSPM unsupported by this controller");
+		return false;
+	}
+
+	unsigned dword11 {1}; /* NOPPME */
+	auto ret = NVMeFeatures(entry, NVMe::NVME_FEAT_NOPSC, &dword11, nullptr, nullptr, true);
+	if (ret != kIOReturnSuccess)
+		SYSLOG(Log::APST, "Failed to enable NOPSPM with 0x%x", ret);
+
+	entry.nopspm = ret == kIOReturnSuccess;
+	entry.controller->setProperty("nops-permissive", entry.nopspm);
+	return entry.nopspm;
+}
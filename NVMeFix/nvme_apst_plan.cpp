@@ -0,0 +1,432 @@
+//
+// @file nvme_apst_plan.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * NVM Express device driver
+ * Portions Copyright (c) 2011-2014, Intel Corporation.
+ */
+
+#include "nvme_apst_plan.hpp"
+
+namespace APST {
+
+namespace {
+/* Histogram weights are normalised to this sum to keep energy sums within 64 bits */
+constexpr uint64_t weightScale {256};
+/* Nothing sane draws more than 100 W, and larger values would overflow energy sums */
+constexpr uint64_t powerCapUw {100000000};
+/* Same for latencies over 10 s, only the cost is capped and not the latency limit check */
+constexpr uint64_t latencyCapUs {10000000};
+/* Exits weighted over 10 times their energy already rule out any state worth considering */
+constexpr uint64_t penaltyCapPercent {1000};
+/* Do not consider more states than this for the cost model chain */
+constexpr size_t maxCandidates {8};
+constexpr uint64_t never {UINT64_MAX};
+constexpr uint64_t maxItptMs {(1ull << 24) - 1};
+
+uint64_t entryFor(unsigned state, uint64_t itptMs) {
+	if (itptMs > maxItptMs)
+		itptMs = maxItptMs;
+	return (static_cast<uint64_t>(state) << 3) | (itptMs << 8);
+}
+
+uint64_t min64(uint64_t a, uint64_t b) {
+	return a < b ? a : b;
+}
+
+/* Transition time shortened by the profile, but not below the 1 ms ITPT granularity */
+uint64_t scaledItptMs(const Input& in, uint64_t itptMs) {
+	if (in.itptPercent >= 100)
+		return itptMs;
+	itptMs = min64(itptMs, maxItptMs) * in.itptPercent / 100;
+	return itptMs ? itptMs : 1;
+}
+
+struct Model {
+	const Input& in;
+	uint64_t weight[IdleHistogram::nbuckets] {};
+	/* PS0 idle power, spent while waiting for the first transition */
+	uint64_t opUw {0};
+	/* PS0 maximum power, spent during entry and exit */
+	uint64_t transitionUw {0};
+
+	Model(const Input& in, const IdleHistogram& hist) : in(in) {
+		auto total = hist.total();
+		for (size_t b = 0; total && b < IdleHistogram::nbuckets; b++)
+			weight[b] = hist.counts[b] * weightScale / total;
+		opUw = powerUw(in.psd[0], true);
+		transitionUw = powerUw(in.psd[0], false);
+	}
+
+	uint64_t enterCost(unsigned state) const {
+		return transitionUw * min64(in.psd[state].entry_lat, latencyCapUs);
+	}
+
+	uint64_t exitCost(unsigned state) const {
+		return transitionUw * min64(in.psd[state].exit_lat, latencyCapUs) *
+			(100 + min64(in.exitPenaltyPercent, penaltyCapPercent)) / 100;
+	}
+
+	/* Weighted energy spent in PS0 before the first transition at `leaveUs` */
+	uint64_t opCost(uint64_t leaveUs) const {
+		uint64_t cost {0};
+		for (size_t b = 0; b < IdleHistogram::nbuckets; b++)
+			cost += weight[b] * opUw * min64(IdleHistogram::typicalUs(b), leaveUs);
+		return cost;
+	}
+
+	/**
+	 * Weighted energy spent in `state` when it is entered `enterUs` after going idle and left for
+	 * a deeper state at `leaveUs`. Exit cost is accounted to the state the interval ends in.
+	 */
+	uint64_t stageCost(unsigned state, uint64_t enterUs, uint64_t leaveUs) const {
+		uint64_t cost {0};
+		auto uw = powerUw(in.psd[state], true);
+
+		for (size_t b = 0; b < IdleHistogram::nbuckets; b++) {
+			auto idle = IdleHistogram::typicalUs(b);
+			if (idle <= enterUs || !weight[b])
+				continue;
+
+			uint64_t energy = enterCost(state) + uw * (min64(idle, leaveUs) - enterUs);
+			if (idle <= leaveUs)
+				energy += exitCost(state);
+			cost += weight[b] * energy;
+		}
+
+		return cost;
+	}
+
+	/* Shortest sensible idle time before attempting a transition to `state` */
+	uint64_t floorUs(unsigned state) const {
+		uint64_t roundTrip = in.psd[state].entry_lat + in.psd[state].exit_lat;
+		roundTrip = (roundTrip + 999) / 1000 * 1000;
+		return roundTrip > 1000 ? roundTrip : 1000;
+	}
+};
+
+/* Number of 24-bit ITPT milliseconds between two points of the time grid */
+uint64_t itptMs(uint64_t fromUs, uint64_t toUs) {
+	return (toUs - fromUs) / 1000;
+}
+}
+
+size_t IdleHistogram::bucketFor(uint64_t idleUs) {
+	auto ms = idleUs / 1000;
+	size_t b {0};
+	while (ms > 1 && b < nbuckets - 1) {
+		ms >>= 1;
+		b++;
+	}
+	return b;
+}
+
+void IdleHistogram::add(uint64_t idleUs, uint32_t n) {
+	auto& c = counts[bucketFor(idleUs)];
+	c = c > UINT32_MAX - n ? UINT32_MAX : c + n;
+}
+
+uint64_t IdleHistogram::total() const {
+	uint64_t sum {0};
+	for (auto c : counts)
+		sum += c;
+	return sum;
+}
+
+IdleHistogram IdleHistogram::uniform() {
+	IdleHistogram hist;
+	for (auto& c : hist.counts)
+		c = 1;
+	return hist;
+}
+
+uint64_t powerUw(const NVMe::nvme_id_power_state& ps, bool idle) {
+	uint64_t uw;
+
+	/* IPS field: 01b is 0.0001 W, 10b is 0.01 W, 00b means idle power is not reported */
+	auto ips = ps.idle_scale >> 6;
+	if (idle && ps.idle_power && (ips == 1 || ips == 2))
+		uw = ps.idle_power * (ips == 1 ? 100ull : 10000ull);
+	else
+		uw = ps.max_power * ((ps.flags & NVMe::NVME_PS_FLAGS_MAX_POWER_SCALE) ? 100ull : 10000ull);
+
+	return uw > powerCapUw ? powerCapUw : uw;
+}
+
+/* Whether `state` is a non-operational state within limits, disregarding maxStates */
+static bool eligible(const Input& in, unsigned state) {
+	/* Nothing transitions to PS0, whatever it claims to be */
+	if (state == 0)
+		return false;
+
+	/*
+	 * Don't allow transitions to the deepest state
+	 * if it's quirked off.
+	 */
+	if (state == in.npss && in.noDeepest)
+		return false;
+
+	/*
+	 * Is this state a useful non-operational state for
+	 * higher-power states to autonomously transition to?
+	 */
+	if (!(in.psd[state].flags & NVMe::NVME_PS_FLAGS_NON_OP_STATE))
+		return false;
+
+	return in.psd[state].exit_lat <= in.maxLatencyUs;
+}
+
+bool usable(const Input& in, unsigned state) {
+	if (!eligible(in, state))
+		return false;
+	if (!in.maxStates)
+		return true;
+
+	unsigned shallower {0};
+	for (unsigned s = 0; s < state; s++)
+		if (eligible(in, s))
+			shallower++;
+	return shallower < in.maxStates;
+}
+
+const Profile profiles[] {
+	/* Shallowest state only, short wake latency */
+	{"performance", 10000, 1, 400, 100},
+	{"balanced", 0, 0, 100, 100},
+	/* Every state the latency limit allows, wake latency is free, and states are entered twice as soon */
+	{"battery", 0, 0, 0, 50},
+};
+
+const size_t nprofiles {sizeof(profiles) / sizeof(profiles[0])};
+
+const Profile& defaultProfile() {
+	return profiles[1];
+}
+
+const Profile* profileForName(const char* name) {
+	for (size_t i = 0; name && i < nprofiles; i++)
+		if (!strcmp(profiles[i].name, name))
+			return &profiles[i];
+	return nullptr;
+}
+
+void applyProfile(const Profile& profile, Input& in) {
+	if (profile.maxLatencyUs && profile.maxLatencyUs < in.maxLatencyUs)
+		in.maxLatencyUs = profile.maxLatencyUs;
+	in.maxStates = profile.maxStates;
+	in.exitPenaltyPercent = profile.exitPenaltyPercent;
+	in.itptPercent = profile.itptPercent;
+}
+
+/* linux/drivers/nvme/host/core.c:nvme_configure_apst */
+void planGreedy(const Input& in, Plan& plan) {
+	plan = {};
+
+	uint64_t target {0};
+
+	/*
+	 * Walk through all states from lowest- to highest-power.
+	 * According to the spec, lower-numbered states use more
+	 * power.  NPSS, despite the name, is the index of the
+	 * lowest-power state, not the number of states.
+	 */
+	for (int state = in.npss; state >= 0; state--) {
+		if (target)
+			plan.table.entries[state] = target;
+
+		if (!usable(in, state))
+			continue;
+
+		uint64_t total_latency_us = in.psd[state].exit_lat + in.psd[state].entry_lat;
+		/*
+		 * This state is good.  Use it as the APST idle
+		 * target for higher power states.
+		 */
+		uint64_t transition_ms = total_latency_us + 19;
+		transition_ms /= 20;
+
+		target = entryFor(state, scaledItptMs(in, transition_ms));
+
+		if (plan.maxPs == -1)
+			plan.maxPs = state;
+
+		if (total_latency_us > plan.maxLatencyUs)
+			plan.maxLatencyUs = total_latency_us;
+	}
+}
+
+/**
+ * APST lets every state autonomously transition to a single deeper state after some idle time, so
+ * starting from PS0 the controller walks a chain of increasingly deep non-operational states.
+ * Chain members and their transition times are picked by dynamic programming over candidate states
+ * and a millisecond time grid matching the histogram buckets, minimising the expected energy of an
+ * idle interval. Entry and exit are charged at PS0 maximum power for the declared latency.
+ */
+void planCostModel(const Input& in, const IdleHistogram& hist, Plan& plan) {
+	plan = {};
+
+	constexpr size_t ntimes {IdleHistogram::nbuckets};
+	Model model(in, hist);
+
+	/* Keep the deepest usable states if there are too many */
+	unsigned cand[maxCandidates];
+	size_t ncand {0};
+	for (int state = in.npss; state >= 0 && ncand < maxCandidates; state--)
+		if (usable(in, state))
+			ncand++;
+	for (int state = in.npss, i = static_cast<int>(ncand) - 1; state >= 0 && i >= 0; state--)
+		if (usable(in, state))
+			cand[i--] = state;
+
+	if (!ncand)
+		return;
+
+	/* best[k][g]: cost of the chain suffix entering cand[k] at grid time g */
+	uint64_t best[maxCandidates][ntimes];
+	struct {
+		uint8_t k, g;
+	} next[maxCandidates][ntimes];
+	constexpr uint8_t none {0xff};
+
+	for (int k = static_cast<int>(ncand) - 1; k >= 0; k--) {
+		for (size_t g = 0; g < ntimes; g++) {
+			auto enterUs = IdleHistogram::lowerBoundUs(g);
+			best[k][g] = model.stageCost(cand[k], enterUs, never);
+			next[k][g] = {none, none};
+
+			for (size_t k2 = k + 1; k2 < ncand; k2++) {
+				/* Deeper state must be worth it */
+				if (powerUw(in.psd[cand[k2]], true) >= powerUw(in.psd[cand[k]], true))
+					continue;
+
+				for (size_t h = g + 1; h < ntimes; h++) {
+					auto leaveUs = IdleHistogram::lowerBoundUs(h);
+					if (leaveUs - enterUs < model.floorUs(cand[k2]))
+						continue;
+
+					auto cost = model.stageCost(cand[k], enterUs, leaveUs) + best[k2][h];
+					if (cost < best[k][g]) {
+						best[k][g] = cost;
+						next[k][g] = {static_cast<uint8_t>(k2), static_cast<uint8_t>(h)};
+					}
+				}
+			}
+		}
+	}
+
+	/* Staying in PS0 forever is the baseline */
+	auto bestCost = model.opCost(never);
+	int firstK {-1}, firstG {-1};
+
+	for (size_t k = 0; k < ncand; k++) {
+		for (size_t g = 0; g < ntimes; g++) {
+			auto enterUs = IdleHistogram::lowerBoundUs(g);
+			if (enterUs < model.floorUs(cand[k]))
+				continue;
+
+			auto cost = model.opCost(enterUs) + best[k][g];
+			if (cost < bestCost) {
+				bestCost = cost;
+				firstK = static_cast<int>(k);
+				firstG = static_cast<int>(g);
+			}
+		}
+	}
+
+	if (firstK < 0)
+		return;
+
+	/* Unroll the chain */
+	unsigned chain[maxCandidates];
+	uint64_t chainUs[maxCandidates];
+	size_t nchain {0};
+
+	for (uint8_t k = firstK, g = firstG; k != none; ) {
+		chain[nchain] = cand[k];
+		chainUs[nchain] = IdleHistogram::lowerBoundUs(g);
+		nchain++;
+
+		auto n = next[k][g];
+		k = n.k;
+		g = n.g;
+	}
+
+	/*
+	 * Every state transitions to the next chain member deeper than itself. States in between
+	 * chain members behave as if they were the shallower chain member.
+	 */
+	for (int state = in.npss; state >= 0; state--) {
+		size_t i {0};
+		while (i < nchain && chain[i] <= static_cast<unsigned>(state))
+			i++;
+		if (i == nchain)
+			continue;
+
+		auto fromUs = i ? chainUs[i - 1] : 0;
+		plan.table.entries[state] = entryFor(chain[i], scaledItptMs(in, itptMs(fromUs, chainUs[i])));
+	}
+
+	plan.maxPs = chain[nchain - 1];
+	for (size_t i = 0; i < nchain; i++) {
+		uint64_t total = in.psd[chain[i]].entry_lat + in.psd[chain[i]].exit_lat;
+		if (total > plan.maxLatencyUs)
+			plan.maxLatencyUs = total;
+	}
+}
+
+bool plan(Policy policy, const Input& in, const IdleHistogram& hist, Plan& plan) {
+	if (policy == Policy::CostModel)
+		planCostModel(in, hist, plan);
+	else
+		planGreedy(in, plan);
+	return plan.maxPs != -1;
+}
+
+uint64_t expectedEnergy(const Input& in, const Plan& plan, const IdleHistogram& hist) {
+	Model model(in, hist);
+	uint64_t cost {0};
+
+	for (size_t b = 0; b < IdleHistogram::nbuckets; b++) {
+		if (!model.weight[b])
+			continue;
+
+		auto idle = IdleHistogram::typicalUs(b);
+		unsigned state {0};
+		uint64_t nowUs {0};
+		uint64_t energy {0};
+
+		/* Follow the table from PS0 until the interval ends; guard against cycles */
+		for (unsigned hops = 0; hops <= in.npss; hops++) {
+			auto e = plan.table.entries[state];
+			auto target = static_cast<unsigned>((e >> 3) & 0x1f);
+			auto itptUs = ((e >> 8) & maxItptMs) * 1000;
+			if (!e || target > in.npss || nowUs + itptUs >= idle)
+				break;
+
+			energy += powerUw(in.psd[state], true) * itptUs + model.enterCost(target);
+			nowUs += itptUs;
+			state = target;
+		}
+
+		energy += powerUw(in.psd[state], true) * (idle - nowUs);
+		if (state != 0)
+			energy += model.exitCost(state);
+
+		cost += model.weight[b] * energy;
+	}
+
+	return cost / weightScale;
+}
+}
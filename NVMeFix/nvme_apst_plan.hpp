@@ -0,0 +1,137 @@
+//
+// @file nvme_apst_plan.hpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+#ifndef nvme_apst_plan_hpp
+#define nvme_apst_plan_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "nvme.h"
+
+/**
+ * APST table planning.
+ * Nothing in here depends on IOKit or Lilu, so the planner may be built for the host and run
+ * against recorded power state descriptor tables.
+ */
+namespace APST {
+
+enum class Policy : uint32_t {
+	/* linux/drivers/nvme/host/core.c:nvme_configure_apst */
+	Greedy    = 0,
+	/* Minimise expected idle energy for a given idle interval distribution */
+	CostModel = 1,
+};
+
+/**
+ * Idle interval distribution.
+ * Bucket i counts idle intervals of [2^i, 2^(i+1)) ms. The first bucket also includes everything
+ * shorter than 1 ms, and the last bucket is open-ended.
+ */
+struct IdleHistogram {
+	static constexpr size_t nbuckets {16};
+	uint32_t counts[nbuckets] {};
+
+	static size_t bucketFor(uint64_t idleUs);
+
+	static uint64_t lowerBoundUs(size_t bucket) {
+		return 1000ull << bucket;
+	}
+
+	/* Idle interval taken as representative for the whole bucket */
+	static uint64_t typicalUs(size_t bucket) {
+		return 1500ull << bucket;
+	}
+
+	void add(uint64_t idleUs, uint32_t n = 1);
+	uint64_t total() const;
+
+	/* Every octave is equally likely. Used when nothing has been observed yet. */
+	static IdleHistogram uniform();
+};
+
+struct Input {
+	const NVMe::nvme_id_power_state* psd {nullptr};
+	/* Index of the lowest-power state, not the number of states */
+	unsigned npss {0};
+	uint64_t maxLatencyUs {0};
+	/* NVME_QUIRK_NO_DEEPEST_PS */
+	bool noDeepest {false};
+	/* Only use this many shallowest usable non-operational states, 0 for all */
+	unsigned maxStates {0};
+	/* Extra weight of exit cost in percent, standing for the added wake latency */
+	uint64_t exitPenaltyPercent {0};
+	/* Idle time before every transition in percent of the planned one */
+	uint64_t itptPercent {100};
+};
+
+/**
+ * Named trade-off between wake latency and idle power, switchable at runtime.
+ */
+struct Profile {
+	const char* name;
+	/* Latency limit on top of ps-max-latency-us, 0 for none */
+	uint64_t maxLatencyUs;
+	unsigned maxStates;
+	uint64_t exitPenaltyPercent;
+	uint64_t itptPercent;
+};
+
+extern const Profile profiles[];
+extern const size_t nprofiles;
+
+/* Balanced profile */
+const Profile& defaultProfile();
+/* Returns nullptr for unknown names */
+const Profile* profileForName(const char* name);
+void applyProfile(const Profile& profile, Input& in);
+
+struct Plan {
+	NVMe::nvme_feat_auto_pst table {};
+	/* Deepest state the table transitions to, -1 if there is none */
+	int maxPs {-1};
+	/* Worst entry + exit latency among the used states */
+	uint64_t maxLatencyUs {0};
+};
+
+/**
+ * Power drawn in the state, in microwatts.
+ * If `idle` is set, idle power is used when reported by the controller, otherwise the maximum
+ * power is assumed.
+ */
+uint64_t powerUw(const NVMe::nvme_id_power_state& ps, bool idle);
+
+/* Whether `state` is a non-operational state APST may autonomously transition to */
+bool usable(const Input& in, unsigned state);
+
+void planGreedy(const Input& in, Plan& plan);
+void planCostModel(const Input& in, const IdleHistogram& hist, Plan& plan);
+
+/**
+ * Build APST table with the given policy. Returns false if the controller
+ * does not have any usable non-operational states.
+ */
+bool plan(Policy policy, const Input& in, const IdleHistogram& hist, Plan& plan);
+
+/**
+ * Expected energy in picojoules spent over one idle interval drawn from `hist`, assuming the
+ * controller idles in PS0 and follows `plan` from there. Exit energy is weighted by the
+ * exit penalty of the input.
+ */
+uint64_t expectedEnergy(const Input& in, const Plan& plan, const IdleHistogram& hist);
+}
+
+#endif /* nvme_apst_plan_hpp */
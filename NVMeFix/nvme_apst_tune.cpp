@@ -0,0 +1,70 @@
+//
+// @file nvme_apst_tune.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+#include "nvme_apst_tune.hpp"
+
+namespace APST {
+
+void Tuner::tickle(uint64_t nowUs) {
+	/* Called concurrently from every CPU submitting I/O, so only atomic updates here */
+	auto last = __atomic_exchange_n(&lastTickleUs, nowUs, __ATOMIC_RELAXED);
+	if (last && nowUs > last && nowUs - last >= minIdleUs) {
+		__atomic_fetch_add(&hist.counts[IdleHistogram::bucketFor(nowUs - last)], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&samples, 1, __ATOMIC_RELAXED);
+	}
+}
+
+bool Tuner::retune(const Input& in, const Plan& current, uint64_t nowUs, Plan& plan) {
+	if (__atomic_load_n(&samples, __ATOMIC_RELAXED) < minSamples)
+		return false;
+	if (updated && nowUs - lastUpdateUs < holdUs)
+		return false;
+
+	auto dist = distribution();
+	planCostModel(in, dist, plan);
+
+	/* Halve the weight of everything seen so far, so the fit follows the workload */
+	for (auto& c : hist.counts) {
+		auto n = __atomic_load_n(&c, __ATOMIC_RELAXED);
+		__atomic_fetch_sub(&c, n - n / 2, __ATOMIC_RELAXED);
+	}
+	__atomic_store_n(&samples, 0, __ATOMIC_RELAXED);
+
+	bool same {true};
+	for (size_t i = 0; i < sizeof(plan.table.entries) / sizeof(plan.table.entries[0]); i++)
+		same &= plan.table.entries[i] == current.table.entries[i];
+	if (same || plan.maxPs == -1)
+		return false;
+
+	auto oldEnergy = expectedEnergy(in, current, dist);
+	auto newEnergy = expectedEnergy(in, plan, dist);
+	if (newEnergy * 100 > oldEnergy * (100 - minGainPercent))
+		return false;
+
+	updated = true;
+	lastUpdateUs = nowUs;
+	return true;
+}
+
+IdleHistogram Tuner::distribution() const {
+	IdleHistogram snapshot;
+	for (size_t i = 0; i < IdleHistogram::nbuckets; i++)
+		snapshot.counts[i] = __atomic_load_n(&hist.counts[i], __ATOMIC_RELAXED);
+	return snapshot.total() ? snapshot : IdleHistogram::uniform();
+}
+
+void Tuner::reset() {
+	*this = {};
+}
+}
@@ -0,0 +1,68 @@
+//
+// @file nvme_apst_tune.hpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+#ifndef nvme_apst_tune_hpp
+#define nvme_apst_tune_hpp
+
+#include <stdint.h>
+
+#include "nvme_apst_plan.hpp"
+
+namespace APST {
+
+/**
+ * Fits APST table to the idle intervals observed between I/O requests.
+ * Time is passed in by the caller, so the tuner may be fed synthetic timestamps.
+ */
+class Tuner {
+public:
+	/* Gaps shorter than this cost the same under any table, so they are not recorded */
+	static constexpr uint64_t minIdleUs {1000};
+	/* Do not bother fitting until this many idle intervals were seen since the last retune */
+	static constexpr uint64_t minSamples {64};
+	/* Only replace the table if it saves at least this share of expected energy */
+	static constexpr uint64_t minGainPercent {10};
+	/* Minimum time between two table updates */
+	static constexpr uint64_t holdUs {60ull * 1000 * 1000};
+
+	/* Record an I/O request at `nowUs`. Safe to call concurrently with itself and `retune`. */
+	void tickle(uint64_t nowUs);
+
+	/**
+	 * Fit a new table to the observed distribution. Returns true and fills `plan` if it is worth
+	 * replacing `current`. Older observations are aged on every call.
+	 */
+	bool retune(const Input& in, const Plan& current, uint64_t nowUs, Plan& plan);
+
+	/* Distribution to plan against, uniform until anything is observed */
+	IdleHistogram distribution() const;
+
+	void reset();
+
+	/* Time of the last recorded I/O request, 0 if none */
+	uint64_t lastActivity() const {
+		return __atomic_load_n(&lastTickleUs, __ATOMIC_RELAXED);
+	}
+
+private:
+	IdleHistogram hist;
+	uint64_t lastTickleUs {0};
+	uint64_t lastUpdateUs {0};
+	uint64_t samples {0};
+	bool updated {false};
+};
+}
+
+#endif /* nvme_apst_tune_hpp */
@@ -0,0 +1,170 @@
+//
+// @file nvme_arbitration.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+#include <IOKit/pci/IOPCIDevice.h>
+
+#include "Log.hpp"
+#include "NVMeFixPlugin.hpp"
+
+/**
+ * IONVMeController does not expose its register mapping, so BAR0 is mapped once more for reading
+ * CAP and CC, which has no side effects.
+ */
+static IOMemoryMap* mapRegisters(IOService* controller, IOPCIDevice*& pci) {
+	pci = OSDynamicCast(IOPCIDevice, controller->getParentEntry(gIOServicePlane));
+	if (!pci) {
+		DBGLOG(Log::Feature, "Controller parent is not an IOPCIDevice");
+		return nullptr;
+	}
+
+	auto map = pci->mapDeviceMemoryWithRegister(kIOPCIConfigBaseAddress0);
+	if (!map)
+		SYSLOG(Log::Feature, "Failed to map controller registers");
+	return map;
+}
+
+bool NVMeFixPlugin::readRegisters(ControllerEntry& entry) {
+	IOPCIDevice* pci {};
+	auto map = mapRegisters(entry.controller, pci);
+	if (!map)
+		return false;
+
+	uint32_t capLo = pci->ioRead32(NVMe::NVME_REG_CAP, map);
+	uint32_t capHi = pci->ioRead32(NVMe::NVME_REG_CAP + sizeof(uint32_t), map);
+	uint32_t cc = pci->ioRead32(NVMe::NVME_REG_CC, map);
+	map->release();
+
+	/* All ones are read from a device that is gone or not powered */
+	if (capLo == 0xffffffff || cc == 0xffffffff) {
+		SYSLOG(Log::Feature, "Controller registers are not readable");
+		return false;
+	}
+
+	entry.regCap = (static_cast<uint64_t>(capHi) << 32) | capLo;
+	entry.regCc = cc;
+	entry.regsValid = true;
+	DBGLOG(Log::Feature, "CAP 0x%llx CC 0x%x", entry.regCap, entry.regCc);
+	return true;
+}
+
+/**
+ * True only if CC was read with EN clear, or as all ones from a device that is gone or not
+ * powered, in which case the controller no longer accesses host memory given to it. False if the
+ * registers could not be read at all.
+ */
+bool NVMeFixPlugin::controllerDisabled(ControllerEntry& entry) {
+	IOPCIDevice* pci {};
+	auto map = mapRegisters(entry.controller, pci);
+	if (!map)
+		return false;
+
+	uint32_t cc = pci->ioRead32(NVMe::NVME_REG_CC, map);
+	map->release();
+
+	DBGLOG(Log::Feature, "CC 0x%x", cc);
+	return cc == 0xffffffff || !(cc & NVMe::NVME_CC_ENABLE);
+}
+
+/**
+ * Under saturating I/O the admin queue, ours included, waits for the controller to fetch a full
+ * burst from the I/O queue every round. A smaller burst costs sequential throughput, so arbitration
+ * is only changed when asked for by device properties. Only command fetching is arbitrated, so this
+ * does not help with commands waiting for large transfers in flight.
+ */
+bool NVMeFixPlugin::configureArbitration(ControllerEntry& entry, const NVMe::nvme_id_ctrl* ctrl) {
+	if (!entry.regsValid)
+		return false;
+
+	static const char* mechanisms[] {"round-robin", "weighted-round-robin", "vendor-specific"};
+	auto mechanism = Arbitration::selected(entry.regCc);
+	bool wrr = Arbitration::wrrSupported(entry.regCap);
+	entry.controller->setProperty("arbitration-mechanism", mechanisms[static_cast<unsigned>(mechanism)]);
+	entry.controller->setProperty("arbitration-wrr-supported", wrr);
+
+	/* The mechanism can only be changed with the controller disabled, which is not ours to do */
+	DBGLOG_COND(wrr && mechanism == Arbitration::Mechanism::RoundRobin, Log::Feature,
+				"Weighted round robin supported but not selected");
+
+	/* Burst is given in commands like it is published, 0 for no limit, and weights 0 are not set */
+	uint32_t burst {UINT32_MAX}, low {0}, medium {0}, high {0};
+	propertyFromParent(entry.controller, "arbitration-burst", burst);
+	propertyFromParent(entry.controller, "arbitration-weight-low", low);
+	propertyFromParent(entry.controller, "arbitration-weight-medium", medium);
+	propertyFromParent(entry.controller, "arbitration-weight-high", high);
+
+	/* Burst trades sequential throughput for admin command latency, which is not ours to decide */
+	if (burst == UINT32_MAX && !low && !medium && !high) {
+		DBGLOG(Log::Feature, "Keeping arbitration set by the controller");
+		return false;
+	}
+
+	NVMe::nvme_common_command get {};
+	get.opcode = NVMe::nvme_admin_get_features;
+	get.cdw10 = NVMe::NVME_FEAT_ARBITRATION;
+	uint32_t current {};
+	auto ret = NVMeAdmin(entry, get, nullptr, &current);
+	if (ret != kIOReturnSuccess) {
+		SYSLOG(Log::Feature, "Failed to get arbitration with 0x%x", ret);
+		return false;
+	}
+
+	Arbitration::Config config {
+		burst == UINT32_MAX ? Arbitration::keepBurst : Arbitration::burstLog2(burst),
+		static_cast<uint16_t>(min(low, 256u)),
+		static_cast<uint16_t>(min(medium, 256u)),
+		static_cast<uint16_t>(min(high, 256u))
+	};
+
+	Arbitration::Setting setting {};
+	if (!Arbitration::plan(entry.regCap, entry.regCc, ctrl->rab, current, config, setting)) {
+		DBGLOG(Log::Feature, "Arbitration 0x%x needs no change", current);
+		return false;
+	}
+
+	Admin::Command command {};
+	command.cmd.opcode = NVMe::nvme_admin_set_features;
+	command.cmd.cdw10 = NVMe::NVME_FEAT_ARBITRATION;
+	command.cmd.cdw11 = setting.dword11();
+	command.callback = arbitrationConfigured;
+	command.context = reinterpret_cast<void*>(static_cast<uintptr_t>(setting.dword11()));
+	command.priority = Admin::Priority::Background;
+	if (submitAdmin(entry, command) != kIOReturnSuccess)
+		executeAdmin(entry, command);
+
+	return true;
+}
+
+/* Called with entry lock held */
+void NVMeFixPlugin::arbitrationConfigured(void* owner, void* context, int status, uint32_t) {
+	auto& entry = *static_cast<ControllerEntry*>(owner);
+	auto dword11 = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(context));
+	if (status == kIOReturnAborted)
+		return;
+
+	if (status != kIOReturnSuccess) {
+		SYSLOG(Log::Feature, "Failed to set arbitration with 0x%x", status);
+		return;
+	}
+
+	DBGLOG(Log::Feature, "Arbitration set to 0x%x", dword11);
+
+	/* In commands, 0 for no limit */
+	auto burst = dword11 & 0x7;
+	entry.controller->setProperty("arbitration-burst", burst == Arbitration::unlimitedBurst ? 0 : 1u << burst, 32);
+	if (Arbitration::selected(entry.regCc) == Arbitration::Mechanism::WeightedRoundRobin) {
+		entry.controller->setProperty("arbitration-weight-low", ((dword11 >> 8) & 0xff) + 1, 32);
+		entry.controller->setProperty("arbitration-weight-medium", ((dword11 >> 16) & 0xff) + 1, 32);
+		entry.controller->setProperty("arbitration-weight-high", (dword11 >> 24) + 1, 32);
+	}
+}
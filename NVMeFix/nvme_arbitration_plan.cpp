@@ -0,0 +1,55 @@
+//
+// @file nvme_arbitration_plan.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+#include "nvme_arbitration_plan.hpp"
+
+namespace Arbitration {
+
+static uint8_t weight(uint16_t commands) {
+	if (commands < 1)
+		commands = 1;
+	else if (commands > 256)
+		commands = 256;
+	return static_cast<uint8_t>(commands - 1);
+}
+
+bool plan(uint64_t cap, uint32_t cc, uint8_t rab, uint32_t current, const Config& config, Setting& out) {
+	auto mechanism = selected(cc);
+	if (mechanism == Mechanism::VendorSpecific)
+		return false;
+
+	out.burst = current & 0x7;
+	out.low = (current >> 8) & 0xff;
+	out.medium = (current >> 16) & 0xff;
+	out.high = current >> 24;
+
+	if (config.burst == unlimitedBurst)
+		out.burst = unlimitedBurst;
+	else if (config.burst != keepBurst)
+		out.burst = config.burst < rab ? config.burst : rab;
+
+	/* The controller cannot have selected it without support, but CAP is the authority */
+	if (mechanism == Mechanism::WeightedRoundRobin && wrrSupported(cap)) {
+		if (config.low)
+			out.low = weight(config.low);
+		if (config.medium)
+			out.medium = weight(config.medium);
+		if (config.high)
+			out.high = weight(config.high);
+	}
+
+	return out.dword11() != current;
+}
+
+}
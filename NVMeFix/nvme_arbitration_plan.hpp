@@ -0,0 +1,102 @@
+//
+// @file nvme_arbitration_plan.hpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+#ifndef nvme_arbitration_plan_hpp
+#define nvme_arbitration_plan_hpp
+
+#include <stdint.h>
+
+#include "nvme.h"
+
+/**
+ * Command arbitration between submission queues. The mechanism is selected in CC.AMS when the
+ * controller is enabled, which IONVMeFamily does, so we may only tune the Arbitration feature within
+ * it: the burst of commands fetched from one queue at a time applies to any mechanism, while
+ * the class weights only apply to weighted round robin.
+ */
+namespace Arbitration {
+
+enum class Mechanism : uint8_t {
+	RoundRobin,
+	WeightedRoundRobin,
+	VendorSpecific
+};
+
+/* CAP.AMS: weighted round robin with urgent priority class is supported */
+static inline bool wrrSupported(uint64_t cap) {
+	return (cap >> 17) & 0x1;
+}
+
+static inline Mechanism selected(uint32_t cc) {
+	switch (cc & NVMe::NVME_CC_AMS_VS) {
+		case NVMe::NVME_CC_AMS_RR:
+			return Mechanism::RoundRobin;
+		case NVMe::NVME_CC_AMS_WRRU:
+			return Mechanism::WeightedRoundRobin;
+		default:
+			return Mechanism::VendorSpecific;
+	}
+}
+
+/* Burst in log2 of commands, of which this value means no limit */
+static constexpr uint8_t unlimitedBurst {7};
+
+struct Setting {
+	uint8_t burst;
+	/* Commands per round of each weighted class, 0's based as in the command */
+	uint8_t low;
+	uint8_t medium;
+	uint8_t high;
+
+	uint32_t dword11() const {
+		return (burst & 0x7) | (static_cast<uint32_t>(low) << 8) |
+			(static_cast<uint32_t>(medium) << 16) | (static_cast<uint32_t>(high) << 24);
+	}
+};
+
+/* Burst in Config leaving the one currently set */
+static constexpr uint8_t keepBurst {0xff};
+
+struct Config {
+	/* Log2 of commands, unlimitedBurst for no limit, or keepBurst */
+	uint8_t burst;
+	/* Commands per round, 1 to 256, 0 to leave the weight currently set */
+	uint16_t low;
+	uint16_t medium;
+	uint16_t high;
+};
+
+/* Burst in log2 for a number of commands, rounded down, 0 for no limit */
+static inline uint8_t burstLog2(uint32_t commands) {
+	if (!commands)
+		return unlimitedBurst;
+
+	uint8_t log2 {0};
+	while (log2 < unlimitedBurst - 1 && (2u << log2) <= commands)
+		log2++;
+	return log2;
+}
+
+/**
+ * Setting changing `current` Arbitration dword 11 as asked for in `config` within the mechanism
+ * selected in `cc`, false if there is nothing we know how to tune or nothing would change. A limited
+ * burst is not set above the one the controller recommends, and weights only apply to weighted round
+ * robin, so they are left as they are otherwise.
+ */
+bool plan(uint64_t cap, uint32_t cc, uint8_t rab, uint32_t current, const Config& config, Setting& out);
+
+}
+
+#endif /* nvme_arbitration_plan_hpp */
@@ -0,0 +1,133 @@
+//
+// @file nvme_budget.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+#include <Headers/kern_time.hpp>
+
+#include "Log.hpp"
+#include "NVMeFixPlugin.hpp"
+
+bool NVMeFixPlugin::initBudget(ControllerEntry& entry, const NVMe::nvme_id_ctrl* ctrl) {
+	if (!entry.workLoop || !entry.budgetLevels.init(ctrl->psd, ctrl->npss))
+		return false;
+
+	entry.budgetPsd = ctrl->psd;
+	entry.budgetTimer = IOTimerEventSource::timerEventSource(entry.pm, budgetAction);
+	if (!entry.budgetTimer) {
+		SYSLOG(Log::PM, "Failed to create power budget timer");
+		return false;
+	}
+
+	if (entry.workLoop->addEventSource(entry.budgetTimer) != kIOReturnSuccess) {
+		SYSLOG(Log::PM, "Failed to add power budget timer to workloop");
+		entry.budgetTimer->release();
+		entry.budgetTimer = nullptr;
+		return false;
+	}
+
+	entry.budgetTimer->setTimeoutMS(budgetIntervalMs);
+	return true;
+}
+
+/* Called with plugin lock held. Controllers that are not set up yet are not counted. */
+void NVMeFixPlugin::allocatePowerBudget() {
+	Budget::Controller ctrls[Budget::maxControllers];
+	ControllerEntry* owners[Budget::maxControllers];
+	size_t n {0};
+
+	for (size_t i = 0; i < controllers.size() && n < Budget::maxControllers; i++) {
+		auto entry = controllers[i];
+		if (!entry->budgetTimer)
+			continue;
+
+		auto requests = __atomic_load_n(&entry->ioRequests, __ATOMIC_RELAXED);
+		ctrls[n] = {&entry->budgetLevels, entry->budgetPsd, requests - entry->budgetRequests, 0};
+		entry->budgetRequests = requests;
+		owners[n++] = entry;
+	}
+
+	auto total = Budget::allocate(ctrls, n, powerBudgetUw);
+	DBGLOG_COND(total > powerBudgetUw, Log::PM, "Power budget exceeded by lowest states, %llu uW", total);
+
+	for (size_t i = 0; i < n; i++) {
+		auto state = owners[i]->budgetLevels.states[ctrls[i].level];
+		__atomic_store_n(&owners[i]->capState, static_cast<int>(state), __ATOMIC_RELAXED);
+	}
+
+	budgetAllocatedNs = getCurrentTimeNs();
+}
+
+/* Shallowest state within the budget of the controller that is no deeper than `state` */
+unsigned NVMeFixPlugin::cappedState(const ControllerEntry& entry, unsigned state) {
+	auto cap = __atomic_load_n(&entry.capState, __ATOMIC_RELAXED);
+	if (cap < 0 || !entry.budgetPsd || state >= ControllerEntry::maxPowerStates)
+		return state;
+
+	auto limit = APST::powerUw(entry.budgetPsd[cap], false);
+	return APST::powerUw(entry.budgetPsd[state], false) > limit ? static_cast<unsigned>(cap) : state;
+}
+
+/* Called with entry lock held */
+void NVMeFixPlugin::applyPowerCap(ControllerEntry& entry) {
+	auto cap = __atomic_load_n(&entry.capState, __ATOMIC_RELAXED);
+	if (cap == entry.capApplied)
+		return;
+
+	DBGLOG(Log::PM, "Power budget allows ps %d", cap);
+
+	if (entry.apste) {
+		/* APST returns to the last operational state set, so it is enough to set the cap itself */
+		unsigned dword11 = static_cast<unsigned>(cap);
+		if (NVMeFeatures(entry, NVMe::NVME_FEAT_POWER_MGMT, &dword11, nullptr, nullptr, true) !=
+			kIOReturnSuccess) {
+			SYSLOG(Log::PM, "Failed to set power state within budget");
+			return;
+		}
+	} else if (entry.governed && entry.govTimer) {
+		entry.govState = ControllerEntry::noGovState;
+		entry.govTimer->setTimeoutUS(1);
+	} else if (entry.pmOrdinal > 0)
+		PM::applyPowerState(entry, entry.pmOrdinal);
+
+	entry.capApplied = cap;
+	entry.controller->setProperty("power-budget-ps", cap, 32);
+	entry.controller->setProperty("power-budget-mw", APST::powerUw(entry.budgetPsd[cap], false) / 1000,
+								  32);
+}
+
+/* Runs on the entry workloop */
+void NVMeFixPlugin::budgetAction(OSObject* owner, IOTimerEventSource* sender) {
+	auto pm = OSDynamicCast(NVMePMProxy, owner);
+	if (!pm || !pm->entry)
+		return;
+
+	auto& entry = *pm->entry;
+	auto& plugin = NVMeFixPlugin::globalPlugin();
+
+	/**
+	 * Controller removal holds the plugin lock while tearing down our timer, so we must not wait
+	 * for it. Every controller timer may do the allocation, whichever fires first after half the
+	 * interval, so that timer jitter does not make it skip a round.
+	 */
+	if (IOLockTryLock(plugin.lck)) {
+		if (getCurrentTimeNs() - plugin.budgetAllocatedNs >= budgetIntervalMs * 1000000ull / 2)
+			plugin.allocatePowerBudget();
+		IOLockUnlock(plugin.lck);
+	}
+
+	IOLockLock(entry.lck);
+	plugin.applyPowerCap(entry);
+	IOLockUnlock(entry.lck);
+
+	sender->setTimeoutMS(budgetIntervalMs);
+}
@@ -0,0 +1,58 @@
+//
+// @file nvme_budget_plan.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+#include "nvme_budget_plan.hpp"
+
+namespace Budget {
+
+uint64_t levelPowerUw(const Controller& ctrl, unsigned level) {
+	return APST::powerUw(ctrl.psd[ctrl.levels->states[level]], false);
+}
+
+uint64_t allocate(Controller* ctrls, size_t n, uint64_t budgetUw) {
+	size_t order[maxControllers];
+	uint64_t total {0};
+
+	if (n > maxControllers)
+		n = maxControllers;
+
+	for (size_t i = 0; i < n; i++) {
+		auto& ctrl = ctrls[i];
+		ctrl.level = ctrl.levels->count - 1;
+		total += levelPowerUw(ctrl, ctrl.level);
+
+		/* Insertion sort by decreasing requests, keeping the original order for ties */
+		auto j = i;
+		for (; j > 0 && ctrls[order[j - 1]].requests < ctrl.requests; j--)
+			order[j] = order[j - 1];
+		order[j] = i;
+	}
+
+	for (size_t i = 0; i < n && total < budgetUw; i++) {
+		auto& ctrl = ctrls[order[i]];
+		auto base = total - levelPowerUw(ctrl, ctrl.level);
+		for (unsigned level = 0; level < ctrl.level; level++) {
+			auto power = levelPowerUw(ctrl, level);
+			if (base + power <= budgetUw) {
+				ctrl.level = level;
+				total = base + power;
+				break;
+			}
+		}
+	}
+
+	return total;
+}
+
+}
@@ -0,0 +1,56 @@
+//
+// @file nvme_budget_plan.hpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+#ifndef nvme_budget_plan_hpp
+#define nvme_budget_plan_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nvme.h"
+#include "nvme_pm_governor.hpp"
+
+/**
+ * Splits a power budget shared by several controllers between them, by capping the operational
+ * power state each one may use. Independent of IOKit, so it may be exercised with synthetic
+ * controllers on the host.
+ */
+namespace Budget {
+
+static constexpr size_t maxControllers {32};
+
+struct Controller {
+	/* Operational states of the controller, shallowest first */
+	const Governor::Levels* levels;
+	const NVMe::nvme_id_power_state* psd;
+	/* I/O requests since the last allocation */
+	uint64_t requests;
+	/* Out: shallowest level the controller may use */
+	unsigned level;
+};
+
+/* Maximum power of `level`, in microwatts */
+uint64_t levelPowerUw(const Controller& ctrl, unsigned level);
+
+/**
+ * Starts every controller in its lowest-power state and raises them in the order of decreasing
+ * I/O requests, each as far as the remaining budget allows. If even the lowest-power states do not
+ * fit, they are kept. Returns the total maximum power of the allocation in microwatts.
+ */
+uint64_t allocate(Controller* ctrls, size_t n, uint64_t budgetUw);
+
+}
+
+#endif /* nvme_budget_plan_hpp */
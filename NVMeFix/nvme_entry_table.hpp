@@ -0,0 +1,132 @@
+//
+// @file nvme_entry_table.hpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+#ifndef nvme_entry_table_hpp
+#define nvme_entry_table_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Fixed-size map from an object pointer to its entry with lock-free lookup.
+ * Readers take a reference on the slot, so that a retired entry is only freed once every reader
+ * that may have seen it is gone. Writers must be serialised by the caller.
+ * Retired keys leave a tombstone, which keeps probe sequences intact and is reused by the next
+ * publish, so the table never fills up with keys of terminated controllers.
+ * Only uses compiler atomics, so it is not tied to IOKit.
+ */
+template <typename T, size_t N>
+class EntryTable {
+	static_assert(N && !(N & (N - 1)), "Capacity must be a power of two");
+
+	struct Slot {
+		/* nullptr ends a probe sequence, tombstone() does not */
+		const void* key;
+		T* value;
+		uint32_t users;
+	} __attribute__((aligned(64)));
+
+	Slot slots[N] {};
+
+	static size_t hash(const void* key) {
+		auto v = reinterpret_cast<uintptr_t>(key);
+		return (v >> 6) ^ (v >> 16);
+	}
+
+	/* Never a valid object pointer */
+	static const void* tombstone() {
+		return reinterpret_cast<const void*>(static_cast<uintptr_t>(1));
+	}
+
+public:
+	/**
+	 * Returns the entry for `key` or nullptr. A returned entry stays valid until `release(slot)`.
+	 */
+	T* acquire(const void* key, size_t& slot) {
+		for (size_t i = 0; i < N; i++) {
+			slot = (hash(key) + i) & (N - 1);
+			auto& s = slots[slot];
+			auto k = __atomic_load_n(&s.key, __ATOMIC_ACQUIRE);
+			if (!k)
+				return nullptr;
+			if (k != key)
+				continue;
+
+			__atomic_fetch_add(&s.users, 1, __ATOMIC_SEQ_CST);
+			auto value = __atomic_load_n(&s.value, __ATOMIC_SEQ_CST);
+			/* Slot may have been retired and reused for another key since the key was read */
+			if (!value || __atomic_load_n(&s.key, __ATOMIC_SEQ_CST) != key) {
+				__atomic_fetch_sub(&s.users, 1, __ATOMIC_RELEASE);
+				return nullptr;
+			}
+			return value;
+		}
+		return nullptr;
+	}
+
+	void release(size_t slot) {
+		__atomic_fetch_sub(&slots[slot].users, 1, __ATOMIC_RELEASE);
+	}
+
+	/* Returns false if the table is full */
+	bool publish(const void* key, T* value) {
+		Slot* free {nullptr};
+		for (size_t i = 0; i < N; i++) {
+			auto& s = slots[(hash(key) + i) & (N - 1)];
+			if (s.key == key) {
+				__atomic_store_n(&s.value, value, __ATOMIC_RELEASE);
+				return true;
+			}
+			if (s.key == tombstone() && !free)
+				free = &s;
+			if (!s.key) {
+				if (!free)
+					free = &s;
+				break;
+			}
+		}
+
+		if (!free)
+			return false;
+
+		/* Readers of the previous key recheck it after reading the value */
+		__atomic_store_n(&free->value, value, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&free->key, key, __ATOMIC_SEQ_CST);
+		return true;
+	}
+
+	/**
+	 * Unpublish the entry for `key` and wait for its readers to leave.
+	 * `wait` is invoked while there are readers left.
+	 */
+	template <typename W>
+	void retire(const void* key, W wait) {
+		for (size_t i = 0; i < N; i++) {
+			auto& s = slots[(hash(key) + i) & (N - 1)];
+			if (!s.key)
+				return;
+			if (s.key != key)
+				continue;
+
+			__atomic_store_n(&s.value, nullptr, __ATOMIC_SEQ_CST);
+			while (__atomic_load_n(&s.users, __ATOMIC_ACQUIRE))
+				wait();
+			__atomic_store_n(&s.key, tombstone(), __ATOMIC_SEQ_CST);
+			return;
+		}
+	}
+};
+
+#endif /* nvme_entry_table_hpp */
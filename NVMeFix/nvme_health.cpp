@@ -0,0 +1,116 @@
+//
+// @file nvme_health.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+#include <Headers/kern_time.hpp>
+
+#include "Log.hpp"
+#include "NVMeFixPlugin.hpp"
+
+/* Without NOPSPM any admin command moves the controller out of a non-operational state */
+bool NVMeFixPlugin::healthPollWakes(const ControllerEntry& entry) {
+	return !entry.nopspm && PM::idleNonOperational(entry);
+}
+
+/**
+ * Reads SMART / Health Information log into the pooled buffer, after anything more urgent queued
+ * on the workloop. A controller idling in a non-operational state is left alone, as its counters
+ * do not change much while idle anyway.
+ */
+void NVMeFixPlugin::pollHealth(ControllerEntry& entry) {
+	if (healthPollWakes(entry)) {
+		DBGLOG(Log::Health, "Skipping SMART log read on idle controller");
+		entry.healthSkips++;
+		entry.controller->setProperty("smart-polls-skipped", entry.healthSkips, 32);
+		return;
+	}
+
+	auto desc = adminBuffer(entry, sizeof(NVMe::nvme_smart_log));
+	if (!desc)
+		return;
+
+	Admin::Command command {};
+	command.cmd = logPageCommand(NVMe::NVME_LOG_SMART, sizeof(NVMe::nvme_smart_log));
+	command.buffer = command.context = desc;
+	command.callback = healthPolled;
+	command.priority = Admin::Priority::Background;
+
+	/* If the queue is full, there is no hurry, so it is read next time */
+	auto ret = submitAdmin(entry, command);
+	if (ret == kIOReturnNotReady)
+		executeAdmin(entry, command);
+	else if (ret != kIOReturnSuccess)
+		returnAdminBuffer(entry, desc);
+}
+
+/* Called with entry lock held */
+void NVMeFixPlugin::healthPolled(void* owner, void* context, int status, uint32_t) {
+	auto& entry = *static_cast<ControllerEntry*>(owner);
+	auto& plugin = NVMeFixPlugin::globalPlugin();
+	auto desc = static_cast<IOBufferMemoryDescriptor*>(context);
+	auto log = static_cast<const NVMe::nvme_smart_log*>(desc->getBytesNoCopy());
+
+	if (status != kIOReturnSuccess)
+		DBGLOG(Log::Health, "Failed to read SMART log with 0x%x", status);
+	else {
+		plugin.publishHealth(entry, entry.health.update(*log, getCurrentTimeNs() / 1000));
+		plugin.updateThermal(entry, *log);
+	}
+
+	plugin.returnAdminBuffer(entry, desc);
+}
+
+/**
+ * Published collections must not be modified, so the previous dictionary is copied with only the
+ * changed fields replaced, and nothing is published if none changed.
+ */
+void NVMeFixPlugin::publishHealth(ControllerEntry& entry, uint32_t changed) {
+	if (!changed)
+		return;
+
+	auto& counters = entry.health.counters();
+	const struct {
+		uint32_t field;
+		const char* key;
+		uint64_t value;
+		unsigned bits;
+	} fields[] {
+		{Health::Temperature, "temperature", counters.temperatureK, 16},
+		{Health::PercentUsed, "percent-used", counters.percentUsed, 8},
+		{Health::UnitsRead, "data-units-read", counters.unitsRead, 64},
+		{Health::UnitsWritten, "data-units-written", counters.unitsWritten, 64},
+		{Health::WarningTempTime, "warning-temp-time", counters.warningTempMin, 32},
+		{Health::CriticalCompTime, "critical-comp-time", counters.criticalCompMin, 32},
+		{Health::ReadRate, "read-bytes-per-sec", counters.readRate, 64},
+		{Health::WriteRate, "write-bytes-per-sec", counters.writeRate, 64}
+	};
+
+	auto previous = OSDynamicCast(OSDictionary, entry.controller->getProperty("smart"));
+	auto dict = previous ? OSDictionary::withDictionary(previous, arrsize(fields)) :
+		OSDictionary::withCapacity(arrsize(fields));
+	if (!dict)
+		return;
+
+	for (auto& f : fields) {
+		if (!(changed & f.field))
+			continue;
+		auto num = OSNumber::withNumber(f.value, f.bits);
+		if (num) {
+			dict->setObject(f.key, num);
+			num->release();
+		}
+	}
+
+	entry.controller->setProperty("smart", dict);
+	dict->release();
+}
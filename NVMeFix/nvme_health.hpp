@@ -0,0 +1,127 @@
+//
+// @file nvme_health.hpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+#ifndef nvme_health_hpp
+#define nvme_health_hpp
+
+#include <stdint.h>
+
+#include "nvme.h"
+
+namespace Health {
+
+/* Bytes in an NVMe data unit */
+static constexpr uint64_t dataUnitBytes {1000 * 512};
+
+struct Counters {
+	uint16_t temperatureK;
+	uint8_t percentUsed;
+	uint64_t unitsRead;
+	uint64_t unitsWritten;
+	/* Minutes above warning and critical composite temperature */
+	uint32_t warningTempMin;
+	uint32_t criticalCompMin;
+	/* Bytes per second between the last two samples */
+	uint64_t readRate;
+	uint64_t writeRate;
+};
+
+enum Field : uint32_t {
+	Temperature      = 1 << 0,
+	PercentUsed      = 1 << 1,
+	UnitsRead        = 1 << 2,
+	UnitsWritten     = 1 << 3,
+	WarningTempTime  = 1 << 4,
+	CriticalCompTime = 1 << 5,
+	ReadRate         = 1 << 6,
+	WriteRate        = 1 << 7,
+	AllFields        = (1 << 8) - 1
+};
+
+/**
+ * Keeps the last SMART / Health Information log sample and tells which of the tracked fields
+ * changed, so that only those have to be published.
+ */
+class Tracker {
+public:
+	/* Returns the fields that changed since the previous sample, all of them for the first one */
+	uint32_t update(const NVMe::nvme_smart_log& log, uint64_t nowUs) {
+		Counters next {};
+		next.temperatureK = static_cast<uint16_t>(log.temperature[0] | (log.temperature[1] << 8));
+		next.percentUsed = log.percent_used;
+		next.unitsRead = le128Low(log.data_units_read);
+		next.unitsWritten = le128Low(log.data_units_written);
+		next.warningTempMin = log.warning_temp_time;
+		next.criticalCompMin = log.critical_comp_time;
+
+		if (samples && nowUs > sampleUs) {
+			next.readRate = rate(current.unitsRead, next.unitsRead, nowUs - sampleUs);
+			next.writeRate = rate(current.unitsWritten, next.unitsWritten, nowUs - sampleUs);
+		}
+
+		uint32_t changed {samples ? 0 : static_cast<uint32_t>(AllFields)};
+		if (next.temperatureK != current.temperatureK)
+			changed |= Temperature;
+		if (next.percentUsed != current.percentUsed)
+			changed |= PercentUsed;
+		if (next.unitsRead != current.unitsRead)
+			changed |= UnitsRead;
+		if (next.unitsWritten != current.unitsWritten)
+			changed |= UnitsWritten;
+		if (next.warningTempMin != current.warningTempMin)
+			changed |= WarningTempTime;
+		if (next.criticalCompMin != current.criticalCompMin)
+			changed |= CriticalCompTime;
+		if (next.readRate != current.readRate)
+			changed |= ReadRate;
+		if (next.writeRate != current.writeRate)
+			changed |= WriteRate;
+
+		current = next;
+		sampleUs = nowUs;
+		samples++;
+		return changed;
+	}
+
+	const Counters& counters() const {
+		return current;
+	}
+
+	uint32_t samples {0};
+
+private:
+	/* Counters wrap after 2^64 data units only in theory, so the high half is ignored */
+	static uint64_t le128Low(const uint8_t* bytes) {
+		uint64_t value {0};
+		for (unsigned i = 0; i < sizeof(value); i++)
+			value |= static_cast<uint64_t>(bytes[i]) << (8 * i);
+		return value;
+	}
+
+	/* Millisecond resolution keeps the product in range for any realistic throughput */
+	static uint64_t rate(uint64_t before, uint64_t after, uint64_t elapsedUs) {
+		if (after < before)
+			return 0;
+		uint64_t elapsedMs = elapsedUs / 1000 ? elapsedUs / 1000 : 1;
+		return (after - before) * dataUnitBytes * 1000 / elapsedMs;
+	}
+
+	Counters current {};
+	uint64_t sampleUs {0};
+};
+
+}
+
+#endif /* nvme_health_hpp */
@@ -0,0 +1,154 @@
+//
+// @file nvme_histogram.hpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+#ifndef nvme_histogram_hpp
+#define nvme_histogram_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace Stats {
+
+/**
+ * Log-linear latency histogram in microseconds. Values below `subBuckets` get a bucket each, and
+ * every following power of two is split into `subBuckets` equal buckets, so a reported percentile
+ * is at most 25% above the recorded value.
+ * Only uses compiler atomics, so samples may be recorded concurrently and from interrupt context.
+ */
+struct LatencyHistogram {
+	static constexpr unsigned subBits {2};
+	static constexpr unsigned subBuckets {1u << subBits};
+	static constexpr unsigned nbuckets {(32 - subBits + 1) * subBuckets};
+
+	uint32_t counts[nbuckets] {};
+	uint32_t samples {0};
+	uint32_t maxUs {0};
+
+	static unsigned bucketFor(uint32_t us) {
+		if (us < subBuckets)
+			return us;
+		unsigned exp = 31 - static_cast<unsigned>(__builtin_clz(us));
+		unsigned sub = (us >> (exp - subBits)) & (subBuckets - 1);
+		return (exp - subBits + 1) * subBuckets + sub;
+	}
+
+	/* Largest value falling into `bucket` */
+	static uint32_t bucketLimit(unsigned bucket) {
+		if (bucket < subBuckets)
+			return bucket;
+		unsigned group = bucket / subBuckets;
+		uint64_t lower = static_cast<uint64_t>(subBuckets + bucket % subBuckets) << (group - 1);
+		return static_cast<uint32_t>(lower + (1ull << (group - 1)) - 1);
+	}
+
+	void record(uint64_t us) {
+		auto value = us > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(us);
+		__atomic_fetch_add(&counts[bucketFor(value)], 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&samples, 1, __ATOMIC_RELAXED);
+
+		auto max = __atomic_load_n(&maxUs, __ATOMIC_RELAXED);
+		while (value > max && !__atomic_compare_exchange_n(&maxUs, &max, value, true, __ATOMIC_RELAXED,
+															 __ATOMIC_RELAXED))
+			;
+	}
+
+	uint32_t count() const {
+		return __atomic_load_n(&samples, __ATOMIC_RELAXED);
+	}
+
+	/* Upper bound of the value below which `permille` of samples fall, 0 if there are none */
+	uint32_t percentile(unsigned permille) const {
+		uint64_t total {0};
+		for (unsigned i = 0; i < nbuckets; i++)
+			total += __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+		if (!total)
+			return 0;
+
+		uint64_t rank = (total * permille + 999) / 1000, seen {0};
+		auto max = __atomic_load_n(&maxUs, __ATOMIC_RELAXED);
+		for (unsigned i = 0; i < nbuckets; i++) {
+			seen += __atomic_load_n(&counts[i], __ATOMIC_RELAXED);
+			if (seen && seen >= rank)
+				return bucketLimit(i) < max ? bucketLimit(i) : max;
+		}
+		return max;
+	}
+};
+
+/**
+ * Latency histograms of admin commands keyed by opcode and a sub-key, e.g. the feature or log page
+ * identifier, in a fixed number of slots. Slots are claimed on first use and never given back.
+ * Lookups must be serialised, while samples may be recorded concurrently.
+ */
+template <size_t N>
+struct CommandLatency {
+	struct Slot {
+		bool used;
+		uint8_t opcode;
+		uint8_t sub;
+		LatencyHistogram hist;
+	} slots[N] {};
+	/* Samples of commands that did not get a slot */
+	uint32_t overflow {0};
+
+	/* Histogram for the command, nullptr if all slots are taken by others */
+	LatencyHistogram* find(uint8_t opcode, uint8_t sub) {
+		for (auto& slot : slots) {
+			if (!slot.used) {
+				slot.used = true;
+				slot.opcode = opcode;
+				slot.sub = sub;
+			}
+			if (slot.opcode == opcode && slot.sub == sub)
+				return &slot.hist;
+		}
+		return nullptr;
+	}
+
+	void record(uint8_t opcode, uint8_t sub, uint64_t us) {
+		auto hist = find(opcode, sub);
+		if (hist)
+			hist->record(us);
+		else
+			overflow++;
+	}
+};
+
+/* Counts of failed commands by status, in a fixed number of slots and serialised by the caller */
+template <size_t N>
+struct StatusCounts {
+	struct {
+		uint32_t status;
+		uint32_t count;
+	} slots[N] {};
+	/* Failures with a status that did not get a slot */
+	uint32_t other {0};
+
+	void record(uint32_t status) {
+		for (auto& slot : slots) {
+			if (!slot.count)
+				slot.status = status;
+			if (slot.status == status) {
+				slot.count++;
+				return;
+			}
+		}
+		other++;
+	}
+};
+
+}
+
+#endif /* nvme_histogram_hpp */
@@ -0,0 +1,218 @@
+//
+// @file nvme_hmb.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+#include "Log.hpp"
+#include "NVMeFixPlugin.hpp"
+
+/* Wired, physically contiguous memory and its device address, kept mapped while dma is held */
+static IOBufferMemoryDescriptor* allocContiguous(uint64_t bytes, IODMACommand*& dma, uint64_t& addr) {
+	auto desc = IOBufferMemoryDescriptor::inTaskWithPhysicalMask(kernel_task,
+		kIODirectionInOut | kIOMemoryPhysicallyContiguous, bytes, ~(HMB::pageBytes - 1));
+	if (!desc)
+		return nullptr;
+
+	memset(desc->getBytesNoCopy(), '\0', bytes);
+
+	dma = IODMACommand::withSpecification(kIODMACommandOutputHost64, 64, 0, IODMACommand::kMapped,
+										  0, HMB::pageBytes);
+	if (!dma) {
+		desc->release();
+		return nullptr;
+	}
+
+	IODMACommand::Segment64 segment {};
+	UInt64 offset {0};
+	UInt32 nsegs {1};
+	if (dma->setMemoryDescriptor(desc) != kIOReturnSuccess ||
+		dma->gen64IOVMSegments(&offset, &segment, &nsegs) != kIOReturnSuccess ||
+		nsegs != 1 || segment.fLength != bytes) {
+		dma->clearMemoryDescriptor();
+		dma->release();
+		dma = nullptr;
+		desc->release();
+		return nullptr;
+	}
+
+	addr = segment.fIOVMAddr;
+	return desc;
+}
+
+bool NVMeFixPlugin::allocHMBChunk(void* context, uint64_t bytes, uint64_t& addr) {
+	auto& entry = *static_cast<ControllerEntry*>(context);
+	auto i = entry.hmb.nchunks;
+
+	entry.hmbChunks[i] = allocContiguous(bytes, entry.hmbDma[i], addr);
+	return entry.hmbChunks[i] != nullptr;
+}
+
+/**
+ * DRAM-less controllers keep their mapping tables in host memory if given some, which helps random
+ * I/O considerably. The buffer is split into as few physically contiguous chunks as the allocator
+ * permits, and stays allocated for the lifetime of the controller, so that it can be handed back
+ * with its contents after sleep.
+ */
+bool NVMeFixPlugin::enableHMB(ControllerEntry& entry, const NVMe::nvme_id_ctrl* ctrl) {
+	HMB::Limits limits {};
+	if (!HMB::limits(*ctrl, limits)) {
+		DBGLOG(Log::HMB, "Host memory buffer not requested by this controller");
+		return false;
+	}
+
+	/* Descriptors are in memory pages, which IONVMeFamily is expected to leave at 4 KiB */
+	if (entry.regsValid && ((entry.regCc >> NVMe::NVME_CC_MPS_SHIFT) & 0xf)) {
+		SYSLOG(Log::HMB, "Unsupported memory page size in CC 0x%x", entry.regCc);
+		return false;
+	}
+
+	DBGLOG(Log::HMB, "Controller prefers %llu bytes, at least %llu in up to %u chunks of %llu bytes or more",
+		   limits.preferredBytes, limits.minBytes, limits.maxChunks, limits.minChunkBytes);
+
+	/* Firmware or IONVMeFamily might have given it a buffer already, which we must not replace */
+	auto attrs = adminBuffer(entry, HMB::pageBytes);
+	if (attrs) {
+		NVMe::nvme_common_command cmd {};
+		cmd.opcode = NVMe::nvme_admin_get_features;
+		cmd.cdw10 = NVMe::NVME_FEAT_HOST_MEM_BUF;
+		uint32_t res {};
+		auto ret = NVMeAdmin(entry, cmd, attrs, &res);
+		returnAdminBuffer(entry, attrs);
+		if (ret == kIOReturnSuccess && (res & NVMe::NVME_HOST_MEM_ENABLE)) {
+			DBGLOG(Log::HMB, "Host memory buffer already enabled");
+			return false;
+		}
+	}
+
+	if (!HMB::allocate(limits, allocHMBChunk, &entry, entry.hmb)) {
+		SYSLOG(Log::HMB, "Failed to allocate host memory buffer, got %llu bytes in %u chunks",
+			   entry.hmb.totalBytes, entry.hmb.nchunks);
+		releaseHMB(entry);
+		return false;
+	}
+
+	entry.hmbList = allocContiguous(HMB::pageBytes, entry.hmbListDma, entry.hmbListAddr);
+	if (!entry.hmbList) {
+		SYSLOG(Log::HMB, "Failed to allocate host memory buffer descriptor list");
+		releaseHMB(entry);
+		return false;
+	}
+
+	HMB::describe(entry.hmb, static_cast<NVMe::nvme_host_mem_buf_desc*>(entry.hmbList->getBytesNoCopy()),
+				  HMB::maxChunks);
+
+	auto ret = NVMeAdmin(entry, HMB::enableCommand(entry.hmb, entry.hmbListAddr, false), nullptr, nullptr);
+	if (ret != kIOReturnSuccess) {
+		SYSLOG(Log::HMB, "Failed to enable host memory buffer with 0x%x", ret);
+		releaseHMB(entry);
+		return false;
+	}
+
+	DBGLOG(Log::HMB, "Enabled host memory buffer of %llu bytes in %u chunks", entry.hmb.totalBytes,
+		   entry.hmb.nchunks);
+	entry.hmbEnabled = true;
+	entry.controller->setProperty("hmb-size", entry.hmb.totalBytes, 64);
+	entry.controller->setProperty("hmb-chunks", entry.hmb.nchunks, 32);
+	entry.controller->setProperty("hmb-enabled", true);
+	return true;
+}
+
+/**
+ * Called with entry lock held before the controller leaves a usable state. The memory stays with
+ * us, but the controller must not access it while sleeping or across a shutdown.
+ */
+void NVMeFixPlugin::returnHMB(ControllerEntry& entry) {
+	if (!entry.hmbEnabled)
+		return;
+
+	auto ret = NVMeAdmin(entry, HMB::disableCommand(), nullptr, nullptr);
+	if (ret != kIOReturnSuccess) {
+		SYSLOG(Log::HMB, "Failed to disable host memory buffer with 0x%x", ret);
+		return;
+	}
+
+	entry.hmbEnabled = false;
+	entry.controller->setProperty("hmb-enabled", false);
+}
+
+/**
+ * Called with entry lock held once the controller is usable again. The buffer is handed back
+ * with its contents before anything else queued, whether or not the controller was reset meanwhile.
+ */
+void NVMeFixPlugin::resumeHMB(ControllerEntry& entry) {
+	if (!entry.hmbList || entry.hmbEnabled)
+		return;
+
+	Admin::Command command {};
+	command.cmd = HMB::enableCommand(entry.hmb, entry.hmbListAddr, true);
+	command.callback = hmbResumed;
+	command.priority = Admin::Priority::Resume;
+	if (submitAdmin(entry, command) != kIOReturnSuccess)
+		executeAdmin(entry, command);
+}
+
+/* Called with entry lock held */
+void NVMeFixPlugin::hmbResumed(void* owner, void*, int status, uint32_t) {
+	auto& entry = *static_cast<ControllerEntry*>(owner);
+	if (status == kIOReturnAborted)
+		return;
+
+	if (status != kIOReturnSuccess) {
+		SYSLOG(Log::HMB, "Failed to re-enable host memory buffer with 0x%x", status);
+		return;
+	}
+
+	entry.hmbEnabled = true;
+	entry.controller->setProperty("hmb-enabled", true);
+}
+
+/**
+ * Called with entry lock held once the controller is about to terminate, while it still takes
+ * commands. The buffer is freed right away if the controller has released it, either by the disable
+ * command or by being disabled itself, and otherwise left to the deleter.
+ */
+void NVMeFixPlugin::disableHMB(ControllerEntry& entry) {
+	returnHMB(entry);
+	if (entry.hmbEnabled && controllerDisabled(entry))
+		entry.hmbEnabled = false;
+
+	if (!entry.hmbEnabled)
+		releaseHMB(entry);
+}
+
+/* Frees the buffer, which the controller must not be using anymore */
+void NVMeFixPlugin::releaseHMB(ControllerEntry& entry) {
+	for (uint32_t i = 0; i < HMB::maxChunks; i++) {
+		if (entry.hmbDma[i]) {
+			entry.hmbDma[i]->clearMemoryDescriptor();
+			entry.hmbDma[i]->release();
+			entry.hmbDma[i] = nullptr;
+		}
+		if (entry.hmbChunks[i]) {
+			entry.hmbChunks[i]->release();
+			entry.hmbChunks[i] = nullptr;
+		}
+	}
+	if (entry.hmbListDma) {
+		entry.hmbListDma->clearMemoryDescriptor();
+		entry.hmbListDma->release();
+		entry.hmbListDma = nullptr;
+	}
+	if (entry.hmbList) {
+		entry.hmbList->release();
+		entry.hmbList = nullptr;
+	}
+
+	entry.hmb.nchunks = 0;
+	entry.hmb.totalBytes = 0;
+	entry.hmbEnabled = false;
+}
@@ -0,0 +1,109 @@
+//
+// @file nvme_hmb_plan.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+#include "nvme_hmb_plan.hpp"
+
+namespace HMB {
+
+static uint64_t roundUp(uint64_t bytes) {
+	return (bytes + pageBytes - 1) & ~(pageBytes - 1);
+}
+
+bool limits(const NVMe::nvme_id_ctrl& ctrl, Limits& out) {
+	if (!ctrl.hmpre)
+		return false;
+
+	out.preferredBytes = static_cast<uint64_t>(ctrl.hmpre) * unitBytes;
+	out.minBytes = static_cast<uint64_t>(ctrl.hmmin) * unitBytes;
+	out.minChunkBytes = ctrl.hmminds ? roundUp(static_cast<uint64_t>(ctrl.hmminds) * unitBytes) : pageBytes;
+	out.maxChunks = ctrl.hmmaxd && ctrl.hmmaxd < maxChunks ? ctrl.hmmaxd : static_cast<uint32_t>(maxChunks);
+
+	/* Minimum above preferred is invalid, and so is a minimum chunk beyond either */
+	if (out.minBytes > out.preferredBytes || out.minChunkBytes > out.preferredBytes)
+		return false;
+
+	return true;
+}
+
+bool allocate(const Limits& limits, Allocator alloc, void* context, Buffer& buffer) {
+	buffer.nchunks = 0;
+	buffer.totalBytes = 0;
+
+	uint64_t preferred = roundUp(limits.preferredBytes);
+	uint64_t maxCount = limits.maxChunks < maxChunks ? limits.maxChunks : maxChunks;
+	if (!maxCount || !alloc)
+		return false;
+
+	/* Start with chunks large enough for the preferred size to fit in the descriptors allowed */
+	uint64_t chunk = preferred < maxChunkBytes ? preferred : maxChunkBytes;
+	uint64_t needed = roundUp((preferred + maxCount - 1) / maxCount);
+	if (chunk < needed)
+		chunk = needed;
+	if (chunk < limits.minChunkBytes)
+		chunk = limits.minChunkBytes;
+
+	while (buffer.totalBytes < preferred && buffer.nchunks < maxCount) {
+		uint64_t left = preferred - buffer.totalBytes;
+		uint64_t bytes = chunk < left ? chunk : left;
+		if (bytes < limits.minChunkBytes)
+			bytes = limits.minChunkBytes;
+
+		uint64_t addr {0};
+		if (alloc(context, bytes, addr)) {
+			buffer.addr[buffer.nchunks] = addr;
+			buffer.bytes[buffer.nchunks] = bytes;
+			buffer.nchunks++;
+			buffer.totalBytes += bytes;
+			continue;
+		}
+
+		uint64_t smaller = (bytes / 2) & ~(pageBytes - 1);
+		if (smaller < limits.minChunkBytes || !smaller)
+			break;
+		chunk = smaller;
+	}
+
+	return buffer.nchunks > 0 && buffer.totalBytes >= limits.minBytes;
+}
+
+uint32_t describe(const Buffer& buffer, NVMe::nvme_host_mem_buf_desc* list, size_t count) {
+	uint32_t n {0};
+	for (; n < buffer.nchunks && n < count; n++) {
+		list[n].addr = buffer.addr[n];
+		list[n].size = static_cast<uint32_t>(buffer.bytes[n] / pageBytes);
+		list[n].rsvd = 0;
+	}
+	return n;
+}
+
+NVMe::nvme_common_command enableCommand(const Buffer& buffer, uint64_t listAddr, bool returning) {
+	NVMe::nvme_common_command cmd {};
+	cmd.opcode = NVMe::nvme_admin_set_features;
+	cmd.cdw10 = NVMe::NVME_FEAT_HOST_MEM_BUF;
+	cmd.cdw11 = NVMe::NVME_HOST_MEM_ENABLE | (returning ? NVMe::NVME_HOST_MEM_RETURN : 0);
+	cmd.cdw12 = static_cast<uint32_t>(buffer.totalBytes / pageBytes);
+	cmd.cdw13 = static_cast<uint32_t>(listAddr);
+	cmd.cdw14 = static_cast<uint32_t>(listAddr >> 32);
+	cmd.cdw15 = buffer.nchunks;
+	return cmd;
+}
+
+NVMe::nvme_common_command disableCommand() {
+	NVMe::nvme_common_command cmd {};
+	cmd.opcode = NVMe::nvme_admin_set_features;
+	cmd.cdw10 = NVMe::NVME_FEAT_HOST_MEM_BUF;
+	return cmd;
+}
+
+}
@@ -0,0 +1,83 @@
+//
+// @file nvme_hmb_plan.hpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+#ifndef nvme_hmb_plan_hpp
+#define nvme_hmb_plan_hpp
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "nvme.h"
+
+/**
+ * Sizing of the Host Memory Buffer requested by DRAM-less controllers, and the Set Features
+ * commands handing it over. Memory is obtained through a caller-provided allocator, so that the
+ * chunking may be exercised against a simulated controller and allocator on the host.
+ */
+namespace HMB {
+
+/* Identify sizes HMB in 4 KiB units, and descriptors in memory pages, which are 4 KiB as well */
+static constexpr uint64_t unitBytes {4096};
+static constexpr uint64_t pageBytes {4096};
+/* Descriptors that fit the single page the list is placed in */
+static constexpr size_t maxChunks {pageBytes / sizeof(NVMe::nvme_host_mem_buf_desc)};
+/* Largest chunk tried first, as larger physically contiguous allocations are likely to fail */
+static constexpr uint64_t maxChunkBytes {4 * 1024 * 1024};
+
+struct Limits {
+	uint64_t preferredBytes;
+	/* The controller cannot use a smaller buffer, 0 if any size will do */
+	uint64_t minBytes;
+	uint64_t minChunkBytes;
+	uint32_t maxChunks;
+};
+
+/* False if the controller does not request a buffer */
+bool limits(const NVMe::nvme_id_ctrl& ctrl, Limits& out);
+
+struct Buffer {
+	uint64_t addr[maxChunks];
+	uint64_t bytes[maxChunks];
+	uint32_t nchunks;
+	uint64_t totalBytes;
+};
+
+/**
+ * Allocates a physically contiguous, page aligned chunk of `bytes` and returns its device address.
+ * Chunk `buffer.nchunks` is being allocated when called.
+ */
+using Allocator = bool (*)(void* context, uint64_t bytes, uint64_t& addr);
+
+/**
+ * Allocates up to the preferred size in as few chunks as the allocator permits, halving the chunk
+ * size whenever an allocation fails, down to the minimum descriptor size. Fails if less than the
+ * minimum size could be allocated, in which case the allocated chunks are left in `buffer` for the
+ * caller to free.
+ */
+bool allocate(const Limits& limits, Allocator alloc, void* context, Buffer& buffer);
+
+/* Fills the descriptor list for `buffer`, which has room for `count` entries, returns entries used */
+uint32_t describe(const Buffer& buffer, NVMe::nvme_host_mem_buf_desc* list, size_t count);
+
+/**
+ * Set Features enabling `buffer` with descriptor list at `listAddr`. When `returning`, the
+ * controller is told the memory is the one it had before and its contents were preserved.
+ */
+NVMe::nvme_common_command enableCommand(const Buffer& buffer, uint64_t listAddr, bool returning);
+NVMe::nvme_common_command disableCommand();
+
+}
+
+#endif /* nvme_hmb_plan_hpp */
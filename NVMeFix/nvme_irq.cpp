@@ -0,0 +1,159 @@
+//
+// @file nvme_irq.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+#include <Headers/kern_time.hpp>
+
+#include "Log.hpp"
+#include "NVMeFixPlugin.hpp"
+
+/**
+ * Interrupts and requests are counted by the routed FilterInterruptRequest and activityTickle, and
+ * sampled on the entry workloop while there is I/O. Coalescing starts disabled and is raised only
+ * under sustained deep-queue load.
+ */
+bool NVMeFixPlugin::initCoalescing(ControllerEntry& entry) {
+	if (!PM.interruptRouted || !entry.workLoop) {
+		DBGLOG(Log::PM, "Interrupts are not observed, not adapting coalescing");
+		return false;
+	}
+
+	Coalesce::Policy::Config config;
+	Coalesce::Policy::defaultConfig(config);
+	entry.irqPolicy.init(config);
+
+	entry.irqTimer = IOTimerEventSource::timerEventSource(entry.pm, coalesceAction);
+	if (!entry.irqTimer) {
+		SYSLOG(Log::PM, "Failed to create interrupt coalescing timer");
+		return false;
+	}
+
+	if (entry.workLoop->addEventSource(entry.irqTimer) != kIOReturnSuccess) {
+		SYSLOG(Log::PM, "Failed to add interrupt coalescing timer to workloop");
+		entry.irqTimer->release();
+		entry.irqTimer = nullptr;
+		return false;
+	}
+
+	/* Firmware may default to some coalescing, which would delay QD1 completions */
+	__atomic_store_n(&entry.irqAdaptive, true, __ATOMIC_RELEASE);
+	applyCoalescing(entry);
+
+	/* Cleared again if the controller rejected it right away */
+	if (!__atomic_load_n(&entry.irqAdaptive, __ATOMIC_RELAXED))
+		return false;
+
+	entry.irqTimer->setTimeoutUS(Coalesce::Policy::defaultSampleUs);
+	return true;
+}
+
+/* Invoked for every I/O request on any CPU, so it must not block */
+void NVMeFixPlugin::coalesceTickle(ControllerEntry& entry) {
+	if (__atomic_load_n(&entry.irqSeen, __ATOMIC_RELAXED) &&
+		__atomic_exchange_n(&entry.irqSeen, false, __ATOMIC_RELAXED))
+		__atomic_fetch_add(&entry.irqBursts, 1, __ATOMIC_RELAXED);
+
+	/* Of concurrent requests only one restarts sampling */
+	if (__atomic_load_n(&entry.irqDormant, __ATOMIC_RELAXED) &&
+		__atomic_exchange_n(&entry.irqDormant, false, __ATOMIC_RELAXED))
+		entry.irqTimer->setTimeoutUS(1);
+}
+
+/* Runs on the entry workloop, stops sampling while idle without coalescing */
+void NVMeFixPlugin::coalesceAction(OSObject* owner, IOTimerEventSource* sender) {
+	auto pm = OSDynamicCast(NVMePMProxy, owner);
+	if (!pm || !pm->entry)
+		return;
+
+	auto& entry = *pm->entry;
+	auto& plugin = NVMeFixPlugin::globalPlugin();
+	if (!__atomic_load_n(&entry.irqAdaptive, __ATOMIC_ACQUIRE))
+		return;
+
+	auto now = getCurrentTimeNs();
+	auto requests = __atomic_load_n(&entry.ioRequests, __ATOMIC_RELAXED);
+	auto interrupts = __atomic_load_n(&entry.irqCount, __ATOMIC_RELAXED);
+	auto bursts = __atomic_load_n(&entry.irqBursts, __ATOMIC_RELAXED);
+
+	/* The first sample after idle only sets the baseline */
+	auto& last = entry.irqSampleStart;
+	bool idle {false};
+	if (last.ns) {
+		Coalesce::Sample sample {requests - last.requests, interrupts - last.interrupts,
+			bursts - last.bursts, (now - last.ns) / 1000};
+
+		IOLockLock(entry.lck);
+		if (entry.irqPolicy.update(sample)) {
+			DBGLOG(Log::PM, "Interrupt coalescing level %u at %llu IOPS", entry.irqPolicy.level(),
+				   entry.irqPolicy.iops);
+			plugin.applyCoalescing(entry);
+		}
+		idle = !sample.requests && entry.irqPolicy.level() == Coalesce::Off;
+		IOLockUnlock(entry.lck);
+	}
+
+	if (idle) {
+		last.ns = 0;
+		__atomic_store_n(&entry.irqDormant, true, __ATOMIC_RELAXED);
+		return;
+	}
+
+	last = {now, requests, interrupts, bursts};
+	sender->setTimeoutUS(Coalesce::Policy::defaultSampleUs);
+}
+
+/* Called with entry lock held */
+void NVMeFixPlugin::applyCoalescing(ControllerEntry& entry) {
+	auto dword11 = entry.irqPolicy.setting().dword11();
+
+	/* Only the last setting matters, so the queue merges pending ones */
+	Admin::Command command {};
+	command.cmd.opcode = NVMe::nvme_admin_set_features;
+	command.cmd.cdw10 = NVMe::NVME_FEAT_IRQ_COALESCE;
+	command.cmd.cdw11 = dword11;
+	command.callback = coalescingApplied;
+	command.context = reinterpret_cast<void*>(static_cast<uintptr_t>(dword11));
+	command.priority = Admin::Priority::Background;
+	if (submitAdmin(entry, command) != kIOReturnSuccess)
+		executeAdmin(entry, command);
+}
+
+/* Called with entry lock held */
+void NVMeFixPlugin::coalescingApplied(void* owner, void* context, int status, uint32_t) {
+	auto& entry = *static_cast<ControllerEntry*>(owner);
+	auto dword11 = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(context));
+	if (status == kIOReturnAborted)
+		return;
+
+	if (status != kIOReturnSuccess) {
+		SYSLOG(Log::PM, "Failed to set interrupt coalescing with 0x%x, no longer adapting it", status);
+		__atomic_store_n(&entry.irqAdaptive, false, __ATOMIC_RELEASE);
+		return;
+	}
+
+	entry.controller->setProperty("irq-coalesce-threshold", (dword11 & 0xff) + 1, 32);
+	entry.controller->setProperty("irq-coalesce-time-us", ((dword11 >> 8) & 0xff) * 100, 32);
+}
+
+void NVMeFixPlugin::publishCoalescing(ControllerEntry& entry) {
+	if (!__atomic_load_n(&entry.irqAdaptive, __ATOMIC_RELAXED))
+		return;
+
+	auto& policy = entry.irqPolicy;
+	entry.controller->setProperty("irq-coalesce-level", policy.level(), 32);
+	entry.controller->setProperty("irq-coalesce-changes", policy.changes, 32);
+	entry.controller->setProperty("irq-iops", policy.iops, 64);
+	entry.controller->setProperty("irq-rate", policy.interruptRate, 64);
+	entry.controller->setProperty("irq-depth-x100", policy.depth100, 32);
+	entry.controller->setProperty("irq-interrupts", __atomic_load_n(&entry.irqCount, __ATOMIC_RELAXED), 64);
+}
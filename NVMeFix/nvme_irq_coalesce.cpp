@@ -0,0 +1,64 @@
+//
+// @file nvme_irq_coalesce.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+#include "nvme_irq_coalesce.hpp"
+
+namespace Coalesce {
+
+void Policy::defaultConfig(Config& config) {
+	/* Aggregation time bounds the delay when the threshold is not reached */
+	config.settings[Off] = {0, 0};
+	config.settings[Light] = {3, 1};
+	config.settings[Heavy] = {15, 2};
+
+	config.minIops[Off] = 0;
+	config.minIops[Light] = 20000;
+	config.minIops[Heavy] = 100000;
+
+	config.minDepth100[Off] = 0;
+	config.minDepth100[Light] = 150;
+	config.minDepth100[Heavy] = 400;
+
+	config.upSamples = 2;
+}
+
+Level Policy::target() const {
+	unsigned lvl = LevelCount - 1;
+	while (lvl > Off && (iops < config.minIops[lvl] || depth100 < config.minDepth100[lvl]))
+		lvl--;
+	return static_cast<Level>(lvl);
+}
+
+bool Policy::update(const Sample& sample) {
+	uint64_t elapsedUs = sample.elapsedUs ? sample.elapsedUs : 1;
+	iops = sample.requests * 1000000 / elapsedUs;
+	interruptRate = sample.interrupts * 1000000 / elapsedUs;
+	uint64_t bursts = sample.bursts ? sample.bursts : 1;
+	uint64_t depth = sample.requests * 100 / bursts;
+	depth100 = depth > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(depth);
+
+	auto next = target();
+	if (next > current && ++pending < config.upSamples)
+		return false;
+
+	pending = 0;
+	if (next == current)
+		return false;
+
+	current = next;
+	changes++;
+	return true;
+}
+
+}
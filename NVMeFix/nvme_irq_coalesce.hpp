@@ -0,0 +1,111 @@
+//
+// @file nvme_irq_coalesce.hpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+#ifndef nvme_irq_coalesce_hpp
+#define nvme_irq_coalesce_hpp
+
+#include <stdint.h>
+
+#include "nvme.h"
+
+/**
+ * Interrupt Coalescing selection from the observed I/O rate and queue depth. Completions are not
+ * visible to us, so depth is estimated as the number of requests issued between two interrupts:
+ * a synchronous QD1 workload issues one, while deep queues issue several per interrupt, as every
+ * interrupt completes several requests. Time is passed in samples by the caller, so the policy may
+ * be driven by a fake clock on the host.
+ */
+namespace Coalesce {
+
+struct Setting {
+	/* Completions to aggregate, 0's based as in the command */
+	uint8_t threshold;
+	/* Aggregation time in 100 microsecond units */
+	uint8_t time;
+
+	uint32_t dword11() const {
+		return threshold | (static_cast<uint32_t>(time) << 8);
+	}
+};
+
+enum Level : unsigned {
+	/* Every completion interrupts, which keeps QD1 latency */
+	Off,
+	Light,
+	Heavy,
+	LevelCount
+};
+
+struct Sample {
+	uint64_t requests;
+	uint64_t interrupts;
+	/* Requests that were the first one since the previous interrupt */
+	uint64_t bursts;
+	uint64_t elapsedUs;
+};
+
+class Policy {
+public:
+	struct Config {
+		Setting settings[LevelCount];
+		/* Rate and requests per interrupt in hundredths needed for each level above Off */
+		uint64_t minIops[LevelCount];
+		uint32_t minDepth100[LevelCount];
+		/* Consecutive samples asking for more coalescing before it is raised */
+		unsigned upSamples;
+	};
+
+	static constexpr uint64_t defaultSampleUs {250 * 1000};
+
+	static void defaultConfig(Config& config);
+
+	void init(const Config& cfg) {
+		config = cfg;
+		current = Off;
+		pending = 0;
+	}
+
+	/**
+	 * Takes the sample that just ended. Returns true if the level changed and has to be programmed.
+	 * Coalescing is lowered right away, so that latency-sensitive I/O is not delayed, and only raised
+	 * once the load lasts.
+	 */
+	bool update(const Sample& sample);
+
+	Level level() const {
+		return current;
+	}
+
+	const Setting& setting() const {
+		return config.settings[current];
+	}
+
+	/* Over the last sample */
+	uint64_t iops {0};
+	uint64_t interruptRate {0};
+	uint32_t depth100 {0};
+	uint32_t changes {0};
+
+private:
+	Level target() const;
+
+	Config config {};
+	Level current {Off};
+	unsigned pending {0};
+};
+
+}
+
+#endif /* nvme_irq_coalesce_hpp */
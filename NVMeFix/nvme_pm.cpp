@@ -14,8 +14,11 @@
 
 #include <IOKit/IOService.h>
 #include <IOKit/IOService.h>
+#include <IOKit/IOUserClient.h>
 #include <IOKit/pwr_mgt/IOPM.h>
 #include <kern/assert.h>
+#include <kern/task.h>
+#include <Headers/kern_time.hpp>
 
 #include "Log.hpp"
 #include "NVMeFixPlugin.hpp"
@@ -42,10 +45,12 @@ bool NVMeFixPlugin::PM::init(ControllerEntry& entry, const NVMe::nvme_id_ctrl* c
 	}
 	static_cast<NVMePMProxy*>(entry.pm)->entry = &entry;
 
+	/* Host memory buffer is taken back around controller sleep whichever way its power is managed */
+	DBGLOG(Log::PM, "Registering power change interest");
+	entry.controller->registerInterestedDriver(entry.pm);
+
 	// If we did not manage to enable APST, assume we can't reenable it next
 	if (apst) {
-		DBGLOG(Log::PM, "Registering power change interest");
-		entry.controller->registerInterestedDriver(entry.pm);
 		entry.nstates = 0;
 		entry.powerStates = nullptr;
 	}
@@ -69,6 +74,8 @@ bool NVMeFixPlugin::PM::initActivePM(ControllerEntry& entry, const NVMe::nvme_id
 		if (!(ctrl->psd[state].flags & NVMe::NVME_PS_FLAGS_NON_OP_STATE))
 			op++;
 
+	/* Off state followed by the operational states */
+	entry.nstates = op + 1;
 	entry.powerStates = new IOPMPowerState[entry.nstates];
 	if (!entry.powerStates) {
 		SYSLOG(Log::PM, "Failed to allocate power state buffer");
@@ -109,6 +116,31 @@ bool NVMeFixPlugin::PM::initActivePM(ControllerEntry& entry, const NVMe::nvme_id
 		idx++;
 	}
 
+	/* Without APST nothing but us changes the power state, so it may be cached */
+	bool apstEnabled {false};
+	NVMe::nvme_feat_auto_pst table;
+	if (plugin.APSTenabled(entry, apstEnabled) != kIOReturnSuccess || apstEnabled) {
+		entry.apstExternal = true;
+		if (apstEnabled && plugin.readAPST(entry, table) == kIOReturnSuccess) {
+			uint64_t minIdleMs {0};
+			for (auto e : table.entries) {
+				auto itpt = (e >> 8) & 0xffffff;
+				if (itpt && (!minIdleMs || itpt < minIdleMs))
+					minIdleMs = itpt;
+			}
+			entry.apstMinIdleNs = minIdleMs * 1000000;
+		}
+		DBGLOG(Log::PM, "APST enabled by firmware, shortest idle timeout %llu ns", entry.apstMinIdleNs);
+	}
+
+	/**
+	 * IOPM learns about activity up to a window late, which can only make an idle period end that
+	 * much early, so the window is kept well below the idle period.
+	 */
+	uint32_t windowMs {defaultTickleWindowMs};
+	propertyFromParent(entry.controller, "pm-tickle-window-ms", windowMs);
+	entry.tickleWindowNs = min(windowMs, idlePeriod * 1000 / 4) * 1000000ull;
+
 	DBGLOG(Log::PM, "Publishing %u states", entry.nstates);
 	
 	auto status = entry.pm->registerPowerDriver(entry.pm, entry.powerStates, entry.nstates);
@@ -124,7 +156,9 @@ bool NVMeFixPlugin::PM::initActivePM(ControllerEntry& entry, const NVMe::nvme_id
 	}
 
 	entry.pm->changePowerStateTo(1); /* Clamp lowest PS at 1 */
-	entry.pm->setIdleTimerPeriod(idlePeriod);
+	/* With the governor IOPM only handles system sleep and wake, and stays in the highest state otherwise */
+	if (!entry.governed)
+		entry.pm->setIdleTimerPeriod(idlePeriod);
 
 	return true;
 fail:
@@ -141,42 +175,168 @@ OSDefineMetaClassAndStructors(NVMePMProxy, IOService);
 IOReturn NVMePMProxy::setPowerState(unsigned long powerStateOrdinal, IOService *whatDevice) {
 	DBGLOG(Log::PM, "setPowerState %lu", powerStateOrdinal);
 
-	if (powerStateOrdinal == 0)
+	__atomic_store_n(&entry->pmOrdinal, powerStateOrdinal, __ATOMIC_RELAXED);
+
+	/* Controller may be reset over sleep */
+	if (powerStateOrdinal == 0) {
+		__atomic_store_n(&entry->psKnown, -1, __ATOMIC_RELAXED);
+		__atomic_store_n(&entry->featuresLost, true, __ATOMIC_RELAXED);
+		/* Rearmed on power-up below, a pending action would find the controller off */
+		if (entry->govTimer)
+			entry->govTimer->cancelTimeout();
 		return kIOPMAckImplied;
+	}
 
-	auto& plugin = NVMeFixPlugin::globalPlugin();
+	/* Controller is back in PS0 after wake, so let the governor start over and reprogram its state */
+	if (entry->governed && entry->govTimer) {
+		if (IOLockTryLock(entry->lck)) {
+			entry->governor.activity(getCurrentTimeNs() / 1000);
+			if (entry->tputGoverned)
+				entry->tputGovernor.record(getCurrentTimeNs() / 1000, 0);
+			entry->govState = NVMeFixPlugin::ControllerEntry::noGovState;
+			IOLockUnlock(entry->lck);
+		}
+		entry->govTimer->setTimeoutUS(1);
+		return kIOPMAckImplied;
+	}
 
-	unsigned dword11 = ((static_cast<unsigned>(entry->nstates) - 1) -
-						static_cast<unsigned>(powerStateOrdinal)) & 0b1111;
-	/* It's ok to skip active PM */
+	/* Entry lock may be held while IOPM calls us, e.g. during setup, so the change is deferred then */
 	if (IOLockTryLock(entry->lck)) {
-		uint32_t res {};
-		auto ret = plugin.NVMeFeatures(*entry, NVMe::NVME_FEAT_POWER_MGMT, nullptr, nullptr, &res,
-			false);
-		res &= 0b1111;
+		/* Admin commands are issued from the entry workloop, and IOPM waits for acknowledgeSetPowerState */
+		if (NVMeFixPlugin::PM::submitTransition(*entry, powerStateOrdinal) == kIOReturnSuccess) {
+			IOLockUnlock(entry->lck);
+			return NVMeFixPlugin::PM::transitionLatencyUs(*entry, powerStateOrdinal);
+		}
 
-		DBGLOG(Log::PM, "Current ps 0x%x, proposed 0x%x", res, dword11);
+		NVMeFixPlugin::PM::applyPowerState(*entry, powerStateOrdinal);
+		IOLockUnlock(entry->lck);
+	} else {
+		DBGLOG(Log::PM, "Failed to obtain entry lock, deferring power state change");
+		__atomic_store_n(&entry->psDeferred, true, __ATOMIC_RELAXED);
+		/* The workloop waits for the lock holder, without the queue periodicAction applies it */
+		if (entry->adminTimer)
+			entry->adminTimer->setTimeoutUS(1);
+	}
 
-		if (ret != kIOReturnSuccess) {
-			SYSLOG(Log::PM, "Failed to get power state");
-		} else if (res < entry->nstates - 1) { /* Only transition to op state if we're not in nop state due to APST */
-			DBGLOG(Log::PM, "Setting power state 0x%x", dword11);
+	return kIOPMAckImplied; /* No real way to signal error (not that we expect any) */
+}
 
-			ret = plugin.NVMeFeatures(*entry, NVMe::NVME_FEAT_POWER_MGMT, &dword11, nullptr, nullptr,
-										   true);
-			if (ret != kIOReturnSuccess)
-				SYSLOG(Log::PM, "Failed to set power state");
-		}
+/* Called with entry lock held */
+void NVMeFixPlugin::PM::applyPowerState(ControllerEntry& entry, unsigned long powerStateOrdinal) {
+	__atomic_store_n(&entry.psDeferred, false, __ATOMIC_RELAXED);
+	applyState(entry, ((static_cast<unsigned>(entry.nstates) - 1) -
+					   static_cast<unsigned>(powerStateOrdinal)) & 0b1111);
+}
 
-		IOLockUnlock(entry->lck);
+/* Called with entry lock held */
+IOReturn NVMeFixPlugin::PM::applyState(ControllerEntry& entry, unsigned state) {
+	auto& plugin = NVMeFixPlugin::globalPlugin();
+
+	unsigned dword11 = cappedState(entry, state);
+
+	auto start = getCurrentTimeNs();
+	auto ret = kIOReturnSuccess;
+	uint32_t res {};
+
+	/* Power state is set right below, so it is not replayed */
+	bool resumed = entry.featuresLost;
+	plugin.restoreFeatures(entry, false);
+
+	bool query = powerStateStale(entry);
+
+	if (query) {
+		ret = plugin.NVMeFeatures(entry, NVMe::NVME_FEAT_POWER_MGMT, nullptr, nullptr, &res, false);
+		res &= 0b1111;
+	} else {
+		res = static_cast<uint32_t>(entry.psKnown);
+		entry.psQueriesAvoided++;
+	}
+
+	DBGLOG(Log::PM, "Current ps 0x%x%s, proposed 0x%x", res, query ? "" : " (cached)", dword11);
+
+	if (ret != kIOReturnSuccess) {
+		SYSLOG(Log::PM, "Failed to get power state");
+		entry.psKnown = -1;
+	} else if (res < entry.nstates - 1) { /* Only transition to op state if we're not in nop state due to APST */
+		DBGLOG(Log::PM, "Setting power state 0x%x", dword11);
+
+		ret = plugin.NVMeFeatures(entry, NVMe::NVME_FEAT_POWER_MGMT, &dword11, nullptr, nullptr, true);
+		if (ret != kIOReturnSuccess)
+			SYSLOG(Log::PM, "Failed to set power state");
+		entry.psKnown = ret == kIOReturnSuccess ? static_cast<int>(dword11) : -1;
 	} else
-		DBGLOG(Log::PM, "Failed to obtain entry lock");
+		entry.psKnown = static_cast<int>(res);
 
-	/**
-	 * FIXME: We should return entry + exit + switching overhead latency here, but at least in my tests
-	 * it is always 0.
-	 */
-	return kIOPMAckImplied; /* No real way to signal error (not that we expect any) */
+	auto ns = getCurrentTimeNs() - start;
+	auto& avg = query ? entry.psSetNsQueried : entry.psSetNsCached;
+	avg = avg ? avg - avg / 8 + ns / 8 : ns;
+	if (resumed)
+		entry.resumeLatency.record(ns / 1000);
+	return ret;
+}
+
+/**
+ * Upper bound of a transition to `powerStateOrdinal`: the controller may have to leave any
+ * operational state before entering the target one, we may have to query the state first, and
+ * another admin command may be running on the workloop. Called with entry lock held.
+ */
+uint32_t NVMeFixPlugin::PM::transitionLatencyUs(const ControllerEntry& entry, unsigned long powerStateOrdinal) {
+	uint32_t exitUs {0}, entryUs {0};
+	auto target = (entry.nstates - 1) - powerStateOrdinal;
+
+	auto ctrl = entry.identify ? static_cast<const NVMe::nvme_id_ctrl*>(entry.identify->getBytesNoCopy()) :
+		nullptr;
+	if (ctrl) {
+		for (unsigned state = 0; state <= ctrl->npss && state < entry.nstates - 1; state++)
+			exitUs = max(exitUs, static_cast<uint32_t>(ctrl->psd[state].exit_lat));
+		if (target <= ctrl->npss)
+			entryUs = ctrl->psd[target].entry_lat;
+	}
+
+	auto adminUs = static_cast<uint32_t>(2 * max(entry.psSetNsQueried, entry.psSetNsCached) / 1000);
+
+	/* Transition may wait for a command of lower priority already running on the workloop */
+	uint32_t runningUs {adminLatencyUs};
+	for (auto& slot : entry.adminLatency.slots) {
+		if (!slot.used)
+			break;
+		runningUs = max(runningUs, slot.hist.percentile(990));
+	}
+
+	return exitUs + entryUs + max(adminUs, static_cast<uint32_t>(adminLatencyUs)) + runningUs;
+}
+
+/* Called with entry lock held */
+IOReturn NVMeFixPlugin::PM::submitTransition(ControllerEntry& entry, unsigned long powerStateOrdinal) {
+	Admin::Command command {};
+	command.cmd.opcode = NVMe::nvme_admin_set_features;
+	command.cmd.cdw10 = NVMe::NVME_FEAT_POWER_MGMT;
+	command.cmd.cdw11 = ((static_cast<unsigned>(entry.nstates) - 1) -
+						 static_cast<unsigned>(powerStateOrdinal)) & 0b1111;
+	command.callback = transitionApplied;
+	command.context = entry.pm;
+	command.priority = Admin::Priority::Transition;
+	return NVMeFixPlugin::globalPlugin().submitAdmin(entry, command);
+}
+
+/* IOPM waits for the change to be acknowledged even if it failed or was superseded */
+void NVMeFixPlugin::PM::transitionApplied(void*, void* context, int, uint32_t) {
+	static_cast<IOService*>(context)->acknowledgeSetPowerState();
+}
+
+IOReturn NVMePMProxy::powerStateWillChangeTo(IOPMPowerFlags capabilities, unsigned long stateNumber,
+											 IOService *whatDevice) {
+	if (!entry || entry->controller != whatDevice || (capabilities & kIOPMDeviceUsable))
+		return kIOPMAckImplied;
+
+	DBGLOG(Log::PM, "powerStateWillChangeTo 0x%x", stateNumber);
+
+	/* The controller is still usable here, and will not be until it is back */
+	IOLockLock(entry->lck);
+	NVMeFixPlugin::globalPlugin().returnHMB(*entry);
+	IOLockUnlock(entry->lck);
+
+	return kIOPMAckImplied;
 }
 
 IOReturn NVMePMProxy::powerStateDidChangeTo(IOPMPowerFlags capabilities, unsigned long stateNumber,
@@ -194,6 +354,7 @@ IOReturn NVMePMProxy::powerStateDidChangeTo(IOPMPowerFlags capabilities, unsigne
 	/* We only get once chance after wake, so we insist on getting to critical section */
 	IOLockLock(entry->lck);
 	NVMe::nvme_id_ctrl* identify {};
+	auto start = getCurrentTimeNs();
 
 	if (entry->controller != whatDevice) {
 		DBGLOG(Log::PM, "Power state change for irrelevant device %s",
@@ -201,23 +362,48 @@ IOReturn NVMePMProxy::powerStateDidChangeTo(IOPMPowerFlags capabilities, unsigne
 		goto done;
 	}
 
-	if (!entry->apstAllowed()) {
-		DBGLOG(Log::PM, "APST not allowed");
+	/* Commands replayed on the way up find the controller awake and restart its idle timeline */
+	entry->adminActiveUs = start / 1000;
+
+	/* Queued first, so that the controller has its buffer back before features are restored */
+	plugin.resumeHMB(*entry);
+
+	/* With active PM, features are replayed by setPowerState along with the power state */
+	if (entry->powerStates)
 		goto done;
-	}
 
-	if (!entry->apste) {
-		DBGLOG(Log::PM, "APST not enabled yet; not re-enabling");
+	/* Without APST there is no cheap way to tell whether the controller was reset */
+	if (!entry->apstAllowed() || !entry->apste) {
+		DBGLOG(Log::PM, "APST not enabled; replaying other features");
+		entry->featuresLost = true;
+		entry->resumeStartNs = start;
+		if (!plugin.replayFeatures(*entry)) {
+			plugin.restoreFeatures(*entry, true);
+			entry->resumeLatency.record((getCurrentTimeNs() - start) / 1000);
+		}
 		goto done;
 	}
 
+	/* Let the workloop query APSTE, so that waking up is not held up by the controller */
+	if (entry->apstPlan.maxPs != -1) {
+		Admin::Command command {};
+		command.cmd.opcode = NVMe::nvme_admin_get_features;
+		command.cmd.cdw10 = NVMe::NVME_FEAT_AUTO_PST;
+		command.callback = NVMeFixPlugin::apstChecked;
+		command.priority = Admin::Priority::Resume;
+		entry->resumeStartNs = start;
+		if (plugin.submitAdmin(*entry, command) == kIOReturnSuccess)
+			goto done;
+	}
+
 	assert(entry->identify);
 	identify = static_cast<decltype(identify)>(entry->identify->getBytesNoCopy());
 	if (!identify) {
 		DBGLOG(Log::PM, "Failed to get identify bytes");
 		goto done;
-	} else if (!plugin.enableAPST(*entry, identify))
+	} else if (!plugin.restoreAPST(*entry, identify))
 		DBGLOG(Log::PM, "Failed to re-enable APST");
+	entry->resumeLatency.record((getCurrentTimeNs() - start) / 1000);
 
 done:
 	IOLockUnlock(entry->lck);
@@ -225,32 +411,460 @@ done:
 	return IOPMAckImplied;
 }
 
+IOReturn NVMePMProxy::setProperties(OSObject* properties) {
+	auto dict = OSDynamicCast(OSDictionary, properties);
+	if (!dict || !entry)
+		return kIOReturnUnsupported;
+
+	/* Profile trades power for latency of the whole system, so it is not up to any process */
+	if (IOUserClient::clientHasPrivilege(current_task(), kIOClientPrivilegeAdministrator) != kIOReturnSuccess) {
+		DBGLOG(Log::PM, "Refusing APST profile change from unprivileged task");
+		return kIOReturnNotPrivileged;
+	}
+
+	auto name = OSDynamicCast(OSString, dict->getObject("apst-profile"));
+	if (!name)
+		return kIOReturnUnsupported;
+
+	auto profile = APST::profileForName(name->getCStringNoCopy());
+	if (!profile) {
+		DBGLOG(Log::PM, "Unknown APST profile %s", name->getCStringNoCopy());
+		return kIOReturnBadArgument;
+	}
+
+	return NVMeFixPlugin::globalPlugin().setAPSTProfile(*entry, *profile);
+}
+
 bool NVMeFixPlugin::PM::solveSymbols(KernelPatcher& kp) {
 	auto idx = plugin.kextInfo.loadIndex;
 	bool ret =
 	plugin.kextFuncs.IONVMeController.activityTickle.routeVirtual(kp, idx,
 													"__ZTV16IONVMeController", 249, activityTickle);
 
+	/* Only used for latency measurement and coalescing, so failing to route it is not fatal */
+	if (ret && !interruptRouted) {
+		interruptRouted = plugin.kextFuncs.IONVMeController.FilterInterruptRequest.route(kp, idx,
+																						  filterInterrupt);
+		DBGLOG_COND(!interruptRouted, Log::PM, "Failed to route FilterInterruptRequest");
+	}
+
 	return ret;
 }
 
+/**
+ * Runs in primary interrupt context, so it may only use the lock-free lookup. The first interrupt
+ * after an I/O request that ended an idle period is taken as its completion. Interrupts are also
+ * counted for adaptive coalescing.
+ */
+bool NVMeFixPlugin::PM::filterInterrupt(void* controller, void* source) {
+	auto& plugin = NVMeFixPlugin::globalPlugin();
+
+	size_t slot {};
+	auto entry = plugin.entries.acquire(controller, slot);
+	if (entry) {
+		if (__atomic_load_n(&entry->wakeStartNs, __ATOMIC_RELAXED)) {
+			auto start = __atomic_exchange_n(&entry->wakeStartNs, 0, __ATOMIC_ACQUIRE);
+			auto state = __atomic_load_n(&entry->wakeState, __ATOMIC_RELAXED);
+			if (start && state < ControllerEntry::maxPowerStates)
+				entry->psWakeLatency[state].record((getCurrentTimeNs() - start) / 1000);
+		}
+		if (__atomic_load_n(&entry->irqAdaptive, __ATOMIC_RELAXED)) {
+			__atomic_fetch_add(&entry->irqCount, 1, __ATOMIC_RELAXED);
+			if (!__atomic_load_n(&entry->irqSeen, __ATOMIC_RELAXED))
+				__atomic_store_n(&entry->irqSeen, true, __ATOMIC_RELAXED);
+		}
+		plugin.entries.release(slot);
+	}
+
+	return plugin.kextFuncs.IONVMeController.FilterInterruptRequest(controller, source);
+}
+
+/* Starts timing the first I/O request after idle, called for every request */
+void NVMeFixPlugin::PM::trackWake(ControllerEntry& entry) {
+	auto now = getCurrentTimeNs();
+	/* Of concurrent requests only the first one sees the idle gap */
+	auto last = __atomic_exchange_n(&entry.lastIoNs, now, __ATOMIC_RELAXED);
+	if (!last || now < last || now - last < wakeIdleNs)
+		return;
+
+	__atomic_store_n(&entry.wakeState, expectedState(entry, (now - last) / 1000), __ATOMIC_RELAXED);
+	__atomic_store_n(&entry.wakeStartNs, now, __ATOMIC_RELEASE);
+}
+
+/* Power state the controller is expected to have reached after `idleUs` of inactivity */
+unsigned NVMeFixPlugin::PM::expectedState(const ControllerEntry& entry, uint64_t idleUs) {
+	if (!__atomic_load_n(&entry.apste, __ATOMIC_RELAXED)) {
+		auto ps = __atomic_load_n(&entry.psKnown, __ATOMIC_RELAXED);
+		return ps < 0 ? 0 : static_cast<unsigned>(ps);
+	}
+
+	/* Follow our APST table from PS0, as the active state is not tracked with APST */
+	unsigned state {0};
+	uint64_t elapsedUs {0};
+	for (unsigned i = 0; i < ControllerEntry::maxPowerStates; i++) {
+		uint64_t e = entry.apstPlan.table.entries[state];
+		uint64_t itptUs = ((e >> 8) & 0xffffff) * 1000;
+		if (!itptUs || elapsedUs + itptUs > idleUs)
+			break;
+		elapsedUs += itptUs;
+		state = (e >> 3) & 0x1f;
+	}
+
+	return state;
+}
+
+/**
+ * Whether APST has likely taken the controller to a non-operational state, following our table from
+ * the last I/O, admin command or power transition.
+ */
+bool NVMeFixPlugin::PM::idleNonOperational(const ControllerEntry& entry) {
+	if (!__atomic_load_n(&entry.apste, __ATOMIC_RELAXED) || !entry.identify)
+		return false;
+
+	auto ctrl = static_cast<const NVMe::nvme_id_ctrl*>(entry.identify->getBytesNoCopy());
+	if (!ctrl)
+		return false;
+
+	auto nowUs = getCurrentTimeNs() / 1000;
+	auto lastUs = max(entry.apstTuner.lastActivity(), entry.adminActiveUs);
+	auto state = expectedState(entry, nowUs > lastUs ? nowUs - lastUs : 0);
+	return state > ctrl->npss || (ctrl->psd[state].flags & NVMe::NVME_PS_FLAGS_NON_OP_STATE);
+}
+
 bool NVMeFixPlugin::PM::activityTickle(void* controller, unsigned long type, unsigned long stateNumber) {
 	auto& plugin = NVMeFixPlugin::globalPlugin();
 
-	ControllerEntry* entry {nullptr};
-	IOLockLock(plugin.lck);
-	entry = plugin.entryForController(static_cast<IOService*>(controller));
-	IOLockUnlock(plugin.lck);
-	
+	size_t slot {};
+	auto entry = plugin.entries.acquire(controller, slot);
+	if (entry) {
+		if (plugin.PM.interruptRouted)
+			trackWake(*entry);
+		bool adaptive = __atomic_load_n(&entry->irqAdaptive, __ATOMIC_RELAXED);
+		if (plugin.powerBudgetUw || adaptive)
+			__atomic_fetch_add(&entry->ioRequests, 1, __ATOMIC_RELAXED);
+		if (adaptive)
+			coalesceTickle(*entry);
+		tickle(*entry);
+		plugin.entries.release(slot);
+	} else if (__atomic_load_n(&plugin.entriesOverflow, __ATOMIC_RELAXED)) {
+		/* Entry did not fit into the table, so the global lock keeps it alive */
+		IOLockLock(plugin.lck);
+		entry = plugin.entryForController(static_cast<IOService*>(controller));
+		if (entry)
+			tickle(*entry);
+		IOLockUnlock(plugin.lck);
+	}
+
+	return plugin.kextFuncs.IONVMeController.activityTickle(controller, type, stateNumber);
+}
+
+/* Whether the controller may have left the last known power state on its own */
+bool NVMeFixPlugin::PM::powerStateStale(const ControllerEntry& entry) {
+	if (entry.psKnown < 0)
+		return true;
+	if (!entry.apstExternal)
+		return false;
+
+	/* Last forwarded tickle may be up to a window older than the last I/O */
+	auto idleNs = getCurrentTimeNs() - __atomic_load_n(&entry.lastTickleNs, __ATOMIC_RELAXED);
+	return !entry.apstMinIdleNs || idleNs + entry.tickleWindowNs >= entry.apstMinIdleNs;
+}
+
+/* Invoked for every I/O request on any CPU, so it must not block */
+void NVMeFixPlugin::PM::tickle(ControllerEntry& entry) {
 	/* If APST is enabled, we do not manage NVMe PM ourselves. */
 	/* We cannot avoid hooking activityTickle, however, as don't know if we have APST in advance */
-	if (entry && IOLockTryLock(entry->lck)) {
-		if (!entry->apste && entry->powerStates && entry->pm) {
-//			DBGLOG("pm", "activityTickle");
-			entry->pm->activityTickle(kIOPMSuperclassPolicy1, entry->nstates - 1);
+	if (__atomic_load_n(&entry.apste, __ATOMIC_RELAXED)) {
+		entry.apstTuner.tickle(getCurrentTimeNs() / 1000);
+		return;
+	}
+
+	if (!__atomic_load_n(&entry.pmReady, __ATOMIC_ACQUIRE))
+		return;
+
+	if (entry.governed) {
+		/* The rate must not drop under contention, so requests are counted before taking the lock */
+		bool first = entry.tputGoverned && !__atomic_fetch_add(&entry.tputPending, 1, __ATOMIC_RELAXED);
+
+		/* Idle governor state is shared with its timer, and it is fine to miss a tickle under contention */
+		if (IOLockTryLock(entry.lck)) {
+			governorKick(entry, getCurrentTimeNs() / 1000);
+			IOLockUnlock(entry.lck);
+		} else if (first)
+			entry.govTimer->setTimeoutUS(1);
+	} else {
+		auto now = getCurrentTimeNs();
+		auto last = __atomic_load_n(&entry.lastTickleNs, __ATOMIC_RELAXED);
+		/* Below the highest state every tickle is forwarded, as IOPM has to raise it */
+		bool highest = __atomic_load_n(&entry.pmOrdinal, __ATOMIC_RELAXED) == entry.nstates - 1;
+
+		/* Of concurrent tickles only one wins the forward, and it covers the others */
+		if ((highest && now - last < entry.tickleWindowNs) ||
+			!__atomic_compare_exchange_n(&entry.lastTickleNs, &last, now, false, __ATOMIC_RELAXED,
+										 __ATOMIC_RELAXED)) {
+			__atomic_fetch_add(&entry.ticklesSuppressed, 1, __ATOMIC_RELAXED);
+			return;
 		}
-		IOLockUnlock(entry->lck);
+
+		__atomic_fetch_add(&entry.ticklesForwarded, 1, __ATOMIC_RELAXED);
+//		DBGLOG("pm", "activityTickle");
+		entry.pm->activityTickle(kIOPMSuperclassPolicy1, entry.nstates - 1);
 	}
+}
 
-	return plugin.kextFuncs.IONVMeController.activityTickle(controller, type, stateNumber);
+bool NVMeFixPlugin::PM::initGovernor(ControllerEntry& entry, const NVMe::nvme_id_ctrl* ctrl) {
+	auto fail = [&entry]() {
+		entry.governed = false;
+		/* Fall back to IOPM idle timer */
+		if (entry.powerStates && entry.pm)
+			entry.pm->setIdleTimerPeriod(idlePeriod);
+		return false;
+	};
+
+	if (!entry.powerStates || !entry.workLoop)
+		return fail();
+
+	Governor::IdleGovernor::Config config;
+	Governor::IdleGovernor::defaultConfig(config);
+
+	/* Array of little-endian 4-byte hold times per operational state, the last one is repeated */
+	auto parent = entry.controller->getParentEntry(gIOServicePlane);
+	auto holds = parent ? OSDynamicCast(OSData, parent->getProperty("pm-hold-ms")) : nullptr;
+	if (holds && holds->getLength() >= sizeof(uint32_t)) {
+		auto n = holds->getLength() / sizeof(uint32_t);
+		auto ms = static_cast<const uint32_t*>(holds->getBytesNoCopy());
+		for (size_t i = 0; i < Governor::Levels::maxLevels; i++)
+			config.holdUs[i] = static_cast<uint64_t>(ms[min(i, n - 1)]) * 1000;
+	}
+
+	uint32_t hysteresisMs {static_cast<uint32_t>(config.hysteresisUs / 1000)};
+	propertyFromParent(entry.controller, "pm-hysteresis-ms", hysteresisMs);
+	config.hysteresisUs = static_cast<uint64_t>(hysteresisMs) * 1000;
+
+	if (!entry.governor.init(ctrl->psd, ctrl->npss, config, getCurrentTimeNs() / 1000)) {
+		SYSLOG(Log::PM, "No operational states for the governor");
+		return fail();
+	}
+
+	/* 0 steps down on idle only, 1 also follows the I/O rate */
+	uint32_t policy {0};
+	propertyFromParent(entry.controller, "pm-governor-policy", policy);
+	if (policy == 1) {
+		Governor::ThroughputGovernor::Config tputConfig;
+		Governor::ThroughputGovernor::defaultConfig(tputConfig);
+		entry.tputGoverned = entry.tputGovernor.init(ctrl->psd, ctrl->npss, tputConfig,
+													 getCurrentTimeNs() / 1000);
+	} else if (policy != 0)
+		SYSLOG(Log::PM, "Ignoring unknown pm-governor-policy %u", policy);
+
+	entry.govTimer = IOTimerEventSource::timerEventSource(entry.pm, governorAction);
+	if (!entry.govTimer) {
+		SYSLOG(Log::PM, "Failed to create governor timer");
+		return fail();
+	}
+
+	if (entry.workLoop->addEventSource(entry.govTimer) != kIOReturnSuccess) {
+		SYSLOG(Log::PM, "Failed to add governor timer to workloop");
+		entry.govTimer->release();
+		entry.govTimer = nullptr;
+		return fail();
+	}
+
+	entry.controller->setProperty("pm-governor", true);
+	entry.govTimer->setTimeoutUS(1);
+	return true;
+}
+
+/* Runs on the entry workloop, applies the governor decision and sleeps until the next one */
+void NVMeFixPlugin::PM::governorAction(OSObject* owner, IOTimerEventSource* sender) {
+	auto pm = OSDynamicCast(NVMePMProxy, owner);
+	if (!pm || !pm->entry)
+		return;
+
+	auto& entry = *pm->entry;
+	auto& plugin = NVMeFixPlugin::globalPlugin();
+
+	IOLockLock(entry.lck);
+
+	/* Raced with power-off, setPowerState rearms the timer once the controller is back */
+	if (entry.poweredOff()) {
+		IOLockUnlock(entry.lck);
+		return;
+	}
+
+	/* The governor state is reprogrammed below anyway */
+	plugin.restoreFeatures(entry, false);
+
+	auto now = getCurrentTimeNs() / 1000;
+	if (entry.tputGoverned) {
+		auto pending = __atomic_exchange_n(&entry.tputPending, 0, __ATOMIC_RELAXED);
+		if (pending)
+			entry.tputGovernor.record(now, pending);
+	}
+	entry.governor.evaluate(now);
+
+	/* Both governors order levels by decreasing power, so the deeper one wins */
+	auto target = entry.governor.targetState();
+	auto deadline = entry.governor.deadline();
+	if (entry.tputGoverned) {
+		entry.tputGovernor.evaluate(now);
+		if (entry.tputGovernor.currentLevel() > entry.governor.currentLevel())
+			target = entry.tputGovernor.targetState();
+		auto tputDeadline = entry.tputGovernor.deadline();
+		if (tputDeadline && (!deadline || tputDeadline < deadline))
+			deadline = tputDeadline;
+	}
+
+	target = cappedState(entry, target);
+	if (target != entry.govState) {
+		unsigned dword11 = target & 0b11111;
+		DBGLOG(Log::PM, "Governor setting power state 0x%x", dword11);
+		if (plugin.NVMeFeatures(entry, NVMe::NVME_FEAT_POWER_MGMT, &dword11, nullptr, nullptr, true) ==
+			kIOReturnSuccess) {
+			entry.govState = target;
+			entry.psKnown = static_cast<int>(target);
+		} else {
+			SYSLOG(Log::PM, "Failed to set power state");
+			entry.psKnown = -1;
+		}
+	}
+
+	IOLockUnlock(entry.lck);
+
+	/* Activity rearms the timer, so there is nothing to wait for in the deepest state */
+	if (deadline)
+		sender->setTimeoutUS(static_cast<uint32_t>(min(deadline > now ? deadline - now : 1,
+													   static_cast<uint64_t>(UINT32_MAX))));
+}
+
+/* Record I/O with the entry lock held, and schedule the governor if it has to act */
+void NVMeFixPlugin::PM::governorKick(ControllerEntry& entry, uint64_t nowUs) {
+	bool kick = entry.governor.activity(nowUs);
+	if (entry.tputGoverned) {
+		/* Includes requests counted while the lock was contended */
+		auto pending = __atomic_exchange_n(&entry.tputPending, 0, __ATOMIC_RELAXED);
+		if (pending)
+			kick |= entry.tputGovernor.record(nowUs, pending);
+	}
+
+	/* Changing state involves an admin command, so leave it to the workloop */
+	if (kick)
+		entry.govTimer->setTimeoutUS(1);
+}
+
+void NVMeFixPlugin::PM::publishStats(ControllerEntry& entry) {
+	if (entry.governed) {
+		entry.controller->setProperty("pm-governor-steps", entry.governor.stepsDown, 32);
+		entry.controller->setProperty("pm-governor-wakeups", entry.governor.wakeups, 32);
+	}
+	if (entry.tputGoverned) {
+		entry.controller->setProperty("pm-governor-iops", entry.tputGovernor.rate(), 64);
+		entry.controller->setProperty("pm-governor-ramps-up", entry.tputGovernor.rampsUp, 32);
+		entry.controller->setProperty("pm-governor-ramps-down", entry.tputGovernor.rampsDown, 32);
+	} else if (entry.powerStates) {
+		entry.controller->setProperty("pm-tickles-forwarded",
+									  __atomic_load_n(&entry.ticklesForwarded, __ATOMIC_RELAXED), 32);
+		entry.controller->setProperty("pm-tickles-suppressed",
+									  __atomic_load_n(&entry.ticklesSuppressed, __ATOMIC_RELAXED), 32);
+		entry.controller->setProperty("pm-ps-queries-avoided", entry.psQueriesAvoided, 32);
+		entry.controller->setProperty("pm-transition-ns-queried", entry.psSetNsQueried, 64);
+		entry.controller->setProperty("pm-transition-ns-cached", entry.psSetNsCached, 64);
+	}
+
+	publishLatency(entry);
+}
+
+static OSDictionary* latencySummary(const Stats::LatencyHistogram& hist) {
+	auto dict = OSDictionary::withCapacity(5);
+	if (!dict)
+		return nullptr;
+
+	const struct {
+		const char* key;
+		uint32_t value;
+	} values[] {
+		{"count", hist.count()},
+		{"p50", hist.percentile(500)},
+		{"p90", hist.percentile(900)},
+		{"p99", hist.percentile(990)},
+		{"max", hist.percentile(1000)}
+	};
+
+	for (auto& v : values) {
+		auto num = OSNumber::withNumber(v.value, 32);
+		if (num) {
+			dict->setObject(v.key, num);
+			num->release();
+		}
+	}
+
+	return dict;
+}
+
+void NVMeFixPlugin::PM::setLatencySummary(OSDictionary* dict, const char* key, const Stats::LatencyHistogram& hist) {
+	if (!hist.count())
+		return;
+
+	auto summary = latencySummary(hist);
+	if (summary) {
+		dict->setObject(key, summary);
+		summary->release();
+	}
+}
+
+/**
+ * Publishes measured latencies next to the ones declared in power state descriptors, so that
+ * controllers underreporting them may be spotted.
+ */
+void NVMeFixPlugin::PM::publishLatency(ControllerEntry& entry) {
+	auto ctrl = entry.identify ? static_cast<const NVMe::nvme_id_ctrl*>(entry.identify->getBytesNoCopy()) :
+		nullptr;
+	if (!ctrl)
+		return;
+
+	unsigned nstates = min(ctrl->npss + 1u, static_cast<unsigned>(ControllerEntry::maxPowerStates));
+	auto states = OSArray::withCapacity(nstates);
+	auto features = OSDictionary::withCapacity(3);
+	if (!states || !features) {
+		OSSafeReleaseNULL(states);
+		OSSafeReleaseNULL(features);
+		return;
+	}
+
+	for (unsigned state = 0; state < nstates; state++) {
+		auto dict = OSDictionary::withCapacity(4);
+		if (!dict)
+			break;
+
+		auto entryLat = OSNumber::withNumber(ctrl->psd[state].entry_lat, 32);
+		auto exitLat = OSNumber::withNumber(ctrl->psd[state].exit_lat, 32);
+		if (entryLat)
+			dict->setObject("entry-lat", entryLat);
+		if (exitLat)
+			dict->setObject("exit-lat", exitLat);
+		OSSafeReleaseNULL(entryLat);
+		OSSafeReleaseNULL(exitLat);
+
+		setLatencySummary(dict, "set", entry.psSetLatency[state]);
+		setLatencySummary(dict, "wake", entry.psWakeLatency[state]);
+
+		states->setObject(dict);
+		dict->release();
+	}
+
+	setLatencySummary(features, "power-mgmt-get", entry.pmGetLatency);
+	setLatencySummary(features, "auto-pst-set", entry.apstSetLatency);
+	setLatencySummary(features, "auto-pst-get", entry.apstGetLatency);
+
+	entry.controller->setProperty("resume-replays", entry.resumeReplays, 32);
+	auto resume = latencySummary(entry.resumeLatency);
+	if (resume) {
+		entry.controller->setProperty("resume-latency-us", resume);
+		resume->release();
+	}
+
+	entry.controller->setProperty("ps-latency-us", states);
+	entry.controller->setProperty("feature-latency-us", features);
+	states->release();
+	features->release();
 }
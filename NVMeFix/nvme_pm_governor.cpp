@@ -0,0 +1,218 @@
+//
+// @file nvme_pm_governor.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+#include "nvme_pm_governor.hpp"
+
+namespace Governor {
+
+bool Levels::init(const NVMe::nvme_id_power_state* psd, unsigned npss) {
+	count = 0;
+	for (unsigned state = 0; state <= npss && state < maxLevels; state++) {
+		if (psd[state].flags & NVMe::NVME_PS_FLAGS_NON_OP_STATE)
+			continue;
+
+		/* Insertion sort, states are typically in order already */
+		auto power = APST::powerUw(psd[state], false);
+		auto i = count++;
+		for (; i > 0 && APST::powerUw(psd[states[i - 1]], false) < power; i--)
+			states[i] = states[i - 1];
+		states[i] = static_cast<uint8_t>(state);
+	}
+	return count > 0;
+}
+
+void IdleGovernor::defaultConfig(Config& config) {
+	for (auto& hold : config.holdUs)
+		hold = defaultHoldUs;
+	config.hysteresisUs = defaultHysteresisUs;
+	config.maxBackoff = defaultMaxBackoff;
+}
+
+bool IdleGovernor::init(const NVMe::nvme_id_power_state* psd, unsigned npss, const Config& config,
+						uint64_t nowUs) {
+	this->config = config;
+	level = 0;
+	levelSinceUs = nowUs;
+	for (auto& b : backoff)
+		b = 0;
+	return levels.init(psd, npss);
+}
+
+bool IdleGovernor::activity(uint64_t nowUs) {
+	if (level == 0) {
+		levelSinceUs = nowUs;
+		return false;
+	}
+
+	/* Previous level is the one whose hold time led here */
+	auto& b = backoff[level - 1];
+	if (nowUs - levelSinceUs < config.hysteresisUs) {
+		if (b < config.maxBackoff)
+			b++;
+	} else if (b > 0)
+		b--;
+
+	level = 0;
+	levelSinceUs = nowUs;
+	wakeups++;
+	return true;
+}
+
+bool IdleGovernor::evaluate(uint64_t nowUs) {
+	bool changed {false};
+
+	/* Timer may fire late, so catch up on every hold time elapsed since */
+	while (level + 1 < levels.count && nowUs - levelSinceUs >= holdUs(level)) {
+		levelSinceUs += holdUs(level);
+		level++;
+		stepsDown++;
+		changed = true;
+	}
+
+	return changed;
+}
+
+uint64_t IdleGovernor::deadline() const {
+	if (level + 1 >= levels.count)
+		return 0;
+	return levelSinceUs + holdUs(level);
+}
+
+void ThroughputGovernor::defaultConfig(Config& config) {
+	config.sampleUs = defaultSampleUs;
+	config.headroomPercent = defaultHeadroomPercent;
+	config.hysteresisPercent = defaultHysteresisPercent;
+	config.downHoldUs = defaultDownHoldUs;
+}
+
+void ThroughputGovernor::capacities(const NVMe::nvme_id_power_state* psd, const Levels& levels,
+									uint8_t capacity[Levels::maxLevels]) {
+	unsigned ranks[Levels::maxLevels];
+	unsigned best {~0u}, worst {0};
+
+	/* Slowest of read and write throughput and latency ranks, 0 is the best */
+	for (unsigned i = 0; i < levels.count; i++) {
+		auto& ps = psd[levels.states[i]];
+		unsigned rank = ps.read_tput;
+		rank = rank > ps.write_tput ? rank : ps.write_tput;
+		rank = rank > ps.read_lat ? rank : ps.read_lat;
+		rank = rank > ps.write_lat ? rank : ps.write_lat;
+		ranks[i] = rank & 0x1f;
+		best = ranks[i] < best ? ranks[i] : best;
+		worst = ranks[i] > worst ? ranks[i] : worst;
+	}
+
+	auto maxPower = APST::powerUw(psd[levels.states[0]], false);
+	for (unsigned i = 0; i < levels.count; i++) {
+		uint64_t percent;
+		if (best == worst)
+			percent = maxPower ? APST::powerUw(psd[levels.states[i]], false) * 100 / maxPower : 100;
+		else
+			percent = 100 * (worst + 1 - ranks[i]) / (worst + 1 - best);
+		capacity[i] = static_cast<uint8_t>(percent > 100 ? 100 : percent);
+	}
+	/* Demand is relative to the first level, so it must be able to serve everything */
+	if (levels.count)
+		capacity[0] = 100;
+}
+
+bool ThroughputGovernor::init(const NVMe::nvme_id_power_state* psd, unsigned npss, const Config& config,
+							  uint64_t nowUs) {
+	*this = {};
+	this->config = config;
+	sampleStartUs = nowUs;
+	if (!levels.init(psd, npss))
+		return false;
+	capacities(psd, levels, capacity);
+	return true;
+}
+
+unsigned ThroughputGovernor::levelFor(uint64_t percent) const {
+	/* Levels are ordered by decreasing power, so the last capable one draws the least */
+	for (unsigned i = levels.count; i-- > 1;)
+		if (capacity[i] >= percent)
+			return i;
+	return 0;
+}
+
+bool ThroughputGovernor::record(uint64_t nowUs, uint32_t n) {
+	if (dormant) {
+		dormant = false;
+		sampleStartUs = nowUs;
+		sampleCount = n;
+		return true;
+	}
+
+	sampleCount += n;
+	if (level == 0 || !peakIops)
+		return false;
+
+	/* Requests the current level may take within a sample, with the headroom */
+	auto limit = peakIops * capacity[level] * config.sampleUs / (100 + config.headroomPercent) /
+		1000000ull;
+	if (sampleCount <= limit)
+		return false;
+
+	level = 0;
+	downSinceUs = 0;
+	rampsUp++;
+	return true;
+}
+
+bool ThroughputGovernor::evaluate(uint64_t nowUs) {
+	if (dormant || nowUs < deadline())
+		return false;
+
+	auto elapsed = nowUs - sampleStartUs;
+	rateIops = sampleCount * 1000000ull / elapsed;
+	sampleStartUs = nowUs;
+	sampleCount = 0;
+
+	/* Peak slowly decays, so that demand is measured against recent load, half-life is about 700 samples */
+	peakIops -= peakIops >> 10;
+	if (rateIops > peakIops)
+		peakIops = rateIops;
+
+	auto demand = peakIops ? rateIops * 100 / peakIops : 0;
+	auto need = demand * (100 + config.headroomPercent) / 100;
+
+	if (level > 0 && capacity[level] < need) {
+		level = levelFor(need);
+		downSinceUs = 0;
+		rampsUp++;
+		return true;
+	}
+
+	auto down = levelFor(need + demand * config.hysteresisPercent / 100);
+	if (down <= level) {
+		downSinceUs = 0;
+		/* Nothing left to do until the next request */
+		dormant = !rateIops;
+		return false;
+	}
+
+	if (!downSinceUs) {
+		downSinceUs = nowUs;
+		return false;
+	}
+
+	if (nowUs - downSinceUs < config.downHoldUs)
+		return false;
+
+	level = down;
+	downSinceUs = 0;
+	rampsDown++;
+	return true;
+}
+}
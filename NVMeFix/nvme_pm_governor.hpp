@@ -0,0 +1,191 @@
+//
+// @file nvme_pm_governor.hpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+
+#ifndef nvme_pm_governor_hpp
+#define nvme_pm_governor_hpp
+
+#include <stdint.h>
+
+#include "nvme.h"
+#include "nvme_apst_plan.hpp"
+
+/**
+ * Operational power state selection for active power management.
+ * Like the APST planner, this is independent of IOKit: time is passed in by the caller, so the
+ * state machine may be driven by a fake clock on the host.
+ */
+namespace Governor {
+
+/* Operational states the governor may use, shallowest first */
+struct Levels {
+	static constexpr unsigned maxLevels {32};
+	uint8_t states[maxLevels] {};
+	unsigned count {0};
+
+	/**
+	 * Fills operational states of the controller by decreasing maximum power, in PS number order
+	 * for equal power. Returns false if there are none.
+	 */
+	bool init(const NVMe::nvme_id_power_state* psd, unsigned npss);
+};
+
+/**
+ * Steps down one operational state after the controller has been idle in the current state for
+ * its hold time, and returns to the shallowest state on any activity.
+ * A wake-up shortly after stepping down means the step was premature, so the hold time of the
+ * previous state is doubled, up to `maxBackoff` times. Longer residencies decay it back.
+ */
+class IdleGovernor {
+public:
+	struct Config {
+		/* Idle time in level i before stepping to level i + 1 */
+		uint64_t holdUs[Levels::maxLevels];
+		uint64_t hysteresisUs;
+		unsigned maxBackoff;
+	};
+
+	static constexpr uint64_t defaultHoldUs {100 * 1000};
+	static constexpr uint64_t defaultHysteresisUs {20 * 1000};
+	static constexpr unsigned defaultMaxBackoff {4};
+
+	static void defaultConfig(Config& config);
+
+	bool init(const NVMe::nvme_id_power_state* psd, unsigned npss, const Config& config, uint64_t nowUs);
+
+	/* Record an I/O request. Returns true if the target state changed and must be applied now. */
+	bool activity(uint64_t nowUs);
+
+	/* Step down if the hold time elapsed. Returns true if the target state changed. */
+	bool evaluate(uint64_t nowUs);
+
+	/* Time of the next step down, 0 if already in the deepest state */
+	uint64_t deadline() const;
+
+	/* Power state to program via NVME_FEAT_POWER_MGMT */
+	unsigned targetState() const {
+		return levels.states[level];
+	}
+
+	unsigned currentLevel() const {
+		return level;
+	}
+
+	bool ready() const {
+		return levels.count > 0;
+	}
+
+	uint32_t stepsDown {0};
+	uint32_t wakeups {0};
+
+private:
+	uint64_t holdUs(unsigned lvl) const {
+		return config.holdUs[lvl] << backoff[lvl];
+	}
+
+	Levels levels;
+	Config config {};
+	unsigned level {0};
+	uint64_t levelSinceUs {0};
+	uint8_t backoff[Levels::maxLevels] {};
+};
+
+/**
+ * Picks the lowest-power operational state able to serve the measured I/O rate.
+ * Relative performance of the states is estimated from throughput and latency ranks of their
+ * power state descriptors. Demand is the request rate relative to the highest rate seen recently.
+ * The governor ramps up as soon as demand exceeds the current state, also within a sample on
+ * bursts, and only ramps down after demand has stayed below a lower state for the hold time.
+ */
+class ThroughputGovernor {
+public:
+	struct Config {
+		uint64_t sampleUs;
+		/* Spare capacity required above demand */
+		unsigned headroomPercent;
+		/* Extra spare capacity required to ramp down */
+		unsigned hysteresisPercent;
+		uint64_t downHoldUs;
+	};
+
+	static constexpr uint64_t defaultSampleUs {10 * 1000};
+	static constexpr unsigned defaultHeadroomPercent {20};
+	static constexpr unsigned defaultHysteresisPercent {10};
+	static constexpr uint64_t defaultDownHoldUs {500 * 1000};
+
+	static void defaultConfig(Config& config);
+
+	/**
+	 * Relative performance of each level in percent of the first one, interpolated linearly between
+	 * the best and one past the worst rank. If all the ranks are equal, they are uninformative, and
+	 * performance is assumed to scale with maximum power.
+	 */
+	static void capacities(const NVMe::nvme_id_power_state* psd, const Levels& levels,
+						   uint8_t capacity[Levels::maxLevels]);
+
+	bool init(const NVMe::nvme_id_power_state* psd, unsigned npss, const Config& config, uint64_t nowUs);
+
+	/**
+	 * Record `n` I/O requests. Returns true if a burst requires ramping up right away, or sampling
+	 * restarts after idle, so that `deadline` has to be rescheduled.
+	 */
+	bool record(uint64_t nowUs, uint32_t n = 1);
+
+	/* Close the sample if it elapsed. Returns true if the level changed. */
+	bool evaluate(uint64_t nowUs);
+
+	/* End of the current sample, 0 if sampling is stopped while idle */
+	uint64_t deadline() const {
+		return dormant ? 0 : sampleStartUs + config.sampleUs;
+	}
+
+	unsigned currentLevel() const {
+		return level;
+	}
+
+	unsigned targetState() const {
+		return levels.states[level];
+	}
+
+	/* Requests per second over the last sample, and the recent peak */
+	uint64_t rate() const {
+		return rateIops;
+	}
+
+	uint64_t peak() const {
+		return peakIops;
+	}
+
+	uint32_t rampsUp {0};
+	uint32_t rampsDown {0};
+
+private:
+	/* Deepest level with at least `percent` capacity */
+	unsigned levelFor(uint64_t percent) const;
+
+	Levels levels;
+	uint8_t capacity[Levels::maxLevels] {};
+	Config config {};
+	unsigned level {0};
+	uint64_t sampleStartUs {0};
+	uint32_t sampleCount {0};
+	uint64_t rateIops {0};
+	uint64_t peakIops {0};
+	/* Since when a deeper level would do, 0 if it would not */
+	uint64_t downSinceUs {0};
+	bool dormant {false};
+};
+}
+
+#endif /* nvme_pm_governor_hpp */
@@ -0,0 +1,92 @@
+//
+// @file nvme_thermal.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+#include "Log.hpp"
+#include "NVMeFixPlugin.hpp"
+
+/**
+ * Host Controlled Thermal Management lets the controller throttle lightly above TMT1 and heavily
+ * above TMT2. By default TMT2 is placed a few degrees below the warning composite temperature, where
+ * firmware would otherwise start its own abrupt throttling, and TMT1 a few degrees below TMT2.
+ */
+bool NVMeFixPlugin::configureHCTM(ControllerEntry& entry, const NVMe::nvme_id_ctrl* ctrl) {
+	if (!(ctrl->hctma & 1)) {
+		DBGLOG(Log::Thermal, "HCTM unsupported by this controller");
+		return false;
+	}
+
+	uint16_t mntmt = ctrl->mntmt, mxtmt = ctrl->mxtmt;
+	if (!mntmt || !mxtmt || mntmt >= mxtmt) {
+		SYSLOG(Log::Thermal, "Invalid HCTM limits %u-%u K", mntmt, mxtmt);
+		return false;
+	}
+
+	uint32_t limit = ctrl->wctemp ? ctrl->wctemp : ctrl->cctemp ? ctrl->cctemp : mxtmt;
+	uint32_t tmt2 = limit > tmt2MarginK ? limit - tmt2MarginK : 0;
+	uint32_t tmt1 = tmt2 > tmt1MarginK ? tmt2 - tmt1MarginK : 0;
+
+	propertyFromParent(entry.controller, "hctm-tmt1", tmt1);
+	propertyFromParent(entry.controller, "hctm-tmt2", tmt2);
+
+	tmt2 = min(max(tmt2, mntmt + 1u), static_cast<uint32_t>(mxtmt));
+	tmt1 = min(max(tmt1, static_cast<uint32_t>(mntmt)), tmt2 - 1);
+
+	entry.hctmTmt1 = static_cast<uint16_t>(tmt1);
+	entry.hctmTmt2 = static_cast<uint16_t>(tmt2);
+
+	/* Nothing waits for the thresholds, so they are set on the workloop if possible */
+	Admin::Command command {};
+	command.cmd.opcode = NVMe::nvme_admin_set_features;
+	command.cmd.cdw10 = NVMe::NVME_FEAT_HCTM;
+	command.cmd.cdw11 = (tmt1 << 16) | tmt2;
+	command.callback = hctmConfigured;
+	command.priority = Admin::Priority::Background;
+	if (submitAdmin(entry, command) != kIOReturnSuccess)
+		executeAdmin(entry, command);
+
+	return entry.hctmTmt2 != 0;
+}
+
+/* Called with entry lock held */
+void NVMeFixPlugin::hctmConfigured(void* owner, void*, int status, uint32_t) {
+	auto& entry = *static_cast<ControllerEntry*>(owner);
+	if (status == kIOReturnAborted)
+		return;
+
+	if (status != kIOReturnSuccess) {
+		SYSLOG(Log::Thermal, "Failed to set HCTM thresholds with 0x%x", status);
+		entry.hctmTmt1 = entry.hctmTmt2 = 0;
+		return;
+	}
+
+	DBGLOG(Log::Thermal, "HCTM thresholds %u K and %u K", entry.hctmTmt1, entry.hctmTmt2);
+	entry.controller->setProperty("hctm-tmt1", entry.hctmTmt1, 16);
+	entry.controller->setProperty("hctm-tmt2", entry.hctmTmt2, 16);
+}
+
+/* Thermal management transition counts and times from a SMART log sample, called with entry lock held */
+void NVMeFixPlugin::updateThermal(ControllerEntry& entry, const NVMe::nvme_smart_log& log) {
+	if (!entry.hctmTmt2)
+		return;
+
+	entry.thmTransitions[0] = log.thm_temp1_trans_count;
+	entry.thmTransitions[1] = log.thm_temp2_trans_count;
+	entry.thmTimeS[0] = log.thm_temp1_total_time;
+	entry.thmTimeS[1] = log.thm_temp2_total_time;
+
+	entry.controller->setProperty("hctm-tmt1-transitions", entry.thmTransitions[0], 32);
+	entry.controller->setProperty("hctm-tmt2-transitions", entry.thmTransitions[1], 32);
+	entry.controller->setProperty("hctm-tmt1-time", entry.thmTimeS[0], 32);
+	entry.controller->setProperty("hctm-tmt2-time", entry.thmTimeS[1], 32);
+}
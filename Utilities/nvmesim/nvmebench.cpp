@@ -0,0 +1,334 @@
+//
+// @file nvmebench.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+/**
+ * Multi-threaded microbenchmarks of the hot paths NVMeFix runs for every I/O request, against the
+ * lock-based code they replaced, and of the statistics kept for every admin command. Every
+ * benchmark runs a number of threads for a fixed time and reports the throughput of all of them
+ * together.
+ *
+ * Build:
+ *   c++ -std=c++14 -O2 -pthread -include host.h -I../../NVMeFix nvmebench.cpp -o nvmebench
+ */
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "nvme.h"
+#include "nvme_entry_table.hpp"
+#include "nvme_histogram.hpp"
+
+namespace {
+
+struct Options {
+	unsigned threads {std::max(2u, std::thread::hardware_concurrency())};
+	unsigned durationMs {1000};
+	const char* only {nullptr};
+};
+
+using Clock = std::chrono::steady_clock;
+
+/**
+ * Runs `work(thread, stop)` on `threads` threads for the configured time, each returning the number
+ * of operations done, and prints the total rate. Background threads return 0.
+ * Returns the total number of operations.
+ */
+template <typename W>
+uint64_t run(const Options& opts, const char* name, unsigned threads, W work) {
+	std::atomic<bool> stop {false};
+	std::vector<uint64_t> ops(threads);
+	std::vector<std::thread> pool;
+
+	auto start = Clock::now();
+	for (unsigned t = 0; t < threads; t++)
+		pool.emplace_back([&, t]() { ops[t] = work(t, stop); });
+	std::this_thread::sleep_for(std::chrono::milliseconds(opts.durationMs));
+	stop.store(true, std::memory_order_relaxed);
+	for (auto& thread : pool)
+		thread.join();
+	auto seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+	uint64_t total {0};
+	for (auto n : ops)
+		total += n;
+	printf("%-32s %3u threads %12.2f Mops/s\n", name, threads, total / seconds / 1e6);
+	return total;
+}
+
+/* Stand-in for ControllerEntry, which knows its own key */
+struct Entry {
+	const void* controller;
+	uint64_t tickles;
+};
+
+/* Controllers looked up per I/O, and controllers attached and terminated meanwhile */
+constexpr size_t nlive {4};
+constexpr size_t nchurn {4};
+
+/* Keys spaced like kernel objects, so that they hash apart */
+const void* controllerKey(size_t i) {
+	return reinterpret_cast<const void*>(static_cast<uintptr_t>(0x10000 + i * 0x1240));
+}
+
+/**
+ * activityTickle lookup. The lock-free table is read by all but one thread, which keeps
+ * publishing and retiring other controllers, like hotplug would. Before, the lookup took the
+ * global lock and searched the controller array.
+ */
+void benchEntryTable(const Options& opts) {
+	static EntryTable<Entry, 32> table;
+	static Entry live[nlive], churn[nchurn];
+	for (size_t i = 0; i < nlive; i++) {
+		live[i] = {controllerKey(i), 0};
+		table.publish(live[i].controller, &live[i]);
+	}
+	for (size_t i = 0; i < nchurn; i++)
+		churn[i] = {controllerKey(nlive + i), 0};
+
+	std::atomic<uint64_t> mismatches {0};
+	auto readers = opts.threads > 1 ? opts.threads - 1 : 1;
+
+	run(opts, "entry-table lock-free", readers + 1, [&](unsigned t, std::atomic<bool>& stop) {
+		uint64_t n {0};
+		if (t == readers) {
+			/* Writer, serialised by being the only one, and not counted */
+			for (size_t i = 0; !stop.load(std::memory_order_relaxed); i++) {
+				auto& e = churn[i % nchurn];
+				if (!table.publish(e.controller, &e))
+					mismatches++;
+				table.retire(e.controller, []() { std::this_thread::yield(); });
+			}
+			return n;
+		}
+
+		for (size_t i = t; !stop.load(std::memory_order_relaxed); i++, n++) {
+			size_t slot;
+			auto key = controllerKey(i % (nlive + nchurn));
+			auto e = table.acquire(key, slot);
+			if (e) {
+				if (e->controller != key)
+					mismatches++;
+				__atomic_fetch_add(&e->tickles, 1, __ATOMIC_RELAXED);
+				table.release(slot);
+			} else if (i % (nlive + nchurn) < nlive)
+				mismatches++;
+		}
+		return n;
+	});
+
+	if (mismatches)
+		printf("  %" PRIu64 " wrong lookups\n", mismatches.load());
+
+	std::mutex lck;
+	std::vector<Entry*> controllers;
+	for (auto& e : live)
+		controllers.push_back(&e);
+
+	run(opts, "entry-table global lock", readers + 1, [&](unsigned t, std::atomic<bool>& stop) {
+		uint64_t n {0};
+		if (t == readers) {
+			for (size_t i = 0; !stop.load(std::memory_order_relaxed); i++) {
+				auto& e = churn[i % nchurn];
+				{
+					std::lock_guard<std::mutex> guard(lck);
+					controllers.push_back(&e);
+				}
+				std::lock_guard<std::mutex> guard(lck);
+				controllers.pop_back();
+			}
+			return n;
+		}
+
+		for (size_t i = t; !stop.load(std::memory_order_relaxed); i++, n++) {
+			auto key = controllerKey(i % (nlive + nchurn));
+			std::lock_guard<std::mutex> guard(lck);
+			for (auto e : controllers)
+				if (e->controller == key) {
+					__atomic_fetch_add(&e->tickles, 1, __ATOMIC_RELAXED);
+					break;
+				}
+		}
+		return n;
+	});
+
+	/* Every slot of a retired controller must be usable again */
+	for (size_t i = 0; i < 1000; i++) {
+		Entry e {controllerKey(100 + i), 0};
+		if (!table.publish(e.controller, &e)) {
+			printf("  table filled up after %zu controllers\n", i);
+			break;
+		}
+		table.retire(e.controller, []() {});
+	}
+}
+
+/* Latencies from a few to tens of thousands of microseconds, most of them short */
+uint32_t latencyUs(uint32_t& seed) {
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return (seed & 0xffff) >> ((seed >> 16) & 15);
+}
+
+/**
+ * LatencyHistogram recording, which wake tracking does from the interrupt filter of every
+ * controller while the periodic timer reads percentiles. Compared against the same histogram
+ * under a global lock.
+ */
+void benchHistogram(const Options& opts) {
+	static Stats::LatencyHistogram hist;
+
+	auto total = run(opts, "histogram atomic", opts.threads, [&](unsigned t, std::atomic<bool>& stop) {
+		uint64_t n {0};
+		uint32_t seed {0x9e3779b9u * (t + 1)};
+		for (; !stop.load(std::memory_order_relaxed); n++)
+			hist.record(latencyUs(seed));
+		return n;
+	});
+
+	if (hist.count() != static_cast<uint32_t>(total))
+		printf("  %u of %" PRIu64 " samples lost\n", hist.count(), total);
+	if (hist.percentile(500) > hist.percentile(990) || hist.percentile(1000) != hist.maxUs)
+		printf("  percentiles out of order\n");
+
+	static Stats::LatencyHistogram locked;
+	std::mutex lck;
+
+	run(opts, "histogram global lock", opts.threads, [&](unsigned t, std::atomic<bool>& stop) {
+		uint64_t n {0};
+		uint32_t seed {0x9e3779b9u * (t + 1)};
+		for (; !stop.load(std::memory_order_relaxed); n++) {
+			auto us = latencyUs(seed);
+			std::lock_guard<std::mutex> guard(lck);
+			locked.counts[Stats::LatencyHistogram::bucketFor(us)]++;
+			locked.samples++;
+			if (us > locked.maxUs)
+				locked.maxUs = us;
+		}
+		return n;
+	});
+}
+
+/**
+ * CommandLatency and StatusCounts, updated after every admin command with the entry lock held,
+ * so on one thread. Keys are a mix like restoring features after reset, which fills 12 of the 16
+ * slots, and a few more than the 8 status slots, so that failures also overflow.
+ */
+void benchCommandStats(const Options& opts) {
+	static Stats::CommandLatency<16> commands;
+	static Stats::StatusCounts<8> errors;
+
+	static const struct {
+		uint8_t opcode;
+		uint8_t sub;
+	} keys[] {
+		{NVMe::nvme_admin_identify, NVMe::NVME_ID_CNS_CTRL},
+		{NVMe::nvme_admin_get_log_page, NVMe::NVME_LOG_SMART},
+		{NVMe::nvme_admin_set_features, NVMe::NVME_FEAT_ARBITRATION},
+		{NVMe::nvme_admin_set_features, NVMe::NVME_FEAT_POWER_MGMT},
+		{NVMe::nvme_admin_get_features, NVMe::NVME_FEAT_POWER_MGMT},
+		{NVMe::nvme_admin_set_features, NVMe::NVME_FEAT_TEMP_THRESH},
+		{NVMe::nvme_admin_set_features, NVMe::NVME_FEAT_IRQ_COALESCE},
+		{NVMe::nvme_admin_set_features, NVMe::NVME_FEAT_AUTO_PST},
+		{NVMe::nvme_admin_get_features, NVMe::NVME_FEAT_AUTO_PST},
+		{NVMe::nvme_admin_set_features, NVMe::NVME_FEAT_HOST_MEM_BUF},
+		{NVMe::nvme_admin_get_features, NVMe::NVME_FEAT_HOST_MEM_BUF},
+		{NVMe::nvme_admin_set_features, NVMe::NVME_FEAT_HCTM},
+	};
+	constexpr size_t nkeys {sizeof(keys) / sizeof(keys[0])};
+
+	run(opts, "command-latency", 1, [&](unsigned, std::atomic<bool>& stop) {
+		uint64_t n {0};
+		uint32_t seed {0x9e3779b9u};
+		for (size_t i = 0; !stop.load(std::memory_order_relaxed); i++, n++) {
+			auto& key = keys[i % nkeys];
+			commands.record(key.opcode, key.sub, latencyUs(seed));
+		}
+		return n;
+	});
+
+	if (commands.overflow)
+		printf("  %u samples without a slot\n", commands.overflow);
+	for (size_t i = 0; i < nkeys; i++)
+		if (!commands.slots[i].used || commands.slots[i].opcode != keys[i].opcode ||
+			commands.slots[i].sub != keys[i].sub)
+			printf("  slot %zu taken by the wrong command\n", i);
+
+	run(opts, "status-counts", 1, [&](unsigned, std::atomic<bool>& stop) {
+		uint64_t n {0};
+		for (uint32_t i = 0; !stop.load(std::memory_order_relaxed); i++, n++)
+			errors.record(0x4000u | (i % 10));
+		return n;
+	});
+
+	if (!errors.other)
+		printf("  statuses without a slot were not counted\n");
+}
+
+void usage(const char* argv0) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"Options:\n"
+		"  -t <threads>     threads per benchmark (all CPUs)\n"
+		"  -d <ms>          duration of every benchmark (1000)\n"
+		"  -b <name>        only run the named benchmark: entry-table, histogram,\n"
+		"                   command-stats\n",
+		argv0);
+}
+
+}
+
+int main(int argc, char** argv) {
+	Options opts;
+
+	for (int i = 1; i < argc; i++) {
+		auto arg = argv[i];
+		auto value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (!strcmp(arg, "-t") && value) {
+			opts.threads = std::max(1u, static_cast<unsigned>(strtoul(value, nullptr, 0)));
+			i++;
+		} else if (!strcmp(arg, "-d") && value) {
+			opts.durationMs = static_cast<unsigned>(strtoul(value, nullptr, 0));
+			i++;
+		} else if (!strcmp(arg, "-b") && value) {
+			opts.only = value;
+			i++;
+		} else {
+			return usage(argv[0]), 1;
+		}
+	}
+
+	static const struct {
+		const char* name;
+		void (*run)(const Options&);
+	} benchmarks[] {
+		{"entry-table", benchEntryTable},
+		{"histogram", benchHistogram},
+		{"command-stats", benchCommandStats},
+	};
+
+	for (auto& bench : benchmarks)
+		if (!opts.only || !strcmp(opts.only, bench.name))
+			bench.run(opts);
+
+	return 0;
+}
@@ -0,0 +1,496 @@
+//
+// @file nvmesim.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+/**
+ * Trace-driven simulator of NVMeFix power management.
+ * Replays an I/O arrival trace through a model of autonomous power state transitions, using the
+ * same planner sources the kext is built from, and reports energy, time in state and latency
+ * added by power state exits.
+ * With -b, replays traces of several controllers against a shared power budget instead, and reports
+ * how often each of them was allowed each operational state.
+ *
+ * Build:
+ *   c++ -std=c++14 -O2 -include host.h -I../../NVMeFix nvmesim.cpp \
+ *     ../../NVMeFix/nvme_apst_plan.cpp ../../NVMeFix/nvme_apst_tune.cpp \
+ *     ../../NVMeFix/nvme_pm_governor.cpp ../../NVMeFix/nvme_budget_plan.cpp -o nvmesim
+ */
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "nvme_apst_plan.hpp"
+#include "nvme_apst_tune.hpp"
+#include "nvme_budget_plan.hpp"
+#include "nvme_pm_governor.hpp"
+
+namespace {
+
+struct Options {
+	APST::Policy policy {APST::Policy::CostModel};
+	const APST::Profile* profile {&APST::defaultProfile()};
+	uint64_t maxLatencyUs {100000};
+	bool noDeepest {false};
+	/* Feed the tuner with arrivals and retune like the kext periodic timer does */
+	bool adaptive {false};
+	/* Active power management by the idle governor instead of APST */
+	bool governor {false};
+	uint64_t retuneIntervalUs {30ull * 1000 * 1000};
+	uint64_t serviceUs {100};
+	/* Power budget shared by all controllers, 0 for a single controller APST or governor run */
+	uint64_t budgetUw {0};
+	uint64_t budgetIntervalUs {1000 * 1000};
+	const char* psdPath {nullptr};
+	const char* tracePath {nullptr};
+};
+
+struct Request {
+	uint64_t arrivalUs;
+	uint64_t serviceUs;
+};
+
+void usage(const char* argv0) {
+	fprintf(stderr,
+		"Usage: %s [options] <psd> <trace>\n"
+		"       %s -b <W> [options] <psd> <trace> [<psd> <trace>...]\n"
+		"  <psd>    4096-byte Identify Controller dump, or text with a line per power state:\n"
+		"           <max power W> <entry lat us> <exit lat us> <op|nop> [idle power W]\n"
+		"  <trace>  line per I/O request: <arrival us> [service us]\n"
+		"Options:\n"
+		"  -p greedy|cost   APST policy (cost)\n"
+		"  -P <profile>     APST profile: performance, balanced, battery (balanced)\n"
+		"  -l <us>          ps-max-latency-us (100000)\n"
+		"  -n               NVME_QUIRK_NO_DEEPEST_PS\n"
+		"  -a               retune the table from observed idle intervals\n"
+		"  -g               use idle governor over operational states instead of APST\n"
+		"  -s <us>          default service time (100)\n"
+		"  -b <W>           split power budget between controllers by their I/O rate\n",
+		argv0, argv0);
+}
+
+bool loadPsd(const char* path, NVMe::nvme_id_ctrl& ctrl) {
+	memset(&ctrl, 0, sizeof(ctrl));
+
+	std::ifstream file(path, std::ios::binary);
+	if (!file)
+		return false;
+	std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	if (data.size() == sizeof(ctrl)) {
+		memcpy(&ctrl, data.data(), sizeof(ctrl));
+		return true;
+	}
+
+	std::istringstream text(data);
+	std::string line;
+	int state {0};
+	while (std::getline(text, line)) {
+		auto hash = line.find('#');
+		if (hash != std::string::npos)
+			line.resize(hash);
+
+		std::istringstream fields(line);
+		double maxW, idleW {0};
+		uint32_t entryUs, exitUs;
+		std::string kind;
+		if (!(fields >> maxW >> entryUs >> exitUs >> kind))
+			continue;
+		fields >> idleW;
+
+		if (state == 32) {
+			fprintf(stderr, "Too many power states\n");
+			return false;
+		}
+
+		auto& ps = ctrl.psd[state];
+		/* Prefer 0.0001 W units to keep precision of low-power states */
+		if (maxW * 10000 < 65535) {
+			ps.max_power = static_cast<uint16_t>(maxW * 10000 + 0.5);
+			ps.flags = NVMe::NVME_PS_FLAGS_MAX_POWER_SCALE;
+		} else
+			ps.max_power = static_cast<uint16_t>(std::min(maxW * 100 + 0.5, 65535.0));
+		if (kind == "nop")
+			ps.flags |= NVMe::NVME_PS_FLAGS_NON_OP_STATE;
+		ps.entry_lat = entryUs;
+		ps.exit_lat = exitUs;
+		if (idleW > 0 && idleW * 10000 < 65535) {
+			ps.idle_power = static_cast<uint16_t>(idleW * 10000 + 0.5);
+			ps.idle_scale = 1 << 6;
+		} else if (idleW > 0) {
+			ps.idle_power = static_cast<uint16_t>(std::min(idleW * 100 + 0.5, 65535.0));
+			ps.idle_scale = 2 << 6;
+		}
+		state++;
+	}
+
+	if (!state)
+		return false;
+
+	ctrl.npss = state - 1;
+	ctrl.apsta = 1;
+	return true;
+}
+
+bool loadTrace(const char* path, uint64_t defaultServiceUs, std::vector<Request>& trace) {
+	std::ifstream file(path);
+	if (!file)
+		return false;
+
+	std::string line;
+	while (std::getline(file, line)) {
+		std::istringstream fields(line);
+		Request req {0, defaultServiceUs};
+		if (!(fields >> req.arrivalUs))
+			continue;
+		fields >> req.serviceUs;
+		trace.push_back(req);
+	}
+
+	std::stable_sort(trace.begin(), trace.end(), [](const Request& a, const Request& b) {
+		return a.arrivalUs < b.arrivalUs;
+	});
+	return !trace.empty();
+}
+
+struct Stats {
+	/* Idle time and energy per state, busy time and energy in PS0 */
+	uint64_t idleUs[32] {};
+	double idleJ[32] {};
+	uint64_t busyUs {0};
+	double busyJ {0};
+	double transitionJ {0};
+	uint64_t transitions {0};
+	uint64_t retunes {0};
+	std::vector<uint64_t> addedUs;
+};
+
+double joules(uint64_t uw, uint64_t us) {
+	return static_cast<double>(uw) * static_cast<double>(us) * 1e-12;
+}
+
+class Simulator {
+public:
+	Simulator(const Options& opts, const NVMe::nvme_id_ctrl& ctrl) : opts(opts), ctrl(ctrl) {
+		input.psd = ctrl.psd;
+		input.npss = ctrl.npss;
+		input.maxLatencyUs = opts.maxLatencyUs;
+		input.noDeepest = opts.noDeepest;
+		APST::applyProfile(*opts.profile, input);
+		if (opts.governor) {
+			Governor::IdleGovernor::Config config;
+			Governor::IdleGovernor::defaultConfig(config);
+			governor.init(ctrl.psd, ctrl.npss, config, 0);
+		} else
+			APST::plan(opts.policy, input, tuner.distribution(), plan);
+	}
+
+	void run(const std::vector<Request>& trace) {
+		uint64_t busyUntil {trace.front().arrivalUs};
+		uint64_t nextRetune {trace.front().arrivalUs + opts.retuneIntervalUs};
+
+		for (auto& req : trace) {
+			uint64_t added {0};
+
+			if (req.arrivalUs > busyUntil)
+				added = idle(busyUntil, req.arrivalUs);
+
+			if (opts.governor)
+				governor.activity(req.arrivalUs);
+
+			if (opts.adaptive && !opts.governor) {
+				tuner.tickle(req.arrivalUs);
+				while (req.arrivalUs >= nextRetune) {
+					APST::Plan fitted;
+					if (tuner.retune(input, plan, nextRetune, fitted)) {
+						plan = fitted;
+						stats.retunes++;
+					}
+					nextRetune += opts.retuneIntervalUs;
+				}
+			}
+
+			auto start = std::max(busyUntil, req.arrivalUs + added);
+			stats.addedUs.push_back(added);
+			stats.busyUs += req.serviceUs;
+			stats.busyJ += joules(APST::powerUw(ctrl.psd[0], false), req.serviceUs);
+			busyUntil = start + req.serviceUs;
+		}
+	}
+
+	void report(const std::vector<Request>& trace) {
+		printf("APST table:\n");
+		for (int state = ctrl.npss; state >= 0; state--) {
+			auto e = plan.table.entries[state];
+			if (e)
+				printf("  PS%-2d -> PS%-2u after %" PRIu64 " ms\n", state,
+					   static_cast<unsigned>((e >> 3) & 0x1f), (e >> 8) & 0xffffff);
+		}
+
+		uint64_t totalUs {stats.busyUs};
+		double totalJ {stats.busyJ + stats.transitionJ};
+		for (unsigned i = 0; i <= ctrl.npss; i++) {
+			totalUs += stats.idleUs[i];
+			totalJ += stats.idleJ[i];
+		}
+
+		printf("\n%-12s %14s %8s %14s\n", "State", "Time (s)", "Time %", "Energy (J)");
+		printf("%-12s %14.3f %7.2f%% %14.6f\n", "PS0 busy", stats.busyUs * 1e-6,
+			   totalUs ? 100.0 * stats.busyUs / totalUs : 0.0, stats.busyJ);
+		for (unsigned i = 0; i <= ctrl.npss; i++) {
+			char name[16];
+			snprintf(name, sizeof(name), "PS%u idle", i);
+			printf("%-12s %14.3f %7.2f%% %14.6f\n", name, stats.idleUs[i] * 1e-6,
+				   totalUs ? 100.0 * stats.idleUs[i] / totalUs : 0.0, stats.idleJ[i]);
+		}
+		printf("%-12s %14s %8s %14.6f\n", "transitions", "", "", stats.transitionJ);
+
+		printf("\nRequests: %zu, transitions: %" PRIu64 ", retunes: %" PRIu64 "\n", trace.size(),
+			   stats.transitions, stats.retunes);
+		printf("Total energy: %.6f J, average power: %.4f W\n", totalJ,
+			   totalUs ? totalJ / (totalUs * 1e-6) : 0.0);
+
+		auto& added = stats.addedUs;
+		std::sort(added.begin(), added.end());
+		auto pct = [&](double p) {
+			auto idx = static_cast<size_t>(p / 100.0 * (added.size() - 1) + 0.5);
+			return added[std::min(idx, added.size() - 1)];
+		};
+		printf("Added latency (us): p50 %" PRIu64 ", p90 %" PRIu64 ", p99 %" PRIu64
+			   ", p99.9 %" PRIu64 ", max %" PRIu64 "\n",
+			   pct(50), pct(90), pct(99), pct(99.9), added.back());
+	}
+
+private:
+	/**
+	 * Walk the APST table from PS0 over idle interval [startUs, endUs) and return the latency
+	 * added to the request arriving at endUs.
+	 */
+	uint64_t idle(uint64_t startUs, uint64_t endUs) {
+		if (opts.governor)
+			return idleGoverned(startUs, endUs);
+
+		unsigned state {0};
+		uint64_t nowUs {startUs};
+		uint64_t entryDoneUs {startUs};
+		auto transitionUw = APST::powerUw(ctrl.psd[0], false);
+
+		for (unsigned hops = 0; hops <= ctrl.npss; hops++) {
+			auto e = plan.table.entries[state];
+			auto target = static_cast<unsigned>((e >> 3) & 0x1f);
+			auto itptUs = ((e >> 8) & 0xffffff) * 1000;
+			if (!e || target > ctrl.npss || nowUs + itptUs >= endUs)
+				break;
+
+			account(state, itptUs);
+			nowUs += itptUs;
+			entryDoneUs = nowUs + ctrl.psd[target].entry_lat;
+			stats.transitionJ += joules(transitionUw, ctrl.psd[target].entry_lat);
+			stats.transitions++;
+			state = target;
+		}
+
+		account(state, endUs - nowUs);
+		if (state == 0)
+			return 0;
+
+		stats.transitionJ += joules(transitionUw, ctrl.psd[state].exit_lat);
+		/* A request arriving while the controller is still entering the state waits for both */
+		auto pendingEntry = entryDoneUs > endUs ? entryDoneUs - endUs : 0;
+		return pendingEntry + ctrl.psd[state].exit_lat;
+	}
+
+	/* Same for the governor, which only uses operational states and steps on its own deadlines */
+	uint64_t idleGoverned(uint64_t startUs, uint64_t endUs) {
+		governor.evaluate(startUs);
+
+		auto state = governor.targetState();
+		uint64_t nowUs {startUs};
+		for (auto deadline = governor.deadline(); deadline && deadline < endUs;
+			 deadline = governor.deadline()) {
+			account(state, deadline - nowUs);
+			governor.evaluate(deadline);
+			nowUs = deadline;
+			state = governor.targetState();
+			stats.transitions++;
+		}
+
+		account(state, endUs - nowUs);
+		return ctrl.psd[state].exit_lat;
+	}
+
+	void account(unsigned state, uint64_t us) {
+		stats.idleUs[state] += us;
+		stats.idleJ[state] += joules(APST::powerUw(ctrl.psd[state], true), us);
+	}
+
+	const Options& opts;
+	const NVMe::nvme_id_ctrl& ctrl;
+	APST::Input input;
+	APST::Plan plan;
+	APST::Tuner tuner;
+	Governor::IdleGovernor governor;
+	Stats stats;
+};
+}
+
+/**
+ * Allocates the budget once per interval from requests seen in the previous one, like the kext
+ * budget timer does, and accounts which state each controller was allowed.
+ */
+int runBudget(const Options& opts, const std::vector<const char*>& paths) {
+	struct Drive {
+		NVMe::nvme_id_ctrl ctrl;
+		Governor::Levels levels;
+		std::vector<Request> trace;
+		size_t next {0};
+		uint64_t requests {0};
+		uint64_t intervals[Governor::Levels::maxLevels] {};
+		uint64_t served[Governor::Levels::maxLevels] {};
+	};
+
+	std::vector<Drive> drives(paths.size() / 2);
+	uint64_t endUs {0};
+	for (size_t i = 0; i < drives.size(); i++) {
+		auto& drive = drives[i];
+		if (!loadPsd(paths[2 * i], drive.ctrl) || drive.ctrl.npss > 31 ||
+			!drive.levels.init(drive.ctrl.psd, drive.ctrl.npss)) {
+			fprintf(stderr, "Failed to load operational power states from %s\n", paths[2 * i]);
+			return 1;
+		}
+		if (!loadTrace(paths[2 * i + 1], opts.serviceUs, drive.trace)) {
+			fprintf(stderr, "Failed to load trace from %s\n", paths[2 * i + 1]);
+			return 1;
+		}
+		endUs = std::max(endUs, drive.trace.back().arrivalUs);
+	}
+
+	std::vector<Budget::Controller> ctrls(drives.size());
+	uint64_t intervals {0}, peakUw {0};
+	double sumUw {0};
+	for (uint64_t startUs = 0; startUs <= endUs; startUs += opts.budgetIntervalUs, intervals++) {
+		for (size_t i = 0; i < drives.size(); i++)
+			ctrls[i] = {&drives[i].levels, drives[i].ctrl.psd, drives[i].requests, 0};
+
+		auto totalUw = Budget::allocate(ctrls.data(), ctrls.size(), opts.budgetUw);
+		peakUw = std::max(peakUw, totalUw);
+		sumUw += totalUw;
+
+		for (size_t i = 0; i < drives.size(); i++) {
+			auto& drive = drives[i];
+			auto level = ctrls[i].level;
+			drive.requests = 0;
+			while (drive.next < drive.trace.size() &&
+				   drive.trace[drive.next].arrivalUs < startUs + opts.budgetIntervalUs) {
+				drive.next++;
+				drive.requests++;
+			}
+			drive.intervals[level]++;
+			drive.served[level] += drive.requests;
+		}
+	}
+
+	printf("Budget %.2f W, %" PRIu64 " intervals of %" PRIu64 " ms, allocated %.2f W peak, %.2f W average\n",
+		   opts.budgetUw / 1e6, intervals, opts.budgetIntervalUs / 1000, peakUw / 1e6,
+		   sumUw / intervals / 1e6);
+	for (size_t i = 0; i < drives.size(); i++) {
+		auto& drive = drives[i];
+		printf("\n%s: %zu requests\n", paths[2 * i + 1], drive.trace.size());
+		printf("  PS     Max W  %% time  %% requests\n");
+		for (unsigned level = 0; level < drive.levels.count; level++)
+			printf("  %2u  %8.4f  %6.1f  %10.1f\n", drive.levels.states[level],
+				   Budget::levelPowerUw(ctrls[i], level) / 1e6, 100.0 * drive.intervals[level] / intervals,
+				   100.0 * drive.served[level] / drive.trace.size());
+	}
+
+	return 0;
+}
+
+int main(int argc, char** argv) {
+	Options opts;
+
+	int i {1};
+	for (; i < argc && argv[i][0] == '-'; i++) {
+		auto arg = argv[i];
+		auto value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+		if (!strcmp(arg, "-p") && value) {
+			if (!strcmp(value, "greedy"))
+				opts.policy = APST::Policy::Greedy;
+			else if (!strcmp(value, "cost"))
+				opts.policy = APST::Policy::CostModel;
+			else
+				return usage(argv[0]), 1;
+			i++;
+		} else if (!strcmp(arg, "-P") && value) {
+			opts.profile = APST::profileForName(value);
+			if (!opts.profile)
+				return usage(argv[0]), 1;
+			i++;
+		} else if (!strcmp(arg, "-l") && value) {
+			opts.maxLatencyUs = strtoull(value, nullptr, 0);
+			i++;
+		} else if (!strcmp(arg, "-s") && value) {
+			opts.serviceUs = strtoull(value, nullptr, 0);
+			i++;
+		} else if (!strcmp(arg, "-n")) {
+			opts.noDeepest = true;
+		} else if (!strcmp(arg, "-a")) {
+			opts.adaptive = true;
+		} else if (!strcmp(arg, "-g")) {
+			opts.governor = true;
+		} else if (!strcmp(arg, "-b") && value) {
+			opts.budgetUw = static_cast<uint64_t>(strtod(value, nullptr) * 1000000);
+			i++;
+		} else {
+			return usage(argv[0]), 1;
+		}
+	}
+
+	if (opts.budgetUw) {
+		if (argc - i < 2 || (argc - i) % 2)
+			return usage(argv[0]), 1;
+		return runBudget(opts, std::vector<const char*>(argv + i, argv + argc));
+	}
+
+	if (argc - i != 2)
+		return usage(argv[0]), 1;
+	opts.psdPath = argv[i];
+	opts.tracePath = argv[i + 1];
+
+	static NVMe::nvme_id_ctrl ctrl;
+	if (!loadPsd(opts.psdPath, ctrl) || ctrl.npss > 31) {
+		fprintf(stderr, "Failed to load power states from %s\n", opts.psdPath);
+		return 1;
+	}
+
+	if (!ctrl.apsta)
+		fprintf(stderr, "Warning: controller does not report APST support\n");
+
+	std::vector<Request> trace;
+	if (!loadTrace(opts.tracePath, opts.serviceUs, trace)) {
+		fprintf(stderr, "Failed to load trace from %s\n", opts.tracePath);
+		return 1;
+	}
+
+	Simulator sim(opts, ctrl);
+	sim.run(trace);
+	sim.report(trace);
+	return 0;
+}
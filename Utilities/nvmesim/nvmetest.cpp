@@ -0,0 +1,1026 @@
+//
+// @file nvmetest.cpp
+//
+// NVMeFix
+//
+// Copyright © 2026 acidanthera. All rights reserved.
+//
+// This program and the accompanying materials
+// are licensed and made available under the terms and conditions of the BSD License
+// which accompanies this distribution.  The full text of the license may be found at
+// http://opensource.org/licenses/bsd-license.php
+// THE PROGRAM IS DISTRIBUTED UNDER THE BSD LICENSE ON AN "AS IS" BASIS,
+// WITHOUT WARRANTIES OR REPRESENTATIONS OF ANY KIND, EITHER EXPRESS OR IMPLIED.
+
+/**
+ * Host tests of the portable NVMeFix modules.
+ * Every case builds its input in place, so failures do not depend on recorded dumps. Prints the
+ * failed checks and exits with non-zero status if there are any.
+ *
+ * Build:
+ *   c++ -std=c++14 -O2 -Wall -include host.h -I../../NVMeFix nvmetest.cpp \
+ *     ../../NVMeFix/nvme_apst_plan.cpp ../../NVMeFix/nvme_apst_tune.cpp \
+ *     ../../NVMeFix/nvme_hmb_plan.cpp ../../NVMeFix/nvme_arbitration_plan.cpp \
+ *     ../../NVMeFix/nvme_pm_governor.cpp ../../NVMeFix/nvme_budget_plan.cpp \
+ *     ../../NVMeFix/nvme_irq_coalesce.cpp -o nvmetest
+ */
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+
+#include "nvme_admin_queue.hpp"
+#include "nvme_apst_plan.hpp"
+#include "nvme_apst_tune.hpp"
+#include "nvme_arbitration_plan.hpp"
+#include "nvme_budget_plan.hpp"
+#include "nvme_health.hpp"
+#include "nvme_hmb_plan.hpp"
+#include "nvme_irq_coalesce.hpp"
+#include "nvme_pm_governor.hpp"
+
+namespace {
+
+unsigned failures {0};
+
+#define CHECK(cond) check((cond), #cond, __FILE__, __LINE__)
+
+void check(bool ok, const char* what, const char* file, int line) {
+	if (!ok) {
+		fprintf(stderr, "%s:%d: %s\n", file, line, what);
+		failures++;
+	}
+}
+
+/* Power state as given in the text tables of nvmesim */
+struct State {
+	uint32_t maxMw;
+	uint32_t entryUs;
+	uint32_t exitUs;
+	bool nop;
+	uint32_t idleMw;
+};
+
+void makePsd(const State* states, unsigned count, NVMe::nvme_id_ctrl& ctrl) {
+	memset(&ctrl, 0, sizeof(ctrl));
+	for (unsigned i = 0; i < count; i++) {
+		auto& ps = ctrl.psd[i];
+		ps.max_power = static_cast<uint16_t>(states[i].maxMw * 10);
+		ps.flags = NVMe::NVME_PS_FLAGS_MAX_POWER_SCALE;
+		if (states[i].nop)
+			ps.flags |= NVMe::NVME_PS_FLAGS_NON_OP_STATE;
+		ps.entry_lat = states[i].entryUs;
+		ps.exit_lat = states[i].exitUs;
+		if (states[i].idleMw) {
+			ps.idle_power = static_cast<uint16_t>(states[i].idleMw * 10);
+			ps.idle_scale = 1 << 6;
+		}
+	}
+	ctrl.npss = count - 1;
+	ctrl.apsta = 1;
+}
+
+/* Every entry must lead to a deeper usable state after a non-zero idle time */
+bool wellFormed(const APST::Input& in, const APST::Plan& plan) {
+	for (unsigned state = 0; state <= in.npss; state++) {
+		auto e = plan.table.entries[state];
+		if (!e)
+			continue;
+		auto target = static_cast<unsigned>((e >> 3) & 0x1f);
+		if (target <= state || target > in.npss || !APST::usable(in, target) || !(e >> 8))
+			return false;
+	}
+	return plan.maxPs == -1 || (plan.maxPs > 0 && APST::usable(in, plan.maxPs));
+}
+
+/* Three operational and two non-operational states, as in the README example */
+const State typical[] {
+	{9000, 0, 0, false, 0}, {4600, 0, 0, false, 0}, {3800, 0, 0, false, 0},
+	{45, 2000, 2000, true, 0}, {4, 6000, 8000, true, 0},
+};
+
+/* APST planner against power state tables a controller might report */
+void testPlanTables() {
+	static const State single[] {
+		{5000, 0, 0, false, 0},
+	};
+	static const State singleNop[] {
+		{5000, 0, 0, true, 0},
+	};
+	static const State allNop[] {
+		{5000, 0, 0, true, 0}, {50, 1000, 1000, true, 0}, {5, 5000, 10000, true, 0},
+	};
+	static const State allOp[] {
+		{5000, 0, 0, false, 0}, {3000, 0, 0, false, 0}, {2000, 0, 0, false, 0},
+	};
+	static const State hugeLatency[] {
+		{65000, 0, 0, false, 0}, {50, UINT32_MAX, UINT32_MAX, true, 0},
+		{5, UINT32_MAX, UINT32_MAX, true, 0},
+	};
+	static const State hugeMixed[] {
+		{65000, 0, 0, false, 0}, {50, 500, 1000, true, 0}, {1, UINT32_MAX, UINT32_MAX, true, 0},
+	};
+
+	static const struct {
+		const char* name;
+		const State* states;
+		unsigned count;
+		uint64_t maxLatencyUs;
+		/* Whether any policy must find a usable state */
+		bool usable;
+	} cases[] {
+		{"typical", typical, 5, 100000, true},
+		{"typical-tight-latency", typical, 5, 1000, false},
+		{"single-state", single, 1, 100000, false},
+		{"single-non-operational", singleNop, 1, 100000, false},
+		{"all-non-operational", allNop, 3, 100000, true},
+		{"all-operational", allOp, 3, 100000, false},
+		{"huge-latency", hugeLatency, 3, UINT64_MAX, true},
+		{"huge-latency-limited", hugeLatency, 3, 100000, false},
+		{"huge-latency-mixed", hugeMixed, 3, UINT64_MAX, true},
+	};
+
+	static const APST::Policy policies[] {APST::Policy::Greedy, APST::Policy::CostModel};
+
+	for (auto& c : cases) {
+		static NVMe::nvme_id_ctrl ctrl;
+		makePsd(c.states, c.count, ctrl);
+
+		APST::Input in;
+		in.psd = ctrl.psd;
+		in.npss = ctrl.npss;
+		in.maxLatencyUs = c.maxLatencyUs;
+
+		for (auto policy : policies) {
+			APST::Plan plan;
+			bool found = APST::plan(policy, in, APST::IdleHistogram::uniform(), plan);
+			bool ok = wellFormed(in, plan) && (policy == APST::Policy::Greedy ? found == c.usable : found <= c.usable);
+			if (!ok)
+				fprintf(stderr, "case %s, policy %u\n", c.name, static_cast<unsigned>(policy));
+			CHECK(ok);
+		}
+	}
+}
+
+/* Costs must saturate instead of wrapping when inputs are at the limits of their fields */
+void testPlanSaturation() {
+	static const State states[] {
+		{65000, 0, 0, false, 0}, {60000, 8000000, 8000000, true, 0}, {1, 8000000, 8000000, true, 0},
+	};
+
+	static NVMe::nvme_id_ctrl ctrl;
+	makePsd(states, 3, ctrl);
+
+	APST::Input in;
+	in.psd = ctrl.psd;
+	in.npss = ctrl.npss;
+	in.maxLatencyUs = UINT64_MAX;
+
+	/* Long idle intervals only, so the deepest state pays off unless exits are penalised */
+	APST::IdleHistogram hist;
+	hist.add(49000000, UINT32_MAX);
+
+	APST::Plan none, cost;
+	APST::planCostModel(in, hist, cost);
+	CHECK(cost.maxPs == 2);
+	CHECK(APST::expectedEnergy(in, cost, hist) < APST::expectedEnergy(in, none, hist));
+
+	in.exitPenaltyPercent = UINT64_MAX;
+	APST::planCostModel(in, hist, cost);
+	CHECK(cost.maxPs == -1);
+
+	/* Never transitions within the interval, as ITPT saturates too */
+	static const State huge[] {
+		{65000, 0, 0, false, 0}, {1, UINT32_MAX, UINT32_MAX, true, 0},
+	};
+	makePsd(huge, 2, ctrl);
+	in.npss = ctrl.npss;
+
+	APST::Plan greedy;
+	APST::planGreedy(in, greedy);
+	CHECK(greedy.maxPs == 1);
+	CHECK(APST::expectedEnergy(in, greedy, hist) == APST::expectedEnergy(in, none, hist));
+}
+
+
+/* Profiles must lead to different tables, and switching to one may leave no usable state */
+void testPlanProfiles() {
+	static NVMe::nvme_id_ctrl ctrl;
+	makePsd(typical, 5, ctrl);
+
+	static const APST::Policy policies[] {APST::Policy::Greedy, APST::Policy::CostModel};
+	for (auto policy : policies) {
+		APST::Plan plans[APST::nprofiles];
+		for (size_t i = 0; i < APST::nprofiles; i++) {
+			APST::Input in;
+			in.psd = ctrl.psd;
+			in.npss = ctrl.npss;
+			in.maxLatencyUs = 100000;
+			APST::applyProfile(APST::profiles[i], in);
+			CHECK(APST::plan(policy, in, APST::IdleHistogram::uniform(), plans[i]));
+			CHECK(wellFormed(in, plans[i]));
+		}
+
+		auto& performance = plans[0];
+		auto& balanced = plans[1];
+		auto& battery = plans[2];
+		CHECK(performance.maxPs == 3);
+		CHECK(memcmp(&balanced.table, &battery.table, sizeof(battery.table)));
+
+		/* Battery enters the same or deeper states no later than balanced */
+		for (unsigned state = 0; state <= ctrl.npss; state++) {
+			auto b = balanced.table.entries[state], p = battery.table.entries[state];
+			CHECK(!b || (p && ((p >> 3) & 0x1f) >= ((b >> 3) & 0x1f) && (p >> 8) <= (b >> 8)));
+		}
+	}
+
+	/* Performance latency limit excludes both states here */
+	static const State slow[] {
+		{9000, 0, 0, false, 0}, {45, 20000, 20000, true, 0}, {4, 60000, 80000, true, 0},
+	};
+	makePsd(slow, 3, ctrl);
+
+	APST::Input in;
+	in.psd = ctrl.psd;
+	in.npss = ctrl.npss;
+	in.maxLatencyUs = 100000;
+	APST::applyProfile(*APST::profileForName("performance"), in);
+	APST::Plan plan;
+	CHECK(!APST::plan(APST::Policy::CostModel, in, APST::IdleHistogram::uniform(), plan));
+	CHECK(!APST::profileForName("unknown"));
+}
+
+/* Record `count` idle intervals of `gapUs` each, returning the time of the last request */
+uint64_t feed(APST::Tuner& tuner, uint64_t nowUs, uint64_t gapUs, unsigned count) {
+	tuner.tickle(nowUs);
+	for (unsigned i = 0; i < count; i++) {
+		nowUs += gapUs;
+		tuner.tickle(nowUs);
+	}
+	return nowUs;
+}
+
+/* Tuner retunes only with enough samples, a different table, enough gain and after the hold time */
+void testTunerRetune() {
+	static NVMe::nvme_id_ctrl ctrl;
+	makePsd(typical, 5, ctrl);
+
+	APST::Input in;
+	in.psd = ctrl.psd;
+	in.npss = ctrl.npss;
+	in.maxLatencyUs = 100000;
+
+	/* Table as planned at boot, against the uniform distribution */
+	APST::Plan boot;
+	APST::planCostModel(in, APST::IdleHistogram::uniform(), boot);
+	CHECK(boot.maxPs == 4);
+
+	APST::Tuner tuner;
+	APST::Plan fitted;
+	uint64_t now {1000000};
+
+	/* One sample short */
+	now = feed(tuner, now, 200000, APST::Tuner::minSamples - 1);
+	CHECK(!tuner.retune(in, boot, now, fitted));
+
+	/* Gaps too short to matter are not samples */
+	tuner.reset();
+	now = feed(tuner, now, APST::Tuner::minIdleUs - 1, 4 * APST::Tuner::minSamples);
+	CHECK(!tuner.retune(in, boot, now, fitted));
+
+	/* Short idle only: staying in PS0 is cheapest, but APST is not turned off by the tuner */
+	tuner.reset();
+	now = feed(tuner, now, 2000, APST::Tuner::minSamples);
+	CHECK(!tuner.retune(in, boot, now, fitted));
+
+	/* Different table, but saving less than minGainPercent */
+	tuner.reset();
+	now = feed(tuner, now, 5000000, APST::Tuner::minSamples);
+	CHECK(!tuner.retune(in, boot, now, fitted));
+	CHECK(fitted.maxPs == 4 && memcmp(&fitted.table, &boot.table, sizeof(boot.table)));
+
+	/* 200 ms gaps never reach the deepest state, so it is dropped */
+	tuner.reset();
+	now = feed(tuner, now, 200000, APST::Tuner::minSamples);
+	CHECK(tuner.retune(in, boot, now, fitted));
+	CHECK(fitted.maxPs == 3 && !fitted.table.entries[3]);
+	auto current = fitted;
+	auto updatedUs = now;
+
+	/* Long idle returns, but the table is held for a while after an update */
+	now = feed(tuner, now, 5000000, APST::Tuner::minSamples);
+	CHECK(!tuner.retune(in, current, updatedUs + APST::Tuner::holdUs - 1, fitted));
+	CHECK(tuner.retune(in, current, updatedUs + APST::Tuner::holdUs, fitted));
+	CHECK(fitted.maxPs == 4);
+	current = fitted;
+
+	/* More of the same workload is not worth another update */
+	now = feed(tuner, now, 5000000, APST::Tuner::minSamples);
+	CHECK(!tuner.retune(in, current, now, fitted));
+}
+
+
+/**
+ * Controller executing admin commands in submission order of the scheduler, like the kext admin
+ * workloop does. Records what it was sent and completes callbacks with the command dword 11 as
+ * result, or with `aborted` for superseded commands, which the kext completes with kIOReturnAborted.
+ */
+class FakeController {
+public:
+	static constexpr size_t depth {4};
+	static constexpr int aborted {-1};
+
+	struct Sent {
+		uint8_t opcode;
+		uint8_t fid;
+		uint32_t dword11;
+	};
+
+	Admin::Scheduler<depth> scheduler;
+	Sent sent[64] {};
+	size_t nsent {0};
+	/* Callbacks by tag in the context, and the status they got */
+	unsigned completions[64] {};
+	int statuses[64] {};
+
+	Admin::Submit submit(uint8_t opcode, uint8_t fid, uint32_t dword11, Admin::Priority priority,
+						 unsigned tag, bool replay = false) {
+		Admin::Command command {};
+		command.cmd.opcode = opcode;
+		command.cmd.cdw10 = fid;
+		command.cmd.cdw11 = dword11;
+		command.callback = completed;
+		command.context = reinterpret_cast<void*>(static_cast<uintptr_t>(tag));
+		command.priority = priority;
+		command.replay = replay;
+
+		Admin::Command superseded;
+		auto ret = scheduler.submit(command, superseded);
+		if (ret == Admin::Submit::Coalesced)
+			superseded.callback(this, superseded.context, aborted, 0);
+		return ret;
+	}
+
+	/* Runs everything pending, returns the number of commands sent */
+	size_t drain() {
+		size_t n {0};
+		Admin::Command command;
+		for (int slot; (slot = scheduler.start(command)) >= 0; n++) {
+			if (nsent < sizeof(sent) / sizeof(sent[0]))
+				sent[nsent++] = {command.cmd.opcode, static_cast<uint8_t>(command.cmd.cdw10 & 0xff),
+					command.cmd.cdw11};
+			command.callback(this, command.context, 0, command.cmd.cdw11);
+			scheduler.finish(slot);
+		}
+		return n;
+	}
+
+private:
+	static void completed(void* owner, void* context, int status, uint32_t) {
+		auto& ctrl = *static_cast<FakeController*>(owner);
+		auto tag = static_cast<unsigned>(reinterpret_cast<uintptr_t>(context));
+		ctrl.completions[tag]++;
+		ctrl.statuses[tag] = status;
+	}
+};
+
+/* Admin queue runs commands by priority, bounds its depth, and completes every command once */
+void testAdminQueue() {
+	using Admin::Priority;
+	using Admin::Submit;
+	constexpr uint8_t get {NVMe::nvme_admin_get_features}, set {NVMe::nvme_admin_set_features},
+		log {NVMe::nvme_admin_get_log_page};
+
+	/* Highest priority first, oldest first within one */
+	{
+		FakeController ctrl;
+		CHECK(ctrl.submit(log, 0x02, 0, Priority::Background, 0) == Submit::Queued);
+		CHECK(ctrl.submit(set, 0x02, 3, Priority::Transition, 1) == Submit::Queued);
+		CHECK(ctrl.submit(get, 0x0c, 0, Priority::Resume, 2) == Submit::Queued);
+		CHECK(ctrl.submit(get, 0x08, 0, Priority::Background, 3) == Submit::Queued);
+		CHECK(ctrl.drain() == 4);
+		CHECK(ctrl.sent[0].fid == 0x0c && ctrl.sent[1].fid == 0x02 && ctrl.sent[1].opcode == set &&
+			  ctrl.sent[2].opcode == log && ctrl.sent[3].fid == 0x08);
+		CHECK(ctrl.scheduler.pending() == 0 && ctrl.scheduler.completed == 4);
+	}
+
+	/* Full queue drops the command without completing it, and takes new ones once drained */
+	{
+		FakeController ctrl;
+		for (unsigned i = 0; i < FakeController::depth; i++)
+			CHECK(ctrl.submit(get, static_cast<uint8_t>(i + 1), 0, Priority::Background, i) == Submit::Queued);
+		CHECK(ctrl.submit(get, 0x10, 0, Priority::Resume, 10) == Submit::Dropped);
+		CHECK(ctrl.scheduler.dropped == 1 && ctrl.scheduler.maxDepth == FakeController::depth);
+		CHECK(ctrl.completions[10] == 0);
+		CHECK(ctrl.drain() == FakeController::depth);
+		CHECK(ctrl.submit(get, 0x10, 0, Priority::Resume, 10) == Submit::Queued);
+		CHECK(ctrl.drain() == 1 && ctrl.completions[10] == 1);
+	}
+
+	/* Only the last value of a feature is sent, the earlier one is completed as aborted */
+	{
+		FakeController ctrl;
+		CHECK(ctrl.submit(set, 0x08, 1, Priority::Background, 0) == Submit::Queued);
+		CHECK(ctrl.submit(get, 0x08, 0, Priority::Background, 1) == Submit::Queued);
+		CHECK(ctrl.submit(set, 0x08, 2, Priority::Background, 2) == Submit::Coalesced);
+		CHECK(ctrl.completions[0] == 1 && ctrl.statuses[0] == FakeController::aborted);
+
+		/* Replayed saved value does not override the newer pending one, and raises its priority */
+		CHECK(ctrl.submit(set, 0x02, 4, Priority::Transition, 3) == Submit::Queued);
+		CHECK(ctrl.submit(set, 0x08, 1, Priority::Resume, 4, true) == Submit::Coalesced);
+		CHECK(ctrl.completions[4] == 1 && ctrl.statuses[4] == FakeController::aborted);
+
+		CHECK(ctrl.drain() == 3);
+		CHECK(ctrl.sent[0].fid == 0x08 && ctrl.sent[0].dword11 == 2);
+		CHECK(ctrl.sent[1].fid == 0x02 && ctrl.sent[2].opcode == get);
+		CHECK(ctrl.completions[2] == 1 && ctrl.statuses[2] == 0);
+		CHECK(ctrl.scheduler.coalesced == 2 && ctrl.scheduler.submitted == 5);
+	}
+
+	/* Running command is not coalesced into, and holds its slot until its callback returned */
+	{
+		FakeController ctrl;
+		CHECK(ctrl.submit(set, 0x08, 1, Priority::Background, 0) == Submit::Queued);
+		Admin::Command command;
+		auto slot = ctrl.scheduler.start(command);
+		CHECK(slot >= 0);
+		CHECK(ctrl.submit(set, 0x08, 2, Priority::Background, 1) == Submit::Queued);
+		CHECK(ctrl.scheduler.pending() == 2);
+		for (unsigned i = 2; i < FakeController::depth; i++)
+			CHECK(ctrl.submit(get, 0x0c, 0, Priority::Background, i) == Submit::Queued);
+		CHECK(ctrl.submit(get, 0x0c, 0, Priority::Background, 9) == Submit::Dropped);
+		ctrl.scheduler.finish(slot);
+		ctrl.scheduler.finish(slot);
+		CHECK(ctrl.scheduler.pending() == FakeController::depth - 1);
+		CHECK(ctrl.drain() == FakeController::depth - 1);
+		CHECK(ctrl.sent[0].dword11 == 2);
+	}
+
+	/* Completion order stays FIFO over many rounds */
+	{
+		FakeController ctrl;
+		bool ordered {true};
+		for (unsigned round = 0; round < 1000; round++) {
+			ctrl.nsent = 0;
+			for (unsigned i = 0; i < FakeController::depth; i++)
+				ctrl.submit(get, static_cast<uint8_t>(i), 0, Priority::Background, i);
+			ctrl.drain();
+			for (unsigned i = 0; i < FakeController::depth; i++)
+				ordered &= ctrl.sent[i].fid == i;
+		}
+		CHECK(ordered);
+		CHECK(ctrl.scheduler.completed == 1000 * FakeController::depth);
+	}
+}
+
+/* Physical memory handing out chunks up to `largest` bytes, at ascending addresses */
+struct FakeMemory {
+	uint64_t largest;
+	uint64_t next {0x100000000};
+	unsigned failed {0};
+
+	static bool alloc(void* context, uint64_t bytes, uint64_t& addr) {
+		auto& mem = *static_cast<FakeMemory*>(context);
+		if (bytes > mem.largest) {
+			mem.failed++;
+			return false;
+		}
+		addr = mem.next;
+		mem.next += bytes;
+		return true;
+	}
+};
+
+/* Identify asking for `preferred` bytes, at least `min` in up to `maxd` chunks of `minds` or more */
+NVMe::nvme_id_ctrl hmbIdentify(uint64_t preferred, uint64_t min, uint64_t minds, uint16_t maxd) {
+	NVMe::nvme_id_ctrl ctrl {};
+	ctrl.hmpre = static_cast<uint32_t>(preferred / HMB::unitBytes);
+	ctrl.hmmin = static_cast<uint32_t>(min / HMB::unitBytes);
+	ctrl.hmminds = static_cast<uint32_t>(minds / HMB::unitBytes);
+	ctrl.hmmaxd = maxd;
+	return ctrl;
+}
+
+/* Chunks are page aligned, add up to the total and do not overlap */
+bool consistent(const HMB::Buffer& buffer) {
+	uint64_t total {0};
+	for (uint32_t i = 0; i < buffer.nchunks; i++) {
+		if ((buffer.addr[i] | buffer.bytes[i]) & (HMB::pageBytes - 1) || !buffer.bytes[i])
+			return false;
+		if (i && buffer.addr[i - 1] + buffer.bytes[i - 1] > buffer.addr[i])
+			return false;
+		total += buffer.bytes[i];
+	}
+	return total == buffer.totalBytes;
+}
+
+/**
+ * Host Memory Buffer sizing against allocators of decreasing largest chunk, and the descriptor list
+ * and Set Features dwords built for it.
+ */
+void testHMB() {
+	constexpr uint64_t MiB {1024 * 1024};
+	HMB::Limits limits {};
+
+	/* Controllers with DRAM do not ask, and a minimum above the preferred size is invalid */
+	auto ctrl = hmbIdentify(0, 0, 0, 0);
+	CHECK(!HMB::limits(ctrl, limits));
+	ctrl = hmbIdentify(32 * MiB, 64 * MiB, 0, 0);
+	CHECK(!HMB::limits(ctrl, limits));
+
+	ctrl = hmbIdentify(64 * MiB, 32 * MiB, 0, 0);
+	CHECK(HMB::limits(ctrl, limits));
+	CHECK(limits.preferredBytes == 64 * MiB);
+	CHECK(limits.minBytes == 32 * MiB);
+	CHECK(limits.minChunkBytes == HMB::pageBytes);
+	CHECK(limits.maxChunks == HMB::maxChunks);
+
+	static const struct {
+		uint64_t preferred;
+		uint64_t min;
+		uint64_t minds;
+		uint16_t maxd;
+		uint64_t largest;
+		bool ok;
+		uint32_t nchunks;
+		uint64_t totalBytes;
+	} cases[] {
+		/* Largest chunks first, and halved on fragmented memory */
+		{64 * MiB, 32 * MiB, 0, 0, 64 * MiB, true, 16, 64 * MiB},
+		{64 * MiB, 32 * MiB, 0, 0, 1 * MiB, true, 64, 64 * MiB},
+		/* Sizes not a multiple of the chunk end with a smaller one */
+		{10 * MiB, 0, 0, 0, 64 * MiB, true, 3, 10 * MiB},
+		/* Few descriptors need larger chunks, which are halved down to what may be allocated */
+		{64 * MiB, 32 * MiB, 0, 8, 64 * MiB, true, 8, 64 * MiB},
+		{64 * MiB, 32 * MiB, 0, 8, 4 * MiB, true, 8, 32 * MiB},
+		{64 * MiB, 48 * MiB, 0, 8, 4 * MiB, false, 8, 32 * MiB},
+		/* Chunks are never below the minimum descriptor size */
+		{64 * MiB, 0, 2 * MiB, 0, 1 * MiB, false, 0, 0},
+		/* The descriptor page bounds the chunk count, leaving a part of the preferred size out */
+		{64 * MiB, 0, 0, 0, 128 * 1024, true, HMB::maxChunks, HMB::maxChunks * 128 * 1024},
+	};
+
+	for (auto& c : cases) {
+		ctrl = hmbIdentify(c.preferred, c.min, c.minds, c.maxd);
+		FakeMemory mem {c.largest};
+		HMB::Buffer buffer {};
+		CHECK(HMB::limits(ctrl, limits));
+		CHECK(HMB::allocate(limits, FakeMemory::alloc, &mem, buffer) == c.ok);
+		CHECK(buffer.nchunks == c.nchunks);
+		CHECK(buffer.totalBytes == c.totalBytes);
+		CHECK(consistent(buffer));
+		for (uint32_t i = 0; i < buffer.nchunks; i++)
+			CHECK(buffer.bytes[i] >= limits.minChunkBytes && buffer.bytes[i] <= c.largest);
+	}
+
+	/* Descriptors in memory pages, bounded by the room given */
+	ctrl = hmbIdentify(10 * MiB, 0, 0, 0);
+	FakeMemory mem {4 * MiB};
+	HMB::Buffer buffer {};
+	CHECK(HMB::limits(ctrl, limits));
+	CHECK(HMB::allocate(limits, FakeMemory::alloc, &mem, buffer));
+
+	NVMe::nvme_host_mem_buf_desc list[HMB::maxChunks];
+	memset(list, 0xff, sizeof(list));
+	CHECK(HMB::describe(buffer, list, HMB::maxChunks) == buffer.nchunks);
+	for (uint32_t i = 0; i < buffer.nchunks; i++) {
+		CHECK(list[i].addr == buffer.addr[i]);
+		CHECK(list[i].size == buffer.bytes[i] / HMB::pageBytes);
+		CHECK(list[i].rsvd == 0);
+	}
+	CHECK(list[2].size == 2 * MiB / HMB::pageBytes);
+	CHECK(HMB::describe(buffer, list, 1) == 1);
+
+	/* Set Features dwords, with the return bit only when the buffer is handed back after sleep */
+	uint64_t listAddr {0x123456789000};
+	auto enable = HMB::enableCommand(buffer, listAddr, false);
+	CHECK(enable.opcode == NVMe::nvme_admin_set_features);
+	CHECK(enable.cdw10 == NVMe::NVME_FEAT_HOST_MEM_BUF);
+	CHECK(enable.cdw11 == NVMe::NVME_HOST_MEM_ENABLE);
+	CHECK(enable.cdw12 == 10 * MiB / HMB::pageBytes);
+	CHECK(enable.cdw13 == 0x56789000);
+	CHECK(enable.cdw14 == 0x1234);
+	CHECK(enable.cdw15 == 3);
+	auto returned = HMB::enableCommand(buffer, listAddr, true);
+	CHECK(returned.cdw11 == (NVMe::NVME_HOST_MEM_ENABLE | NVMe::NVME_HOST_MEM_RETURN));
+	auto disable = HMB::disableCommand();
+	CHECK(disable.opcode == NVMe::nvme_admin_set_features);
+	CHECK(disable.cdw10 == NVMe::NVME_FEAT_HOST_MEM_BUF);
+	CHECK(disable.cdw11 == 0);
+}
+
+/* Arbitration dword 11 changed only as asked for, within what the selected mechanism uses */
+void testArbitrationPlan() {
+	/* Bursts are rounded down to a power of two, and the largest limited one is 64 commands */
+	static const struct {
+		uint32_t commands;
+		uint8_t log2;
+	} bursts[] {
+		{0, Arbitration::unlimitedBurst}, {1, 0}, {2, 1}, {3, 1}, {4, 2}, {127, 6}, {128, 6}, {100000, 6},
+	};
+	for (auto& b : bursts)
+		CHECK(Arbitration::burstLog2(b.commands) == b.log2);
+
+	constexpr uint64_t capWrr {1ull << 17};
+	constexpr uint32_t rr {NVMe::NVME_CC_AMS_RR}, wrr {NVMe::NVME_CC_AMS_WRRU}, vs {NVMe::NVME_CC_AMS_VS};
+	constexpr auto keep = Arbitration::keepBurst;
+
+	static const struct {
+		const char* name;
+		uint64_t cap;
+		uint32_t cc;
+		uint8_t rab;
+		uint32_t current;
+		Arbitration::Config config;
+		bool changed;
+		uint32_t dword11;
+	} cases[] {
+		{"nothing asked", capWrr, wrr, 3, 0x01070f03, {keep, 0, 0, 0}, false, 0x01070f03},
+		{"same burst", capWrr, rr, 3, 0x3, {3, 0, 0, 0}, false, 0x3},
+		{"lower burst", capWrr, rr, 6, 0x3, {1, 0, 0, 0}, true, 0x1},
+		{"burst capped by rab", 0, rr, 2, 0x0, {5, 0, 0, 0}, true, 0x2},
+		{"unlimited above rab", 0, rr, 2, 0x2, {Arbitration::unlimitedBurst, 0, 0, 0}, true, 0x7},
+		{"weights under rr", capWrr, rr, 3, 0x3, {keep, 2, 8, 16}, false, 0x3},
+		{"weights under wrr", capWrr, wrr, 3, 0x3, {keep, 2, 8, 16}, true, 0x0f070103},
+		{"one weight", capWrr, wrr, 3, 0x0f070103, {keep, 0, 0, 256}, true, 0xff070103},
+		{"wrr without cap", 0, wrr, 3, 0x3, {keep, 2, 8, 16}, false, 0x3},
+		{"vendor specific", capWrr, vs, 3, 0x3, {1, 2, 8, 16}, false, 0},
+	};
+
+	for (auto& c : cases) {
+		Arbitration::Setting setting {};
+		bool changed = Arbitration::plan(c.cap, c.cc, c.rab, c.current, c.config, setting);
+		bool ok = changed == c.changed && (c.cc == vs || setting.dword11() == c.dword11);
+		if (!ok)
+			fprintf(stderr, "case %s: 0x%08x\n", c.name, setting.dword11());
+		CHECK(ok);
+	}
+}
+
+/* Operational states of a DRAM-less controller, within the 6.5 W the 0.0001 W scale takes */
+const State active[] {
+	{6500, 0, 0, false, 0}, {4600, 0, 0, false, 0}, {3800, 0, 0, false, 0},
+	{45, 2000, 2000, true, 0}, {4, 6000, 8000, true, 0},
+};
+
+/* Idle governor stepped through its hold times by a fake clock */
+void testIdleGovernor() {
+	constexpr uint64_t ms {1000};
+	static NVMe::nvme_id_ctrl ctrl;
+
+	/* Levels are operational states by decreasing power, whatever their numbers */
+	static const State unordered[] {
+		{6000, 0, 0, false, 0}, {3800, 0, 0, false, 0}, {4600, 0, 0, false, 0}, {45, 2000, 2000, true, 0},
+	};
+	makePsd(unordered, 4, ctrl);
+	Governor::Levels levels;
+	CHECK(levels.init(ctrl.psd, ctrl.npss));
+	CHECK(levels.count == 3);
+	CHECK(levels.states[0] == 0 && levels.states[1] == 2 && levels.states[2] == 1);
+
+	makePsd(active, 5, ctrl);
+	Governor::IdleGovernor::Config config;
+	Governor::IdleGovernor::defaultConfig(config);
+	config.holdUs[0] = 100 * ms;
+	config.holdUs[1] = 200 * ms;
+
+	/* One step per hold time, none past the deepest operational state */
+	Governor::IdleGovernor gov;
+	CHECK(gov.init(ctrl.psd, ctrl.npss, config, 0));
+	CHECK(gov.deadline() == 100 * ms);
+	CHECK(!gov.evaluate(100 * ms - 1));
+	CHECK(gov.evaluate(100 * ms));
+	CHECK(gov.currentLevel() == 1 && gov.targetState() == 1);
+	CHECK(gov.deadline() == 300 * ms);
+	CHECK(!gov.evaluate(300 * ms - 1));
+	CHECK(gov.evaluate(300 * ms));
+	CHECK(gov.targetState() == 2);
+	CHECK(gov.deadline() == 0);
+	CHECK(!gov.evaluate(10000 * ms));
+	CHECK(gov.stepsDown == 2);
+
+	/* Late timer catches up on all the hold times elapsed */
+	CHECK(gov.init(ctrl.psd, ctrl.npss, config, 0));
+	CHECK(gov.evaluate(1000 * ms));
+	CHECK(gov.currentLevel() == 2);
+
+	/* Activity in the shallowest state only restarts its hold time */
+	CHECK(gov.init(ctrl.psd, ctrl.npss, config, 0));
+	CHECK(!gov.activity(90 * ms));
+	CHECK(!gov.evaluate(150 * ms));
+	CHECK(gov.evaluate(190 * ms));
+	CHECK(gov.wakeups == 0);
+
+	/* Wake-up within hysteresis doubles the hold time of the state that led to the step */
+	CHECK(gov.activity(200 * ms));
+	CHECK(gov.currentLevel() == 0 && gov.wakeups == 1);
+	CHECK(gov.deadline() == 400 * ms);
+	CHECK(!gov.evaluate(400 * ms - 1));
+	CHECK(gov.evaluate(400 * ms));
+
+	/* Doubling stops at maxBackoff */
+	uint64_t now {400 * ms};
+	for (unsigned i = 0; i < 10; i++) {
+		now = gov.deadline();
+		CHECK(gov.evaluate(now));
+		CHECK(gov.activity(now + config.hysteresisUs - 1));
+		now += config.hysteresisUs - 1;
+	}
+	CHECK(gov.deadline() == now + (100 * ms << config.maxBackoff));
+
+	/* Residency past hysteresis halves it again */
+	now = gov.deadline();
+	CHECK(gov.evaluate(now));
+	now += config.hysteresisUs;
+	CHECK(gov.activity(now));
+	CHECK(gov.deadline() == now + (100 * ms << (config.maxBackoff - 1)));
+}
+
+/* Sets the relative performance ranks of power state `ps`, 0 being the best */
+void setRanks(NVMe::nvme_id_ctrl& ctrl, unsigned ps, uint8_t readTput, uint8_t readLat, uint8_t writeTput,
+			  uint8_t writeLat) {
+	ctrl.psd[ps].read_tput = readTput;
+	ctrl.psd[ps].read_lat = readLat;
+	ctrl.psd[ps].write_tput = writeTput;
+	ctrl.psd[ps].write_lat = writeLat;
+}
+
+/* Close `count` samples of `perSample` requests each, returning the time after the last one */
+uint64_t sample(Governor::ThroughputGovernor& gov, uint64_t nowUs, uint32_t perSample, unsigned count) {
+	for (unsigned i = 0; i < count; i++) {
+		gov.record(nowUs, perSample);
+		nowUs = gov.deadline();
+		gov.evaluate(nowUs);
+	}
+	return nowUs;
+}
+
+/* Throughput governor picking operational states by ranks of the power state table */
+void testThroughputGovernor() {
+	static NVMe::nvme_id_ctrl ctrl;
+	makePsd(active, 5, ctrl);
+	Governor::Levels levels;
+	CHECK(levels.init(ctrl.psd, ctrl.npss));
+	uint8_t capacity[Governor::Levels::maxLevels];
+
+	/* Ranks of a state are its worst of all four, relative to the best and one past the worst */
+	setRanks(ctrl, 0, 0, 0, 0, 0);
+	setRanks(ctrl, 1, 1, 2, 0, 1);
+	setRanks(ctrl, 2, 3, 0, 3, 3);
+	Governor::ThroughputGovernor::capacities(ctrl.psd, levels, capacity);
+	CHECK(capacity[0] == 100 && capacity[1] == 50 && capacity[2] == 25);
+
+	/* Without informative ranks, capacity follows maximum power */
+	setRanks(ctrl, 1, 0, 0, 0, 0);
+	setRanks(ctrl, 2, 0, 0, 0, 0);
+	Governor::ThroughputGovernor::capacities(ctrl.psd, levels, capacity);
+	CHECK(capacity[0] == 100 && capacity[1] == 4600 * 100 / 6500 && capacity[2] == 3800 * 100 / 6500);
+
+	/* The first level serves everything, even if it is ranked worse */
+	setRanks(ctrl, 0, 2, 2, 2, 2);
+	setRanks(ctrl, 1, 0, 0, 0, 0);
+	setRanks(ctrl, 2, 1, 1, 1, 1);
+	Governor::ThroughputGovernor::capacities(ctrl.psd, levels, capacity);
+	CHECK(capacity[0] == 100 && capacity[1] == 100 && capacity[2] == 66);
+
+	setRanks(ctrl, 0, 0, 0, 0, 0);
+	setRanks(ctrl, 1, 1, 2, 0, 1);
+	setRanks(ctrl, 2, 3, 0, 3, 3);
+
+	Governor::ThroughputGovernor::Config config;
+	Governor::ThroughputGovernor::defaultConfig(config);
+	Governor::ThroughputGovernor gov;
+	uint64_t now {1000000};
+	CHECK(gov.init(ctrl.psd, ctrl.npss, config, now));
+
+	/* Full load sets the peak, 100 requests per 10 ms sample */
+	now = sample(gov, now, 100, 50);
+	CHECK(gov.currentLevel() == 0);
+	CHECK(gov.rate() == 10000 && gov.peak() == 10000);
+
+	/* A third of the peak fits the 50% state with headroom and hysteresis, but only after the hold */
+	auto samplesHeld = static_cast<unsigned>(config.downHoldUs / config.sampleUs);
+	now = sample(gov, now, 30, samplesHeld);
+	CHECK(gov.currentLevel() == 0);
+	now = sample(gov, now, 30, 2);
+	CHECK(gov.currentLevel() == 1 && gov.targetState() == 1 && gov.rampsDown == 1);
+
+	/* A tenth of it fits the lowest state too */
+	now = sample(gov, now, 10, samplesHeld + 2);
+	CHECK(gov.currentLevel() == 2 && gov.targetState() == 2 && gov.rampsDown == 2);
+
+	/* Bursts ramp up within the sample, before the deadline */
+	CHECK(!gov.record(now, 10));
+	CHECK(gov.record(now + 1, 40));
+	CHECK(gov.currentLevel() == 0 && gov.rampsUp == 1);
+	now = gov.deadline();
+	gov.evaluate(now);
+
+	/* And the hold starts over */
+	now = sample(gov, now, 10, samplesHeld - 1);
+	CHECK(gov.currentLevel() == 0);
+	now = sample(gov, now, 10, 3);
+	CHECK(gov.currentLevel() == 2);
+
+	/* Sampling stops while idle and restarts with the next request */
+	now = sample(gov, now, 0, 2);
+	CHECK(gov.deadline() == 0);
+	CHECK(gov.record(now + 5000000));
+	CHECK(gov.deadline() == now + 5000000 + config.sampleUs);
+}
+
+/* Power budget split between synthetic controllers by their I/O requests */
+void testBudget() {
+	constexpr uint64_t mW {1000};
+	static NVMe::nvme_id_ctrl ctrl;
+	makePsd(active, 5, ctrl);
+	Governor::Levels levels;
+	CHECK(levels.init(ctrl.psd, ctrl.npss));
+
+	/* Lowest states draw 3.8 W each, the shallowest 6.5 W and the one between 4.6 W */
+	static const struct {
+		const char* name;
+		uint64_t requests[2];
+		uint64_t budgetUw;
+		unsigned levels[2];
+		uint64_t totalUw;
+	} cases[] {
+		{"busier first", {10, 100}, 10300 * mW, {2, 0}, 10300 * mW},
+		{"ties in order", {100, 100}, 10300 * mW, {0, 2}, 10300 * mW},
+		{"rest to next", {10, 100}, 11100 * mW, {1, 0}, 11100 * mW},
+		{"rest too small", {10, 100}, 11000 * mW, {2, 0}, 10300 * mW},
+		{"all fit", {0, 0}, 20000 * mW, {0, 0}, 13000 * mW},
+		{"below lowest", {10, 100}, 1000 * mW, {2, 2}, 7600 * mW},
+	};
+
+	for (auto& c : cases) {
+		Budget::Controller ctrls[2] {
+			{&levels, ctrl.psd, c.requests[0], 0},
+			{&levels, ctrl.psd, c.requests[1], 0},
+		};
+		auto total = Budget::allocate(ctrls, 2, c.budgetUw);
+		bool ok = total == c.totalUw && ctrls[0].level == c.levels[0] && ctrls[1].level == c.levels[1];
+		if (!ok)
+			fprintf(stderr, "case %s: %" PRIu64 " uW, levels %u %u\n", c.name, total, ctrls[0].level,
+					ctrls[1].level);
+		CHECK(ok);
+	}
+
+	/* Maximum power is in 0.01 W without NVME_PS_FLAGS_MAX_POWER_SCALE, and in 0.0001 W with it */
+	static NVMe::nvme_id_ctrl mixed;
+	memset(&mixed, 0, sizeof(mixed));
+	mixed.npss = 1;
+	mixed.psd[0].max_power = 800;
+	mixed.psd[1].max_power = 30000;
+	mixed.psd[1].flags = NVMe::NVME_PS_FLAGS_MAX_POWER_SCALE;
+	Governor::Levels mixedLevels;
+	CHECK(mixedLevels.init(mixed.psd, mixed.npss));
+
+	Budget::Controller one {&mixedLevels, mixed.psd, 1, 0};
+	CHECK(Budget::levelPowerUw(one, 0) == 8000 * mW);
+	CHECK(Budget::levelPowerUw(one, 1) == 3000 * mW);
+	CHECK(Budget::allocate(&one, 1, 8000 * mW - 1) == 3000 * mW && one.level == 1);
+	CHECK(Budget::allocate(&one, 1, 8000 * mW) == 8000 * mW && one.level == 0);
+}
+
+/* Interrupt coalescing level driven by samples of a fake clock */
+void testCoalescePolicy() {
+	Coalesce::Policy::Config config;
+	Coalesce::Policy::defaultConfig(config);
+	Coalesce::Policy policy;
+	policy.init(config);
+
+	constexpr uint64_t us {Coalesce::Policy::defaultSampleUs};
+	/* 200k IOPS, synchronous, then 16 requests per interrupt, then 40k IOPS at 2 per interrupt */
+	const Coalesce::Sample qd1 {50000, 50000, 50000, us};
+	const Coalesce::Sample deep {50000, 3125, 3125, us};
+	const Coalesce::Sample light {10000, 5000, 5000, us};
+
+	/* QD1 keeps every completion interrupting, however fast */
+	for (unsigned i = 0; i < 10; i++)
+		CHECK(!policy.update(qd1));
+	CHECK(policy.level() == Coalesce::Off && policy.changes == 0);
+	CHECK(policy.iops == 200000 && policy.depth100 == 100);
+
+	/* Raised only once the load lasts upSamples samples */
+	for (unsigned i = 1; i < config.upSamples; i++) {
+		CHECK(!policy.update(deep));
+		CHECK(policy.level() == Coalesce::Off);
+	}
+	CHECK(policy.update(deep));
+	CHECK(policy.level() == Coalesce::Heavy);
+	CHECK(policy.setting().dword11() == (15 | 2 << 8));
+	CHECK(!policy.update(deep));
+
+	/* Lowered right away */
+	CHECK(policy.update(qd1));
+	CHECK(policy.level() == Coalesce::Off);
+
+	/* A sample asking for less restarts the count */
+	CHECK(!policy.update(light));
+	CHECK(!policy.update(qd1));
+	CHECK(!policy.update(light));
+	CHECK(policy.update(light));
+	CHECK(policy.level() == Coalesce::Light);
+	CHECK(policy.update(qd1));
+	CHECK(policy.changes == 4);
+
+	/* Empty samples and ones without bursts or time do not divide by zero */
+	CHECK(!policy.update({0, 0, 0, 0}));
+	CHECK(policy.iops == 0 && policy.depth100 == 0 && policy.level() == Coalesce::Off);
+	CHECK(!policy.update({5, 0, 0, 0}));
+	CHECK(policy.iops == 5000000 && policy.interruptRate == 0 && policy.depth100 == 500);
+	CHECK(!policy.update({0, 10, 0, us}));
+	CHECK(policy.level() == Coalesce::Off);
+}
+
+/* Stores `value` as the little-endian 128-bit counter of the SMART log */
+void setLe128(uint8_t* bytes, uint64_t value) {
+	memset(bytes, 0, 16);
+	for (unsigned i = 0; i < sizeof(value); i++)
+		bytes[i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+/* SMART / Health log snapshots published by changed fields, with rates from data units */
+void testHealthTracker() {
+	constexpr uint64_t second {1000000};
+	static NVMe::nvme_smart_log log;
+	memset(&log, 0, sizeof(log));
+	log.temperature[0] = 310 & 0xff;
+	log.temperature[1] = 310 >> 8;
+	log.percent_used = 3;
+	setLe128(log.data_units_read, 100000);
+	setLe128(log.data_units_written, 50000);
+
+	/* Everything is new in the first snapshot, and there is no rate yet */
+	Health::Tracker tracker;
+	CHECK(tracker.update(log, 10 * second) == Health::AllFields);
+	CHECK(tracker.counters().temperatureK == 310);
+	CHECK(tracker.counters().unitsRead == 100000 && tracker.counters().unitsWritten == 50000);
+	CHECK(tracker.counters().readRate == 0 && tracker.counters().writeRate == 0);
+
+	/* Reads advance, writes do not, so their rate stays 0 and is not published again */
+	setLe128(log.data_units_read, 102000);
+	CHECK(tracker.update(log, 11 * second) == (Health::UnitsRead | Health::ReadRate));
+	CHECK(tracker.counters().readRate == 2000 * Health::dataUnitBytes);
+	CHECK(tracker.counters().writeRate == 0);
+
+	/* Same read rate is not a change, while writes start */
+	setLe128(log.data_units_read, 104000);
+	setLe128(log.data_units_written, 50500);
+	CHECK(tracker.update(log, 12 * second) ==
+		  (Health::UnitsRead | Health::UnitsWritten | Health::WriteRate));
+	CHECK(tracker.counters().writeRate == 500 * Health::dataUnitBytes);
+
+	/* Nothing advances, so the rates drop to 0 */
+	CHECK(tracker.update(log, 13 * second) == (Health::ReadRate | Health::WriteRate));
+	CHECK(tracker.update(log, 14 * second) == 0);
+
+	/* Other fields, and the high half of counters, which is ignored */
+	log.temperature[0] = 320 & 0xff;
+	log.percent_used = 4;
+	log.warning_temp_time = 1;
+	log.critical_comp_time = 2;
+	log.data_units_read[8] = 1;
+	CHECK(tracker.update(log, 15 * second) ==
+		  (Health::Temperature | Health::PercentUsed | Health::WarningTempTime | Health::CriticalCompTime));
+	CHECK(tracker.counters().unitsRead == 104000);
+
+	/* Counter going back, e.g. after a format, and a repeated timestamp, give no rate */
+	setLe128(log.data_units_read, 1000);
+	CHECK(tracker.update(log, 16 * second) == Health::UnitsRead);
+	CHECK(tracker.counters().readRate == 0);
+	setLe128(log.data_units_read, 2000);
+	CHECK(tracker.update(log, 16 * second) == Health::UnitsRead);
+	CHECK(tracker.counters().readRate == 0);
+	CHECK(tracker.samples == 8);
+}
+}
+
+int main() {
+	static const struct {
+		const char* name;
+		void (*run)();
+	} tests[] {
+		{"plan-tables", testPlanTables},
+		{"plan-saturation", testPlanSaturation},
+		{"plan-profiles", testPlanProfiles},
+		{"tuner-retune", testTunerRetune},
+		{"admin-queue", testAdminQueue},
+		{"hmb", testHMB},
+		{"arbitration-plan", testArbitrationPlan},
+		{"idle-governor", testIdleGovernor},
+		{"throughput-governor", testThroughputGovernor},
+		{"budget", testBudget},
+		{"coalesce-policy", testCoalescePolicy},
+		{"health-tracker", testHealthTracker},
+	};
+
+	for (auto& test : tests) {
+		auto before = failures;
+		test.run();
+		printf("%-24s %s\n", test.name, failures == before ? "ok" : "FAILED");
+	}
+
+	return failures ? 1 : 0;
+}